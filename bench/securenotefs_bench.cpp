@@ -0,0 +1,318 @@
+/*
+Responsibilities of securenotefs_bench:
+
+Microbenchmarks for the layers every FUSE callback goes through, so block
+sizes can be chosen from numbers and regressions show up before release:
+
+    Path translation (utils::backing_path / relative_path)
+    Per-block integrity check throughput by block size
+    Snapshot reads with the verified-block map hit and missed
+    Open-file table lookups hit and missed, block range locks
+    Concurrent fdatasyncs of one file sharing syncs
+    getattr answered from the attribute cache against an lstat
+    Metrics recording
+    Log calls filtered out and buffered
+
+Run with --benchmark_format=json for machine-readable output.
+*/
+
+#include <benchmark/benchmark.h>
+
+#include <zlib.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "attr_cache.hpp"
+#include "checkpoint.hpp"
+#include "metrics.hpp"
+#include "open_file.hpp"
+#include "tar_manager.hpp"
+#include "utils.hpp"
+
+namespace {
+
+// A .snfs snapshot holding one file, built once and removed at exit
+struct SnapshotFixture {
+    static constexpr size_t FILE_SIZE = 16 << 20;
+
+    std::filesystem::path dir;
+    std::string snapshot;
+
+    SnapshotFixture()
+    {
+        char tmpl[] = "/tmp/securenotefs-bench-XXXXXX";
+        if (::mkdtemp(tmpl) == nullptr)
+            std::abort();
+        dir = tmpl;
+        std::filesystem::create_directory(dir / "data");
+        std::string bytes(FILE_SIZE, '\0');
+        for (size_t i = 0; i < bytes.size(); ++i)
+            bytes[i] = static_cast<char>(i * 131 + (i >> 12));
+        std::ofstream(dir / "data" / "note.bin", std::ios::binary) << bytes;
+        if (!tar_manager::create_timestamped((dir / "data").string(), snapshot))
+            std::abort();
+    }
+
+    ~SnapshotFixture()
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(dir, ec);
+    }
+};
+
+SnapshotFixture& fixture()
+{
+    static SnapshotFixture f;
+    return f;
+}
+
+std::string nested_path(int depth)
+{
+    std::string path;
+    for (int i = 0; i < depth; ++i)
+        path += "/folder" + std::to_string(i);
+    return path + "/note.md";
+}
+
+} // namespace
+
+static void BM_BackingPath(benchmark::State& state)
+{
+    utils::set_backing_root("/home/user/notes-vault/data");
+    std::string path = nested_path(static_cast<int>(state.range(0)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(utils::backing_path(path.c_str()));
+}
+BENCHMARK(BM_BackingPath)->Arg(1)->Arg(4)->Arg(16);
+
+static void BM_RelativePath(benchmark::State& state)
+{
+    std::string path = nested_path(static_cast<int>(state.range(0)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(utils::relative_path(path.c_str()));
+}
+BENCHMARK(BM_RelativePath)->Arg(1)->Arg(4)->Arg(16);
+
+// The check a snapshot read pays the first time it touches a block
+static void BM_BlockChecksum(benchmark::State& state)
+{
+    std::vector<unsigned char> block(static_cast<size_t>(state.range(0)), 0x5a);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(crc32(0, block.data(), static_cast<uInt>(block.size())));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK(BM_BlockChecksum)->RangeMultiplier(4)->Range(4 << 10, 1 << 20);
+
+// Every block already verified: a lookup in the verified map and a memcpy
+static void BM_SnapshotReadHit(benchmark::State& state)
+{
+    tar_manager::IndexedArchive archive;
+    if (!archive.open(fixture().snapshot)) {
+        state.SkipWithError("cannot open snapshot");
+        return;
+    }
+    const auto* f = archive.find("note.bin");
+    size_t size = static_cast<size_t>(state.range(0));
+    std::vector<char> buf(size);
+    archive.prefetch(*f, 0, f->entry.size);  // verify everything once
+
+    off_t off = 0;
+    for (auto _ : state) {
+        if (archive.read(*f, buf.data(), size, off) < 0)
+            state.SkipWithError("read failed");
+        off = (off + static_cast<off_t>(size)) % static_cast<off_t>(SnapshotFixture::FILE_SIZE);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK(BM_SnapshotReadHit)->RangeMultiplier(4)->Range(4 << 10, 1 << 20);
+
+// Freshly mounted snapshot: every block read is checksummed first
+static void BM_SnapshotReadMiss(benchmark::State& state)
+{
+    size_t size = static_cast<size_t>(state.range(0));
+    std::vector<char> buf(size);
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto archive = std::make_unique<tar_manager::IndexedArchive>();
+        if (!archive->open(fixture().snapshot)) {
+            state.SkipWithError("cannot open snapshot");
+            break;
+        }
+        const auto* f = archive->find("note.bin");
+        state.ResumeTiming();
+
+        if (archive->read(*f, buf.data(), size, 0) < 0)
+            state.SkipWithError("read failed");
+
+        state.PauseTiming();
+        archive.reset();
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK(BM_SnapshotReadMiss)->RangeMultiplier(4)->Range(4 << 10, 1 << 20);
+
+// Another handle already has the inode open: a hash probe and a refcount
+static void BM_InodeTableHit(benchmark::State& state)
+{
+    open_file::Table table;
+    struct stat st{};
+    st.st_dev = 1;
+    st.st_ino = 42;
+    open_file::Inode* held = table.acquire(st);
+    for (auto _ : state)
+        table.release(table.acquire(st));
+    table.release(held);
+}
+BENCHMARK(BM_InodeTableHit);
+
+// First open of the inode: allocate its state, free it on the last release
+static void BM_InodeTableMiss(benchmark::State& state)
+{
+    open_file::Table table;
+    struct stat st{};
+    st.st_dev = 1;
+    for (auto _ : state) {
+        ++st.st_ino;
+        table.release(table.acquire(st));
+    }
+}
+BENCHMARK(BM_InodeTableMiss);
+
+// Writers on disjoint blocks of one file, one per thread
+static void BM_RangeLock(benchmark::State& state)
+{
+    static open_file::Inode inode(1, 1);
+    uint64_t off = static_cast<uint64_t>(state.thread_index()) * open_file::LOCK_BLOCK_SIZE;
+    for (auto _ : state) {
+        open_file::Inode::Guard guard = inode.lock(off, 4096, true);
+        benchmark::DoNotOptimize(&guard);
+    }
+}
+BENCHMARK(BM_RangeLock)->Threads(1)->Threads(4)->Threads(8);
+
+// Threads writing and fdatasync'ing one file; syncs_per_call shows how many
+// of the calls shared a sync
+static void BM_InodeSync(benchmark::State& state)
+{
+    static int fd = ::open((fixture().dir / "sync.bin").c_str(), O_RDWR | O_CREAT, 0600);
+    static open_file::Inode inode(1, 2);
+    uint64_t before = metrics::counter(metrics::Counter::Syncs);
+    off_t off = static_cast<off_t>(state.thread_index()) * 4096;
+    char block[4096] = {};
+    for (auto _ : state) {
+        if (::pwrite(fd, block, sizeof(block), off) != static_cast<ssize_t>(sizeof(block)) ||
+            inode.sync(fd, true) != 0)
+            state.SkipWithError("write or sync failed");
+    }
+    if (state.thread_index() == 0)
+        state.counters["syncs_per_call"] = benchmark::Counter(
+            static_cast<double>(metrics::counter(metrics::Counter::Syncs) - before) /
+            static_cast<double>(state.iterations() * state.threads()));
+}
+BENCHMARK(BM_InodeSync)->Threads(1)->Threads(4)->Threads(16)->UseRealTime();
+
+// getattr on hot files: threads looking up their own paths in the sharded
+// attribute cache, against the lstat it saves
+static void BM_AttrCacheHit(benchmark::State& state)
+{
+    static attr_cache::Cache* cache = [] {
+        auto* c = new attr_cache::Cache;
+        for (int i = 0; i < 64; ++i) {
+            std::string rel = "notes/file" + std::to_string(i) + ".md";
+            struct stat st {};
+            st.st_ino = static_cast<ino_t>(i + 1);
+            st.st_mode = S_IFREG | 0600;
+            st.st_nlink = 1;
+            c->fill(rel, st, {});
+            c->fill(rel, st, c->ticket(rel));
+        }
+        return c;
+    }();
+    std::string rel = "notes/file" + std::to_string(state.thread_index() % 64) + ".md";
+    struct stat st;
+    for (auto _ : state)
+        if (!cache->get(rel, st))
+            state.SkipWithError("miss");
+}
+BENCHMARK(BM_AttrCacheHit)->Threads(1)->Threads(4)->Threads(16);
+
+static void BM_Lstat(benchmark::State& state)
+{
+    std::string path = (fixture().dir / "sync.bin").string();
+    ::close(::open(path.c_str(), O_RDWR | O_CREAT, 0600));
+    struct stat st;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(::lstat(path.c_str(), &st));
+}
+BENCHMARK(BM_Lstat);
+
+// Every sn_write marks its file dirty; threads writing different files
+// should not queue behind one lock
+static void BM_CheckpointMark(benchmark::State& state)
+{
+    static checkpoint::Checkpointer* checkpoints = [] {
+        auto* c = new checkpoint::Checkpointer;
+        checkpoint::Config config;
+        config.dirty_bytes = 0;
+        c->setup(fixture().dir.string(), {}, config, nullptr, nullptr, false);
+        return c;
+    }();
+    std::string rel = "notes/file" + std::to_string(state.thread_index()) + ".md";
+    for (auto _ : state)
+        checkpoints->mark(rel, 4096);
+}
+BENCHMARK(BM_CheckpointMark)->Threads(1)->Threads(4)->Threads(16);
+
+static void BM_MetricsRecord(benchmark::State& state)
+{
+    uint64_t ns = 1000;
+    for (auto _ : state)
+        metrics::record(metrics::Op::Read, ns++);
+}
+BENCHMARK(BM_MetricsRecord)->Threads(1)->Threads(8);
+
+static void BM_MetricsScope(benchmark::State& state)
+{
+    for (auto _ : state) {
+        metrics::Scope timing(metrics::Op::Getattr);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_MetricsScope);
+
+// What a callback pays for a record below the runtime threshold
+static void BM_LogFiltered(benchmark::State& state)
+{
+    utils::set_log_level(utils::LogLevel::Error);
+    for (auto _ : state)
+        SN_LOG_INFO("bench", "read %d", 4096);
+    utils::set_log_level(utils::LogLevel::Info);
+}
+BENCHMARK(BM_LogFiltered);
+
+// A record that is kept: format it and append it to the thread's buffer
+static void BM_LogBuffered(benchmark::State& state)
+{
+    static utils::Logger* logger = [] {
+        auto* l = new utils::Logger;
+        l->open("/dev/null");
+        l->start();
+        return l;
+    }();
+    (void) logger;
+    for (auto _ : state)
+        SN_LOG_INFO("bench", "read %d", 4096);
+}
+BENCHMARK(BM_LogBuffered)->Threads(1)->Threads(8);
+
+BENCHMARK_MAIN();
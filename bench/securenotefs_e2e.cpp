@@ -0,0 +1,503 @@
+/*
+Responsibilities of securenotefs_e2e:
+
+Mount securenotefs on a scratch directory and run scripted workloads through
+the mount, then run the same workloads on a plain directory next to data/,
+so the overhead of the filesystem layer can be tracked over time:
+
+    create_storm    many small files created and written
+    seq_write       one large file written in 1 MiB chunks, then fsync'd
+    seq_read        the same file read back in 1 MiB chunks
+    random_read_4k  4 KiB preads at random offsets of that file
+    ls_lR           recursive readdir + lstat of a tree of 100k files
+    churn           checkout-like rewrites, renames and replacements in it
+
+Each workload prints one JSON object per target ("fuse", "raw") and one
+comparing them, one per line on stdout. Progress goes to stderr. Needs only
+/dev/fuse and fusermount3.
+
+Usage: securenotefs_e2e [--binary=PATH] [--dir=PATH] [--scale=F]
+                        [--only=NAME,...] [--with-checkpoints]
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+// CMake points this at the securenotefs it built
+#ifndef SECURENOTEFS_BINARY
+#define SECURENOTEFS_BINARY "./securenotefs"
+#endif
+
+struct Options {
+    std::string binary = SECURENOTEFS_BINARY;
+    std::string dir = fs::temp_directory_path().string();
+    double scale = 1.0;
+    std::vector<std::string> only;
+    bool checkpoints = false;
+};
+
+// Workload sizes at --scale=1
+constexpr size_t SMALL_FILES = 10000;
+constexpr size_t SMALL_FILE_SIZE = 1024;
+constexpr uint64_t LARGE_FILE_SIZE = 256ull << 20;
+constexpr size_t CHUNK = 1 << 20;
+constexpr size_t RANDOM_READS = 20000;
+constexpr size_t TREE_FILES = 100000;
+constexpr size_t FILES_PER_DIR = 100;
+
+// Timings of one workload on one target
+struct Result {
+    uint64_t ops = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    std::vector<double> latencies_us;
+};
+
+[[noreturn]] void fail(const std::string& what)
+{
+    throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Time one operation into r
+template <typename Fn>
+void timed(Result& r, Fn&& fn)
+{
+    auto start = clock_type::now();
+    fn();
+    r.latencies_us.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - start).count());
+    ++r.ops;
+}
+
+void write_file(const std::string& path, const std::string& contents, int flags = O_CREAT | O_WRONLY | O_TRUNC)
+{
+    int fd = ::open(path.c_str(), flags, 0644);
+    if (fd == -1)
+        fail("open " + path);
+    if (::write(fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()))
+        fail("write " + path);
+    if (::close(fd) == -1)
+        fail("close " + path);
+}
+
+std::string tree_path(const std::string& root, size_t i)
+{
+    return root + "/d" + std::to_string(i / FILES_PER_DIR) + "/f" + std::to_string(i);
+}
+
+void make_dirs(const std::string& root, size_t files)
+{
+    fs::create_directories(root);
+    for (size_t d = 0; d * FILES_PER_DIR < files; ++d)
+        if (::mkdir((root + "/d" + std::to_string(d)).c_str(), 0755) == -1 && errno != EEXIST)
+            fail("mkdir " + root);
+}
+
+// ---- workloads ------------------------------------------------------------
+
+void create_storm(const std::string& root, const Options& opt, Result& r)
+{
+    size_t files = static_cast<size_t>(SMALL_FILES * opt.scale);
+    std::string contents(SMALL_FILE_SIZE, 'n');
+    make_dirs(root + "/storm", files);
+    for (size_t i = 0; i < files; ++i) {
+        timed(r, [&] { write_file(tree_path(root + "/storm", i), contents, O_CREAT | O_EXCL | O_WRONLY); });
+        r.bytes += contents.size();
+    }
+}
+
+uint64_t large_size(const Options& opt)
+{
+    return std::max<uint64_t>(CHUNK, static_cast<uint64_t>(static_cast<double>(LARGE_FILE_SIZE) * opt.scale)) /
+           CHUNK * CHUNK;
+}
+
+void seq_write(const std::string& root, const Options& opt, Result& r)
+{
+    std::string path = root + "/large.bin";
+    std::vector<char> chunk(CHUNK);
+    for (size_t i = 0; i < chunk.size(); ++i)
+        chunk[i] = static_cast<char>(i * 7);
+    int fd = ::open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd == -1)
+        fail("open " + path);
+    for (uint64_t off = 0; off < large_size(opt); off += CHUNK) {
+        timed(r, [&] {
+            if (::pwrite(fd, chunk.data(), chunk.size(), static_cast<off_t>(off)) != static_cast<ssize_t>(CHUNK))
+                fail("pwrite " + path);
+        });
+        r.bytes += CHUNK;
+    }
+    timed(r, [&] {
+        if (::fsync(fd) == -1)
+            fail("fsync " + path);
+    });
+    ::close(fd);
+}
+
+// Untimed setup: the file seq_read and random_read_4k read
+void ensure_large(const std::string& root, const Options& opt)
+{
+    if (fs::exists(root + "/large.bin"))
+        return;
+    Result ignored;
+    seq_write(root, opt, ignored);
+}
+
+void seq_read(const std::string& root, const Options& opt, Result& r)
+{
+    std::string path = root + "/large.bin";
+    std::vector<char> chunk(CHUNK);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        fail("open " + path);
+    for (uint64_t off = 0; off < large_size(opt); off += CHUNK) {
+        timed(r, [&] {
+            if (::pread(fd, chunk.data(), chunk.size(), static_cast<off_t>(off)) != static_cast<ssize_t>(CHUNK))
+                fail("pread " + path);
+        });
+        r.bytes += CHUNK;
+    }
+    ::close(fd);
+}
+
+void random_read_4k(const std::string& root, const Options& opt, Result& r)
+{
+    std::string path = root + "/large.bin";
+    char buf[4096];
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        fail("open " + path);
+    std::mt19937_64 rng(42);
+    uint64_t blocks = large_size(opt) / sizeof(buf);
+    size_t reads = std::max<size_t>(1, static_cast<size_t>(RANDOM_READS * opt.scale));
+    for (size_t i = 0; i < reads; ++i) {
+        off_t off = static_cast<off_t>(rng() % blocks * sizeof(buf));
+        timed(r, [&] {
+            if (::pread(fd, buf, sizeof(buf), off) != static_cast<ssize_t>(sizeof(buf)))
+                fail("pread " + path);
+        });
+        r.bytes += sizeof(buf);
+    }
+    ::close(fd);
+}
+
+size_t tree_files(const Options& opt)
+{
+    return std::max<size_t>(1, static_cast<size_t>(TREE_FILES * opt.scale));
+}
+
+// Untimed setup: the tree ls_lR and churn run over
+void ensure_tree(const std::string& root, const Options& opt)
+{
+    if (fs::exists(root + "/tree"))
+        return;
+    size_t files = tree_files(opt);
+    make_dirs(root + "/tree", files);
+    for (size_t i = 0; i < files; ++i)
+        write_file(tree_path(root + "/tree", i), "# note " + std::to_string(i) + "\n");
+}
+
+void walk(const std::string& dir, Result& r)
+{
+    DIR* dp;
+    timed(r, [&] {
+        if ((dp = ::opendir(dir.c_str())) == nullptr)
+            fail("opendir " + dir);
+    });
+    std::vector<std::string> subdirs;
+    while (true) {
+        struct dirent* de;
+        timed(r, [&] { de = ::readdir(dp); });
+        if (de == nullptr)
+            break;
+        if (std::strcmp(de->d_name, ".") == 0 || std::strcmp(de->d_name, "..") == 0)
+            continue;
+        std::string path = dir + "/" + de->d_name;
+        struct stat st;
+        timed(r, [&] {
+            if (::lstat(path.c_str(), &st) == -1)
+                fail("lstat " + path);
+        });
+        if (S_ISDIR(st.st_mode))
+            subdirs.push_back(path);
+    }
+    ::closedir(dp);
+    for (const auto& d : subdirs)
+        walk(d, r);
+}
+
+void ls_lR(const std::string& root, const Options& opt, Result& r)
+{
+    (void) opt;
+    walk(root + "/tree", r);
+}
+
+// Like switching branches: a tenth of the files rewritten, a twentieth moved,
+// a twentieth deleted and recreated
+void churn(const std::string& root, const Options& opt, Result& r)
+{
+    size_t files = tree_files(opt);
+    std::mt19937_64 rng(7);
+    std::string contents(4096, 'c');
+    for (size_t n = 0; n < files / 5; ++n) {
+        size_t i = rng() % files;
+        std::string path = tree_path(root + "/tree", i);
+        switch (n % 4) {
+        case 0:
+        case 1:
+            timed(r, [&] { write_file(path, contents); });
+            r.bytes += contents.size();
+            break;
+        case 2:
+            timed(r, [&] {
+                std::string to = path + ".moved";
+                if (::rename(path.c_str(), to.c_str()) == -1 && errno != ENOENT)
+                    fail("rename " + path);
+                if (::rename(to.c_str(), path.c_str()) == -1 && errno != ENOENT)
+                    fail("rename " + to);
+            });
+            break;
+        case 3:
+            timed(r, [&] {
+                if (::unlink(path.c_str()) == -1 && errno != ENOENT)
+                    fail("unlink " + path);
+                write_file(path, contents, O_CREAT | O_EXCL | O_WRONLY);
+            });
+            r.bytes += contents.size();
+            break;
+        }
+    }
+}
+
+struct Workload {
+    const char* name;
+    std::function<void(const std::string&, const Options&)> setup;
+    std::function<void(const std::string&, const Options&, Result&)> run;
+};
+
+// ---- mounting -------------------------------------------------------------
+
+bool mounted(const std::string& mountpoint)
+{
+    struct stat mnt, parent;
+    return ::stat(mountpoint.c_str(), &mnt) == 0 &&
+           ::stat((mountpoint + "/..").c_str(), &parent) == 0 && mnt.st_dev != parent.st_dev;
+}
+
+int run_command(std::vector<std::string> args, const std::string& cwd)
+{
+    pid_t pid = ::fork();
+    if (pid == -1)
+        fail("fork");
+    if (pid == 0) {
+        // Keep the child's chatter out of the JSON on stdout
+        if (::dup2(STDERR_FILENO, STDOUT_FILENO) == -1 || ::chdir(cwd.c_str()) == -1)
+            _exit(127);
+        std::vector<char*> argv;
+        for (auto& a : args)
+            argv.push_back(a.data());
+        argv.push_back(nullptr);
+        ::execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    int status;
+    while (::waitpid(pid, &status, 0) == -1)
+        if (errno != EINTR)
+            fail("waitpid");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// securenotefs mounts notes/ over data/ in its working directory and
+// daemonizes once mounted
+void mount(const std::string& work, const Options& opt)
+{
+    std::vector<std::string> args{opt.binary};
+    if (!opt.checkpoints) {
+        args.push_back("--checkpoint-interval=0");
+        args.push_back("--checkpoint-dirty-mb=0");
+    }
+    if (run_command(args, work) != 0)
+        throw std::runtime_error("cannot start " + opt.binary);
+    for (int i = 0; i < 100 && !mounted(work + "/notes"); ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (!mounted(work + "/notes"))
+        throw std::runtime_error("notes/ did not get mounted");
+}
+
+// Unmount and wait for the daemon to write its final snapshot and remove
+// data/, which it does last
+void unmount(const std::string& work)
+{
+    if (!mounted(work + "/notes"))
+        return;
+    if (run_command({"fusermount3", "-u", work + "/notes"}, work) != 0)
+        std::fprintf(stderr, "warning: fusermount3 -u %s/notes failed\n", work.c_str());
+    for (int i = 0; i < 600 && fs::exists(work + "/data"); ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+// ---- output ---------------------------------------------------------------
+
+double percentile(std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[rank];
+}
+
+void print_result(const char* workload, const char* target, Result& r)
+{
+    std::sort(r.latencies_us.begin(), r.latencies_us.end());
+    double secs = r.seconds > 0 ? r.seconds : 1e-9;
+    std::printf("{\"workload\":\"%s\",\"target\":\"%s\",\"ops\":%llu,\"bytes\":%llu,\"seconds\":%.6f,"
+                "\"ops_per_sec\":%.1f,\"mib_per_sec\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+                workload, target, static_cast<unsigned long long>(r.ops),
+                static_cast<unsigned long long>(r.bytes), r.seconds, static_cast<double>(r.ops) / secs,
+                static_cast<double>(r.bytes) / (1 << 20) / secs, percentile(r.latencies_us, 0.5),
+                percentile(r.latencies_us, 0.99), r.latencies_us.empty() ? 0.0 : r.latencies_us.back());
+    std::fflush(stdout);
+}
+
+void print_overhead(const char* workload, Result& fuse, Result& raw)
+{
+    auto ratio = [](double a, double b) { return b > 0 ? a / b : 0.0; };
+    std::printf("{\"workload\":\"%s\",\"target\":\"overhead\",\"time_ratio\":%.3f,\"p50_ratio\":%.3f,"
+                "\"p99_ratio\":%.3f}\n",
+                workload, ratio(fuse.seconds, raw.seconds),
+                ratio(percentile(fuse.latencies_us, 0.5), percentile(raw.latencies_us, 0.5)),
+                ratio(percentile(fuse.latencies_us, 0.99), percentile(raw.latencies_us, 0.99)));
+    std::fflush(stdout);
+}
+
+Result measure(const Workload& w, const std::string& root, const Options& opt)
+{
+    if (w.setup)
+        w.setup(root, opt);
+    Result r;
+    auto start = clock_type::now();
+    w.run(root, opt, r);
+    r.seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    return r;
+}
+
+Options parse_options(int argc, char** argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        auto value = [&](std::string_view name) { return std::string(arg.substr(name.size())); };
+        if (arg.starts_with("--binary="))
+            opt.binary = value("--binary=");
+        else if (arg.starts_with("--dir="))
+            opt.dir = value("--dir=");
+        else if (arg.starts_with("--scale="))
+            opt.scale = std::stod(value("--scale="));
+        else if (arg.starts_with("--only=")) {
+            std::string list = value("--only=");
+            for (size_t pos = 0; pos <= list.size();) {
+                size_t comma = std::min(list.find(',', pos), list.size());
+                opt.only.push_back(list.substr(pos, comma - pos));
+                pos = comma + 1;
+            }
+        } else if (arg == "--with-checkpoints")
+            opt.checkpoints = true;
+        else
+            throw std::runtime_error("unknown option " + std::string(arg));
+    }
+    // The daemon runs from the scratch directory
+    opt.binary = fs::absolute(opt.binary).string();
+    return opt;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    try {
+        opt = parse_options(argc, argv);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "securenotefs_e2e: %s\n", e.what());
+        return 2;
+    }
+
+    std::string tmpl = opt.dir + "/securenotefs-e2e-XXXXXX";
+    if (::mkdtemp(tmpl.data()) == nullptr) {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    std::string work = tmpl;
+    std::string mnt = work + "/notes";
+    std::string raw = work + "/raw";
+
+    const std::vector<Workload> workloads = {
+        {"create_storm", nullptr, create_storm},
+        {"seq_write", nullptr, seq_write},
+        {"seq_read", ensure_large, seq_read},
+        {"random_read_4k", ensure_large, random_read_4k},
+        {"ls_lR", ensure_tree, ls_lR},
+        {"churn", ensure_tree, churn},
+    };
+    auto selected = [&](const Workload& w) {
+        return opt.only.empty() || std::find(opt.only.begin(), opt.only.end(), w.name) != opt.only.end();
+    };
+
+    int status = 0;
+    try {
+        fs::create_directory(raw);
+        mount(work, opt);
+        for (const auto& w : workloads) {
+            if (!selected(w))
+                continue;
+            std::fprintf(stderr, "%s...\n", w.name);
+            Result on_fuse = measure(w, mnt, opt);
+            Result on_raw = measure(w, raw, opt);
+            print_result(w.name, "fuse", on_fuse);
+            print_result(w.name, "raw", on_raw);
+            print_overhead(w.name, on_fuse, on_raw);
+        }
+        // Leave nothing for the final snapshot to pack
+        for (const auto& entry : fs::directory_iterator(mnt))
+            fs::remove_all(entry.path());
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "securenotefs_e2e: %s\n", e.what());
+        status = 1;
+    }
+
+    try {
+        unmount(work);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "securenotefs_e2e: %s\n", e.what());
+        status = 1;
+    }
+    std::error_code ec;
+    if (!mounted(mnt))
+        fs::remove_all(work, ec);
+    else
+        std::fprintf(stderr, "securenotefs_e2e: %s still mounted, leaving it\n", mnt.c_str());
+    return status;
+}
@@ -0,0 +1,191 @@
+/*
+Responsibilities of attr_cache:
+
+Answer getattr and access for files in data/ from memory, keyed by backing
+inode so every name of a file sees the same attributes.
+
+Never serve attributes older than the last change a callback made: each
+change moves the inode to a new generation, and an lstat only stores its
+result if the generation it started under is still current.
+*/
+
+#include "attr_cache.hpp"
+
+#include <algorithm>
+#include <functional>
+
+namespace attr_cache {
+
+Cache::PathShard& Cache::path_shard(const std::string& rel)
+{
+    return paths_[std::hash<std::string>()(rel) % SHARDS];
+}
+
+Cache::InodeShard& Cache::inode_shard(const Key& key)
+{
+    return inodes_[KeyHash()(key) % SHARDS];
+}
+
+bool Cache::lookup(const std::string& rel, Key& key)
+{
+    PathShard& s = path_shard(rel);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.paths.find(rel);
+    if (it == s.paths.end())
+        return false;
+    key = it->second;
+    return true;
+}
+
+void Cache::bump(const Key& key)
+{
+    InodeShard& s = inode_shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.inodes.find(key);
+    if (it == s.inodes.end())
+        return;
+    it->second.generation = ++s.next_generation;
+    it->second.valid = false;
+}
+
+bool Cache::get(const std::string& rel, struct stat& out)
+{
+    Key key;
+    if (!lookup(rel, key))
+        return false;
+    InodeShard& s = inode_shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.inodes.find(key);
+    if (it == s.inodes.end() || !it->second.valid)
+        return false;
+    if (ttl_ != clock::duration::zero() && clock::now() - it->second.at > ttl_) {
+        it->second.valid = false;
+        return false;
+    }
+    out = it->second.st;
+    return true;
+}
+
+Cache::Ticket Cache::ticket(const std::string& rel)
+{
+    Ticket t;
+    Key key;
+    if (!lookup(rel, key))
+        return t;
+    InodeShard& s = inode_shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.inodes.find(key);
+    if (it == s.inodes.end()) {
+        while (s.inodes.size() >= shard_limit_)
+            s.inodes.erase(s.inodes.begin());
+        it = s.inodes.emplace(key, Attrs()).first;
+        it->second.generation = ++s.next_generation;
+    }
+    t.known = true;
+    t.dev = key.dev;
+    t.ino = key.ino;
+    t.generation = it->second.generation;
+    return t;
+}
+
+void Cache::fill(const std::string& rel, const struct stat& st, const Ticket& ticket)
+{
+    Key key{st.st_dev, st.st_ino};
+    if (!ticket.known || ticket.dev != key.dev || ticket.ino != key.ino) {
+        map(rel, key.dev, key.ino);
+        return;
+    }
+
+    // Other names of a hard-linked file change its link count without
+    // passing through rel, so only its first lookups are answered
+    if (!S_ISDIR(st.st_mode) && st.st_nlink > 1)
+        return;
+
+    InodeShard& s = inode_shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.inodes.find(key);
+    if (it == s.inodes.end() || it->second.generation != ticket.generation)
+        return;
+    it->second.st = st;
+    it->second.valid = true;
+    it->second.at = clock::now();
+}
+
+void Cache::map(const std::string& rel, dev_t dev, ino_t ino)
+{
+    PathShard& s = path_shard(rel);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.paths.count(rel) == 0)
+        while (s.paths.size() >= shard_limit_)
+            s.paths.erase(s.paths.begin());
+    s.paths.insert_or_assign(rel, Key{dev, ino});
+}
+
+void Cache::changed(const std::string& rel)
+{
+    Key key;
+    if (lookup(rel, key))
+        bump(key);
+}
+
+void Cache::parent_changed(const std::string& rel)
+{
+    size_t slash = rel.rfind('/');
+    changed(slash == std::string::npos ? std::string() : rel.substr(0, slash));
+}
+
+void Cache::forget(const std::string& rel)
+{
+    PathShard& s = path_shard(rel);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.paths.erase(rel);
+}
+
+void Cache::forget_tree(const std::string& rel)
+{
+    std::string prefix = rel + "/";
+    for (auto& s : paths_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (auto it = s.paths.begin(); it != s.paths.end();) {
+            if (rel.empty() || it->first == rel || it->first.starts_with(prefix))
+                it = s.paths.erase(it);
+            else
+                ++it;
+        }
+    }
+}
+
+size_t Cache::size()
+{
+    size_t n = 0;
+    for (auto& s : inodes_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (const auto& [key, attrs] : s.inodes)
+            n += attrs.valid ? 1 : 0;
+    }
+    return n;
+}
+
+size_t Cache::capacity()
+{
+    return shard_limit_ * SHARDS;
+}
+
+void Cache::set_capacity(size_t entries)
+{
+    size_t limit = std::max<size_t>(1, (entries + SHARDS - 1) / SHARDS);
+    shard_limit_ = limit;
+    for (auto& s : paths_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        while (s.paths.size() > limit)
+            s.paths.erase(s.paths.begin());
+    }
+    // Generations stay unique: next_generation is per shard, not per entry
+    for (auto& s : inodes_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        while (s.inodes.size() > limit)
+            s.inodes.erase(s.inodes.begin());
+    }
+}
+
+} // namespace attr_cache
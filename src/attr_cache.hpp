@@ -0,0 +1,120 @@
+#ifndef SECURENOTEFS_ATTR_CACHE_HPP
+#define SECURENOTEFS_ATTR_CACHE_HPP
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace attr_cache {
+
+// stat(2) results for files in data/, so getattr and access on hot files
+// skip the lstat. Two sharded maps: path -> backing inode, filled by every
+// lookup, readdirplus and create, and inode -> attributes with a
+// generation. Callbacks that change a file bump its generation, which
+// drops the attributes and makes any lstat that was already in flight fail
+// to store its now stale result.
+//
+// Attributes are stored from a path's second lookup on: the first only
+// learns which inode to read a generation from before the lstat.
+class Cache {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // What a lookup saw before its lstat, passed back to fill()
+    struct Ticket {
+        bool known = false;  // path was mapped, so inode/generation are set
+        dev_t dev = 0;
+        ino_t ino = 0;
+        uint64_t generation = 0;
+    };
+
+    // Attributes are trusted for ttl, or until invalidated when ttl is zero
+    explicit Cache(clock::duration ttl = clock::duration::zero()) : ttl_(ttl) {}
+    Cache(const Cache&) = delete;
+    Cache& operator=(const Cache&) = delete;
+
+    // Cached attributes of rel; false on a miss
+    bool get(const std::string& rel, struct stat& out);
+
+    // Take before the lstat of rel that follows a miss
+    Ticket ticket(const std::string& rel);
+
+    // Record what the lstat of rel returned
+    void fill(const std::string& rel, const struct stat& st, const Ticket& ticket);
+
+    // Note which inode rel names, e.g. from a directory listing
+    void map(const std::string& rel, dev_t dev, ino_t ino);
+
+    // Callbacks changed the file at rel
+    void changed(const std::string& rel);
+
+    // A name was added to or removed from the directory holding rel
+    void parent_changed(const std::string& rel);
+
+    // rel, or rel and everything below it, no longer names the same file
+    void forget(const std::string& rel);
+    void forget_tree(const std::string& rel);
+
+    // Inodes with attributes in memory
+    size_t size();
+
+    // Paths, and inodes, kept before the oldest ones are dropped; lowering
+    // it drops the excess at once
+    size_t capacity();
+    void set_capacity(size_t entries);
+
+private:
+    static constexpr size_t SHARDS = 16;
+
+    struct Key {
+        dev_t dev;
+        ino_t ino;
+        bool operator==(const Key&) const = default;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const
+        {
+            return std::hash<uint64_t>()(static_cast<uint64_t>(k.ino) * 31 + static_cast<uint64_t>(k.dev));
+        }
+    };
+
+    struct Attrs {
+        uint64_t generation = 0;
+        bool valid = false;
+        struct stat st {};
+        clock::time_point at;
+    };
+
+    struct PathShard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Key> paths;
+    };
+
+    struct InodeShard {
+        std::mutex mutex;
+        uint64_t next_generation = 0;  // never reused, even after eviction
+        std::unordered_map<Key, Attrs, KeyHash> inodes;
+    };
+
+    PathShard& path_shard(const std::string& rel);
+    InodeShard& inode_shard(const Key& key);
+
+    bool lookup(const std::string& rel, Key& key);
+    void bump(const Key& key);
+
+    clock::duration ttl_;
+    std::atomic<size_t> shard_limit_{8192};
+    PathShard paths_[SHARDS];
+    InodeShard inodes_[SHARDS];
+};
+
+} // namespace attr_cache
+
+#endif // SECURENOTEFS_ATTR_CACHE_HPP
@@ -0,0 +1,317 @@
+/*
+Responsibilities of checkpoint:
+
+Collect the paths FUSE callbacks create, modify or remove under data/.
+
+On a worker thread, every interval or once enough bytes are dirty, write them
+out as a tar_manager delta snapshot, reading data/ no faster than the I/O
+budget allows. Compact the chain into one full snapshot once it gets long,
+keeping only the newest keep_full of the full snapshots it replaces.
+
+On unmount, flush() writes the final delta synchronously.
+
+With a journal, start a new segment at each checkpoint and drop the older
+ones once it is on disk, so the journal only ever holds what the newest
+snapshot may be missing.
+*/
+
+#include "checkpoint.hpp"
+#include "journal.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.hpp"
+
+namespace checkpoint {
+
+Checkpointer::~Checkpointer()
+{
+    stop();
+}
+
+void Checkpointer::setup(const std::string& dataDir, std::vector<std::string> chain, const Config& config,
+                         tar_manager::LazySnapshot* lazy, tar_manager::Restore* restore, bool full_first)
+{
+    data_dir_ = dataDir;
+    chain_ = std::move(chain);
+    config_ = config;
+    dirty_limit_ = config.dirty_bytes;
+    lazy_ = lazy;
+    restore_ = restore;
+    need_full_ = full_first || restore != nullptr;
+}
+
+void Checkpointer::use_journal(journal::Journal* journal, const std::vector<tar_manager::Change>& recovered)
+{
+    journal_ = journal;
+    std::map<std::string, tar_manager::Change> changes;
+    for (const auto& c : recovered) {
+        // Journaled ahead of a change the crash cut off; a delta entry for
+        // a path missing from data/ would hide the snapshot's copy
+        struct stat st;
+        std::string real = data_dir_ + "/" + c.path;
+        if (!c.removed && ::lstat(real.c_str(), &st) == -1 && lazy_ != nullptr &&
+            lazy_->archived(c.path) != nullptr)
+            continue;
+        changes[c.path] = c;
+    }
+    restore_changes(changes);
+}
+
+Config Checkpointer::config()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return config_;
+}
+
+void Checkpointer::set_config(const Config& config)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        config_ = config;
+        dirty_limit_ = config.dirty_bytes;
+    }
+    // Re-arm the timer and re-check the dirty threshold
+    cv_.notify_one();
+}
+
+void Checkpointer::start()
+{
+    // Started even with both triggers off, in case set_config() turns one on
+    worker_ = std::thread(&Checkpointer::run, this);
+}
+
+void Checkpointer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (worker_.joinable())
+        worker_.join();
+}
+
+Checkpointer::Shard& Checkpointer::shard(const std::string& rel)
+{
+    return shards_[std::hash<std::string>()(rel) % SHARDS];
+}
+
+bool Checkpointer::dirty()
+{
+    for (auto& s : shards_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (!s.changes.empty())
+            return true;
+    }
+    return false;
+}
+
+void Checkpointer::mark(const std::string& rel, uint64_t bytes)
+{
+    {
+        Shard& s = shard(rel);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.changes[rel].path = rel;
+    }
+    if (bytes == 0)
+        return;
+    uint64_t limit = dirty_limit_.load(std::memory_order_relaxed);
+    uint64_t before = dirty_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    // Only the write that crosses the threshold wakes the worker; taking
+    // mutex_ keeps the wakeup from landing between its check and its wait
+    if (limit != 0 && before < limit && before + bytes >= limit) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cv_.notify_one();
+    }
+}
+
+void Checkpointer::mark_removed(const std::string& rel)
+{
+    Shard& s = shard(rel);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto& c = s.changes[rel];
+    c.path = rel;
+    c.removed = true;
+}
+
+void Checkpointer::mark_tree(const std::string& rel)
+{
+    Shard& s = shard(rel);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto& c = s.changes[rel];
+    c.path = rel;
+    c.tree = true;
+}
+
+void Checkpointer::run()
+{
+    using clock = std::chrono::steady_clock;
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto last = clock::now();
+    while (!stopping_) {
+        unsigned interval = config_.interval_sec;
+        auto due = [&] {
+            return stopping_ || (config_.dirty_bytes != 0 && dirty_bytes_ >= config_.dirty_bytes);
+        };
+        auto woken = [&] { return due() || config_.interval_sec != interval; };
+        bool early = true;
+        if (interval == 0)
+            cv_.wait(lock, woken);
+        else
+            early = cv_.wait_until(lock, last + std::chrono::seconds(interval), woken);
+        if (stopping_)
+            break;
+        if (early && !due())
+            continue;  // the interval changed; wait again with the new one
+        last = clock::now();
+        if (!dirty())
+            continue;
+
+        uint64_t io_budget = config_.io_budget;
+        lock.unlock();
+        tar_manager::Throttle throttle(io_budget);
+        std::string written;
+        checkpoint(&throttle, nullptr, written);
+        lock.lock();
+    }
+}
+
+bool Checkpointer::flush(std::string& written, tar_manager::Progress* progress)
+{
+    return checkpoint(nullptr, progress, written);
+}
+
+void Checkpointer::cancel()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+    if (active_ != nullptr)
+        active_->cancelled = true;
+}
+
+void Checkpointer::restore_changes(const std::map<std::string, tar_manager::Change>& changes)
+{
+    for (const auto& [rel, c] : changes) {
+        Shard& s = shard(rel);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto& cur = s.changes[rel];
+        cur.path = rel;
+        cur.removed = cur.removed || c.removed;
+        cur.tree = cur.tree || c.tree;
+    }
+}
+
+void Checkpointer::prune(const std::string& full, size_t keep)
+{
+    std::string newest = std::filesystem::path(full).filename().string();
+    std::vector<std::string> older;
+    for (auto& path : tar_manager::find_full(std::filesystem::path(full).parent_path().string()))
+        if (std::filesystem::path(path).filename().string() < newest)
+            older.push_back(std::move(path));
+    // Oldest first; a mounted one stays mapped until unmount
+    for (size_t i = 0; i + keep < older.size(); ++i) {
+        ::unlink(older[i].c_str());
+        SN_LOG_INFO("checkpoint", "removed superseded snapshot %s", older[i].c_str());
+    }
+}
+
+bool Checkpointer::checkpoint(tar_manager::Throttle* throttle, tar_manager::Progress* progress,
+                              std::string& written)
+{
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+    written.clear();
+
+    // The writer is handed a Progress even when nobody watches, so cancel()
+    // has something to flag
+    tar_manager::Progress own;
+    if (progress == nullptr)
+        progress = &own;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (cancelled_)
+            return false;
+        active_ = progress;
+    }
+    struct Inactive {
+        Checkpointer* self;
+        ~Inactive()
+        {
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            self->active_ = nullptr;
+        }
+    } inactive{this};
+
+    // Before taking the changes: anything journaled from here on is marked
+    // too late for this checkpoint and must stay in the journal. A change
+    // journaled earlier but marked after the swap below is still in segment
+    // and so survives this checkpoint's retire().
+    uint64_t segment = journal_ != nullptr ? journal_->rotate() : 0;
+
+    std::map<std::string, tar_manager::Change> changes;
+    size_t max_chain, keep_full;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_chain = config_.max_chain;
+        keep_full = config_.keep_full;
+    }
+    dirty_bytes_ = 0;
+    for (auto& s : shards_) {
+        std::map<std::string, tar_manager::Change> taken;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            taken.swap(s.changes);
+        }
+        changes.merge(taken);
+    }
+    if (changes.empty() && !need_full_) {
+        if (journal_ != nullptr)
+            journal_->retire(segment);
+        return true;
+    }
+
+    // Files changed while being copied are marked again and land in the next one
+    bool full = need_full_ || chain_.empty() || chain_.size() > max_chain;
+    bool ok;
+    if (full) {
+        if (lazy_ == nullptr && restore_ != nullptr && !restore_->wait_all()) {
+            restore_changes(changes);
+            return false;
+        }
+        ok = tar_manager::create_timestamped(data_dir_, written, tar_manager::Format::Indexed, lazy_, throttle,
+                                             progress);
+    } else {
+        std::vector<tar_manager::Change> list;
+        for (auto& [rel, c] : changes)
+            list.push_back(std::move(c));
+        ok = tar_manager::create_delta(data_dir_, chain_.back(), list, written, throttle, progress);
+    }
+    if (!ok) {
+        restore_changes(changes);
+        written.clear();
+        return false;
+    }
+
+    if (full) {
+        // The deltas are folded into the new snapshot; older full ones stay
+        // as history, up to keep_full of them
+        for (size_t i = 1; i < chain_.size(); ++i)
+            ::unlink(chain_[i].c_str());
+        chain_.assign(1, written);
+        need_full_ = false;
+        prune(written, keep_full);
+    } else {
+        chain_.push_back(written);
+    }
+    if (journal_ != nullptr)
+        journal_->retire(segment);
+    return true;
+}
+
+} // namespace checkpoint
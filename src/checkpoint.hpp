@@ -0,0 +1,120 @@
+#ifndef SECURENOTEFS_CHECKPOINT_HPP
+#define SECURENOTEFS_CHECKPOINT_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tar_manager.hpp"
+
+namespace journal { class Journal; }
+
+namespace checkpoint {
+
+// When and how fast background checkpoints run
+struct Config {
+    unsigned interval_sec = 60;          // 0 turns the periodic timer off
+    uint64_t dirty_bytes = 64ull << 20;  // checkpoint early once this much was written
+    uint64_t io_budget = 32ull << 20;    // bytes/sec a background checkpoint may read
+    size_t max_chain = 16;               // deltas allowed before compacting the chain
+    size_t keep_full = 1;                // older full snapshots kept once compacted away
+};
+
+// Records what callbacks change under data/ and writes it out as a delta
+// snapshot on a worker thread, on a timer or once enough data is dirty. The
+// packaging cost is spread over the session, so unmount only has to write
+// whatever changed since the last checkpoint.
+class Checkpointer {
+public:
+    Checkpointer() = default;
+    Checkpointer(const Checkpointer&) = delete;
+    Checkpointer& operator=(const Checkpointer&) = delete;
+    ~Checkpointer();
+
+    // chain is the snapshot chain the session was mounted from, full snapshot
+    // first. lazy (if mounted in place) supplies files never copied to data/;
+    // restore (if unpacking a tarball) must finish before the first snapshot.
+    // full_first forces a full first snapshot, for when data/ held files at
+    // startup that no snapshot in chain knows about.
+    void setup(const std::string& dataDir, std::vector<std::string> chain, const Config& config,
+               tar_manager::LazySnapshot* lazy, tar_manager::Restore* restore, bool full_first);
+
+    // Rotate journal with every checkpoint and retire what each one covers.
+    // recovered are the changes a crashed session journaled; they are
+    // dirty from the start, in place of a full first snapshot.
+    void use_journal(journal::Journal* journal, const std::vector<tar_manager::Change>& recovered);
+
+    // Current settings, and new ones that apply from the next wakeup on
+    Config config();
+    void set_config(const Config& config);
+
+    // Start the worker; call after FUSE has daemonized
+    void start();
+
+    // Stop the worker, letting a checkpoint in progress finish
+    void stop();
+
+    // rel was created or modified; bytes counts toward the dirty threshold
+    void mark(const std::string& rel, uint64_t bytes = 0);
+
+    // rel and everything below it went away
+    void mark_removed(const std::string& rel);
+
+    // rel is a directory whose whole contents are new (e.g. renamed into place)
+    void mark_tree(const std::string& rel);
+
+    // Write out everything still dirty, unthrottled. written is the new
+    // snapshot, or empty when nothing changed since the last one.
+    bool flush(std::string& written, tar_manager::Progress* progress = nullptr);
+
+    // Make the checkpoint in progress, and every later one, fail. Their
+    // changes stay marked and journaled. Safe to call from any thread.
+    void cancel();
+
+private:
+    static constexpr size_t SHARDS = 16;
+
+    // Paths marked since the last checkpoint, sharded by path so callbacks
+    // marking different files do not contend
+    struct Shard {
+        std::mutex mutex;
+        std::map<std::string, tar_manager::Change> changes;
+    };
+
+    Shard& shard(const std::string& rel);
+    bool dirty();
+    void run();
+    bool checkpoint(tar_manager::Throttle* throttle, tar_manager::Progress* progress, std::string& written);
+    void restore_changes(const std::map<std::string, tar_manager::Change>& changes);
+    void prune(const std::string& full, size_t keep);
+
+    std::string data_dir_;
+    tar_manager::LazySnapshot* lazy_ = nullptr;
+    tar_manager::Restore* restore_ = nullptr;
+    journal::Journal* journal_ = nullptr;
+
+    std::mutex write_mutex_;              // one snapshot writer at a time
+    std::vector<std::string> chain_;      // guarded by write_mutex_
+    bool need_full_ = false;              // guarded by write_mutex_
+
+    Shard shards_[SHARDS];
+    std::atomic<uint64_t> dirty_bytes_{0};
+    std::atomic<uint64_t> dirty_limit_{0};  // config_.dirty_bytes, for mark()
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    Config config_;
+    bool stopping_ = false;
+    bool cancelled_ = false;
+    tar_manager::Progress* active_ = nullptr;  // of the snapshot being written
+    std::thread worker_;
+};
+
+} // namespace checkpoint
+
+#endif // SECURENOTEFS_CHECKPOINT_HPP
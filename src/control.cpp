@@ -0,0 +1,80 @@
+/*
+Responsibilities of control:
+
+Hold the named tuning knobs fs serves as files under notes/.securenotefs/,
+so settings fixed at startup (readahead window, worker counts, checkpoint
+triggers, FUSE cache timeouts) can be read and changed under live load.
+
+Parse the values written to them.
+*/
+
+#include "control.hpp"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <utility>
+
+namespace control {
+
+namespace {
+
+// Strip the newline echo appends, and any other trailing blanks
+std::string trimmed(const std::string& text)
+{
+    size_t end = text.find_last_not_of(" \t\r\n");
+    return end == std::string::npos ? std::string() : text.substr(0, end + 1);
+}
+
+} // namespace
+
+void Panel::add(Knob knob)
+{
+    knobs_.push_back(std::move(knob));
+}
+
+const Knob* Panel::find(const std::string& name) const
+{
+    for (const auto& k : knobs_)
+        if (k.name == name)
+            return &k;
+    return nullptr;
+}
+
+bool parse_uint(const std::string& text, uint64_t& out)
+{
+    std::string value = trimmed(text);
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    errno = 0;
+    out = std::strtoull(value.c_str(), nullptr, 10);
+    return errno == 0;
+}
+
+bool parse_seconds(const std::string& text, double& out)
+{
+    std::string value = trimmed(text);
+    if (value.empty() || value.find_first_not_of("0123456789.") != std::string::npos)
+        return false;
+    char* end = nullptr;
+    out = std::strtod(value.c_str(), &end);
+    return *end == '\0' && std::isfinite(out);
+}
+
+Knob uint_knob(std::string name, std::function<uint64_t()> get, std::function<void(uint64_t)> set,
+               uint64_t max)
+{
+    Knob k;
+    k.name = std::move(name);
+    k.get = [get] { return std::to_string(get()) + '\n'; };
+    k.set = [set, max](const std::string& text) {
+        uint64_t value;
+        if (!parse_uint(text, value) || value > max)
+            return -EINVAL;
+        set(value);
+        return 0;
+    };
+    return k;
+}
+
+} // namespace control
@@ -0,0 +1,49 @@
+#ifndef SECURENOTEFS_CONTROL_HPP
+#define SECURENOTEFS_CONTROL_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace control {
+
+// One file in the mount's control directory
+struct Knob {
+    std::string name;
+    // Current value as served to readers, newline-terminated
+    std::function<std::string()> get;
+    // Parse and apply a written value: 0, or -errno such as -EINVAL.
+    // Empty for read-only files.
+    std::function<int(const std::string&)> set;
+};
+
+// The files of the control directory. Filled in once by sn_init before FUSE
+// serves any request, and only read afterwards, so lookups take no lock;
+// each knob synchronizes with whatever it tunes.
+class Panel {
+public:
+    void add(Knob knob);
+
+    // Knob called name, or nullptr
+    const Knob* find(const std::string& name) const;
+
+    const std::vector<Knob>& knobs() const { return knobs_; }
+
+private:
+    std::vector<Knob> knobs_;
+};
+
+// Value written by `echo N > file`: digits, optionally followed by whitespace
+bool parse_uint(const std::string& text, uint64_t& out);
+
+// Non-negative decimal number, e.g. a timeout in seconds
+bool parse_seconds(const std::string& text, double& out);
+
+// Read-write knob over an unsigned value; writes above max are rejected
+Knob uint_knob(std::string name, std::function<uint64_t()> get, std::function<void(uint64_t)> set,
+               uint64_t max = UINT64_MAX);
+
+} // namespace control
+
+#endif // SECURENOTEFS_CONTROL_HPP
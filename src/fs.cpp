@@ -52,12 +52,528 @@ In each callback (getattr, readdir, open, read, write, cleanup):
  #ifdef HAVE_SETXATTR
  #include <sys/xattr.h>
  #endif
+ #ifdef HAVE_COPY_FILE_RANGE
+ #include <sys/ioctl.h>
+ #include <linux/fs.h>
+ #endif
  
+ #include <algorithm>
+ #include <atomic>
+ #include <set>
+ #include <string>
+ #include <vector>
  #include "utils.hpp" //Previously passthrough_helpers.h
- 
+ #include "tar_manager.hpp"
+ #include "checkpoint.hpp"
+ #include "prefetch.hpp"
+ #include "open_file.hpp"
+ #include "metrics.hpp"
+ #include "control.hpp"
+ #include "trace.hpp"
+ #include "journal.hpp"
+ #include "xattr.hpp"
+ #include "negative_cache.hpp"
+ #include "attr_cache.hpp"
+
+ static sn_context *sn_ctx()
+ {
+     return static_cast<sn_context *>(fuse_get_context()->private_data);
+ }
+
+ /* The handle sn_open/sn_create stored in fi->fh */
+ static open_file::Handle *sn_fh(struct fuse_file_info *fi)
+ {
+     return open_file::Handle::from_fh(fi->fh);
+ }
+
+ /* Table open handles share per-inode state through, if any */
+ static open_file::Table *sn_files()
+ {
+     sn_context *ctx = sn_ctx();
+     return ctx != NULL ? ctx->files : NULL;
+ }
+
+ /* truncate(2) by path, ordered against writes through open handles to
+    the blocks from size on */
+ static int sn_truncate_path(const std::string &real, off_t size)
+ {
+     open_file::Table *files = sn_files();
+     struct stat st;
+     if (files == NULL || lstat(real.c_str(), &st) == -1)
+         return truncate(real.c_str(), size);
+
+     int res;
+     open_file::Inode *inode = files->acquire(st);
+     {
+         open_file::Inode::Guard guard = inode->lock_from(size, true);
+         res = truncate(real.c_str(), size);
+     }
+     int saved = errno;
+     files->release(inode);
+     errno = saved;
+     return res;
+ }
+
+ /* Hidden directory at the mount root for the filesystem's own files: the
+    stats report and the tuning knobs of ctx->control. It only exists in
+    the mount, never in data/ or a snapshot. */
+ static const char SN_INTERNAL_DIR[] = "/.securenotefs";
+
+ static bool sn_internal(const char *path)
+ {
+     size_t len = sizeof(SN_INTERNAL_DIR) - 1;
+     return strncmp(path, SN_INTERNAL_DIR, len) == 0 &&
+            (path[len] == '\0' || path[len] == '/');
+ }
+
+ /* Knob served as a file under SN_INTERNAL_DIR, or NULL */
+ static const control::Knob *sn_knob(const char *path)
+ {
+     sn_context *ctx = sn_ctx();
+     size_t len = sizeof(SN_INTERNAL_DIR) - 1;
+     if (ctx == NULL || ctx->control == NULL || path[len] != '/')
+         return NULL;
+     return ctx->control->find(path + len + 1);
+ }
+
+ /* Attributes of a path under SN_INTERNAL_DIR. Files report size 0 and are
+    opened direct_io, like /proc, as their contents are made when opened. */
+ static int sn_internal_stat(const char *path, struct stat *st)
+ {
+     memset(st, 0, sizeof(*st));
+     st->st_uid = getuid();
+     st->st_gid = getgid();
+     if (strcmp(path, SN_INTERNAL_DIR) == 0) {
+         st->st_mode = S_IFDIR | 0755;
+         st->st_nlink = 2;
+         return 0;
+     }
+     const control::Knob *knob = sn_knob(path);
+     if (knob == NULL)
+         return -ENOENT;
+     st->st_mode = S_IFREG | (knob->set ? 0644 : 0444);
+     st->st_nlink = 1;
+     return 0;
+ }
+
+ /* Knob over one of the FUSE cache timeouts, in seconds. libfuse reads its
+    fuse_config on every reply, so a change applies from the next lookup. */
+ static control::Knob sn_timeout_knob(const char *name, double *field)
+ {
+     control::Knob k;
+     k.name = name;
+     k.get = [field] {
+         char text[32];
+         snprintf(text, sizeof(text), "%g\n", std::atomic_ref<double>(*field).load());
+         return std::string(text);
+     };
+     k.set = [field](const std::string &text) {
+         double secs;
+         if (!control::parse_seconds(text, secs))
+             return -EINVAL;
+         std::atomic_ref<double>(*field).store(secs);
+         return 0;
+     };
+     return k;
+ }
+
+ /* Everything that can be tuned without remounting */
+ static void sn_add_controls(sn_context *ctx, struct fuse_config *cfg)
+ {
+     control::Panel *panel = ctx->control;
+
+     panel->add({"stats", [] { return metrics::report(); }, {}});
+     panel->add({"trace.json", [] { return trace::chrome_json(); }, {}});
+     panel->add(control::uint_knob("trace",
+         [] { return trace::enabled() ? 1 : 0; },
+         [](uint64_t on) { trace::set_enabled(on != 0); }, 1));
+     panel->add({"log_level",
+         [] { return std::string(utils::name(utils::log_level())) + "\n"; },
+         [](const std::string &text) {
+             utils::LogLevel level;
+             if (!utils::parse_log_level(text, level))
+                 return -EINVAL;
+             utils::set_log_level(level);
+             return 0;
+         }});
+
+     if (ctx->prefetcher != NULL) {
+         prefetch::Prefetcher *p = ctx->prefetcher;
+         panel->add(control::uint_knob("readahead_kb",
+             [p] { return p->max_window() >> 10; },
+             [p](uint64_t kb) { p->set_max_window(kb << 10); }, UINT64_MAX >> 10));
+         panel->add(control::uint_knob("prefetch_workers",
+             [p] { return p->workers(); },
+             [p](uint64_t n) { p->set_workers(static_cast<unsigned>(n)); }, 64));
+         panel->add(control::uint_knob("prefetch_queue_depth",
+             [p] { return p->queue_limit(); },
+             [p](uint64_t n) { p->set_queue_limit(n); }));
+     }
+
+     if (ctx->checkpoints != NULL) {
+         checkpoint::Checkpointer *c = ctx->checkpoints;
+         panel->add(control::uint_knob("checkpoint_interval",
+             [c] { return c->config().interval_sec; },
+             [c](uint64_t secs) {
+                 checkpoint::Config config = c->config();
+                 config.interval_sec = static_cast<unsigned>(secs);
+                 c->set_config(config);
+             }, UINT32_MAX));
+         panel->add(control::uint_knob("checkpoint_dirty_mb",
+             [c] { return c->config().dirty_bytes >> 20; },
+             [c](uint64_t mb) {
+                 checkpoint::Config config = c->config();
+                 config.dirty_bytes = mb << 20;
+                 c->set_config(config);
+             }, UINT64_MAX >> 20));
+         panel->add(control::uint_knob("checkpoint_io_mbps",
+             [c] { return c->config().io_budget >> 20; },
+             [c](uint64_t mb) {
+                 checkpoint::Config config = c->config();
+                 config.io_budget = mb << 20;
+                 c->set_config(config);
+             }, UINT64_MAX >> 20));
+         panel->add(control::uint_knob("checkpoint_keep_full",
+             [c] { return c->config().keep_full; },
+             [c](uint64_t n) {
+                 checkpoint::Config config = c->config();
+                 config.keep_full = static_cast<size_t>(n);
+                 c->set_config(config);
+             }));
+     }
+
+     if (ctx->negatives != NULL) {
+         negative_cache::Cache *n = ctx->negatives;
+         panel->add(control::uint_knob("negative_cache_entries",
+             [n] { return n->capacity(); },
+             [n](uint64_t entries) { n->set_capacity(entries); }, UINT32_MAX));
+     }
+     if (ctx->attrs != NULL) {
+         attr_cache::Cache *a = ctx->attrs;
+         panel->add(control::uint_knob("attr_cache_entries",
+             [a] { return a->capacity(); },
+             [a](uint64_t entries) { a->set_capacity(entries); }, UINT32_MAX));
+     }
+     if (ctx->xattrs != NULL) {
+         xattr::Cache *x = ctx->xattrs;
+         panel->add(control::uint_knob("xattr_cache_files",
+             [x] { return x->capacity(); },
+             [x](uint64_t files) { x->set_capacity(files); }, UINT32_MAX));
+     }
+
+     panel->add(sn_timeout_knob("entry_timeout", &cfg->entry_timeout));
+     panel->add(sn_timeout_knob("attr_timeout", &cfg->attr_timeout));
+     panel->add(sn_timeout_knob("negative_timeout", &cfg->negative_timeout));
+ }
+
+ /* Backing inode number of an open file for traces, or 0 */
+ static uint64_t sn_ino(open_file::Handle *fh)
+ {
+     return fh->inode() != NULL ? fh->inode()->ino() : 0;
+ }
+
+ /* Backing fd of an open file, or -1 when there is none to use */
+ static int sn_fd(struct fuse_file_info *fi)
+ {
+     return fi != NULL ? sn_fh(fi)->fd() : -1;
+ }
+
+ /* Fetch ahead of a sequential reader. Snapshot blocks are paged in and
+    checksummed on a prefetch thread; for files in data/ the kernel is asked
+    to start reading the window, which does not block. */
+ static void sn_readahead(open_file::Handle *fh, off_t offset, size_t size)
+ {
+     sn_context *ctx = sn_ctx();
+     if (ctx == NULL || ctx->prefetcher == NULL)
+         return;
+
+     const tar_manager::IndexedArchive::File *archived = fh->archived();
+     uint64_t file_size = archived != NULL ? archived->entry.size : UINT64_MAX;
+     prefetch::Window w = fh->readahead().on_read(offset, size, file_size,
+                                                  ctx->prefetcher->max_window());
+     if (w.length == 0)
+         return;
+     ++fh->stats().prefetches;
+     metrics::add(metrics::Counter::Prefetches);
+     if (archived != NULL) {
+         tar_manager::LazySnapshot *snapshot = ctx->snapshot;
+         ctx->prefetcher->submit([snapshot, archived, w] {
+             snapshot->prefetch(*archived, w.offset, w.length);
+         });
+     } else {
+         posix_fadvise(fh->fd(), w.offset, w.length, POSIX_FADV_WILLNEED);
+     }
+ }
+
+ /* Snapshot entry a read-only caller can be served from without data/ */
+ static const tar_manager::IndexedArchive::File *sn_archived(const char *path)
+ {
+     sn_context *ctx = sn_ctx();
+     if (ctx == NULL || ctx->snapshot == NULL)
+         return NULL;
+     return ctx->snapshot->archived(utils::relative_path(path));
+ }
+
+ /* A handle served from the snapshot whose file has since been copied into
+    data/, say by a writer opening it, has to read that copy from now on.
+    Only looks again once some file was copied. If the copy is gone from
+    path, the snapshot still holds what the file had. */
+ static void sn_follow_restore(open_file::Handle *fh, const char *path)
+ {
+     sn_context *ctx = sn_ctx();
+     if (fh->archived() == NULL || path == NULL || ctx == NULL || ctx->snapshot == NULL)
+         return;
+     uint64_t restores = ctx->snapshot->restores();
+     if (fh->restores_seen() == restores)
+         return;
+     if (!ctx->snapshot->restored(fh->archived())) {
+         fh->set_restores_seen(restores);
+         return;
+     }
+     int fd = open(utils::backing_path(path).c_str(), O_RDONLY);
+     if (fd != -1)
+         fh->restored(fd, sn_files());
+     else
+         fh->set_restores_seen(restores);
+ }
+
+ /* Block until a snapshot restore in progress has written path into data/.
+    With subtree set, wait for everything below a directory as well. */
+ static int sn_restored(const char *path, bool subtree = false)
+ {
+     sn_context *ctx = sn_ctx();
+     if (ctx == NULL || ctx->restore == NULL)
+         return 0;
+
+     std::string rel = utils::relative_path(path);
+     bool ok = subtree ? ctx->restore->wait_tree(rel) : ctx->restore->wait_for(rel);
+     if (!ok)
+         SN_LOG_WARN("fs", "restore of %s failed", rel.c_str());
+     return ok ? 0 : -EIO;
+ }
+
+ /* Forget a not-yet-restored file that is being deleted or replaced */
+ static bool sn_discard(const char *path)
+ {
+     sn_context *ctx = sn_ctx();
+     return ctx != NULL && ctx->restore != NULL &&
+            ctx->restore->discard(utils::relative_path(path));
+ }
+
+ /* sn_discard() for a callback that can still fail after deciding to
+    replace path: sn_hold() keeps it from being restored meanwhile, and
+    sn_release() drops it only if it was replaced */
+ static bool sn_hold(const char *path)
+ {
+     sn_context *ctx = sn_ctx();
+     return ctx != NULL && ctx->restore != NULL &&
+            ctx->restore->hold(utils::relative_path(path));
+ }
+
+ static void sn_release(const char *path, bool replaced)
+ {
+     sn_ctx()->restore->release(utils::relative_path(path), replaced);
+ }
+
+ /* Durably record that paths are about to change, before they do, so that
+    after a crash the next mount knows what to snapshot. Callbacks arriving
+    together share one fdatasync. */
+ static int sn_journal(const std::vector<tar_manager::Change> &changes)
+ {
+     sn_context *ctx = sn_ctx();
+     if (ctx == NULL || ctx->journal == NULL)
+         return 0;
+     return ctx->journal->log(changes) != 0 ? 0 : -EIO;
+ }
+
+ static int sn_journal(const char *path, bool removed = false)
+ {
+     tar_manager::Change c;
+     c.path = utils::relative_path(path);
+     c.removed = removed;
+     return sn_journal(std::vector<tar_manager::Change>{c});
+ }
+
+ /* sn_journal() for data written through a handle: only its first write in
+    each journal segment waits for a record */
+ static int sn_journal_write(open_file::Handle *fh, const char *path)
+ {
+     sn_context *ctx = sn_ctx();
+     if (ctx == NULL || ctx->journal == NULL || fh->journaled() == ctx->journal->segment())
+         return 0;
+     tar_manager::Change c;
+     c.path = utils::relative_path(path);
+     uint64_t segment = ctx->journal->log(c);
+     if (segment == 0)
+         return -EIO;
+     fh->set_journaled(segment);
+     return 0;
+ }
+
+ /* Attributes of files in data/ looked up before, or NULL */
+ static attr_cache::Cache *sn_attrs()
+ {
+     sn_context *ctx = sn_ctx();
+     return ctx != NULL ? ctx->attrs : NULL;
+ }
+
+ /* Tell the background checkpointer a callback created or modified path,
+    and drop what the attribute cache knows about it */
+ static void sn_changed(const char *path, uint64_t bytes = 0)
+ {
+     sn_context *ctx = sn_ctx();
+     if (ctx != NULL && ctx->attrs != NULL)
+         ctx->attrs->changed(utils::relative_path(path));
+     if (ctx != NULL && ctx->checkpoints != NULL)
+         ctx->checkpoints->mark(utils::relative_path(path), bytes);
+ }
+
+ static void sn_removed(const char *path)
+ {
+     sn_context *ctx = sn_ctx();
+     if (ctx != NULL && ctx->attrs != NULL) {
+         ctx->attrs->forget(utils::relative_path(path));
+         ctx->attrs->parent_changed(utils::relative_path(path));
+     }
+     if (ctx != NULL && ctx->checkpoints != NULL)
+         ctx->checkpoints->mark_removed(utils::relative_path(path));
+ }
+
+ static void sn_moved(const char *from, const char *to)
+ {
+     sn_context *ctx = sn_ctx();
+     if (ctx != NULL && ctx->checkpoints != NULL) {
+         ctx->checkpoints->mark_removed(utils::relative_path(from));
+         ctx->checkpoints->mark_tree(utils::relative_path(to));
+     }
+ }
+
+ /* Drop cached attributes once path names another file, or nothing */
+ static void sn_forget_xattrs(const char *path, bool subtree = false)
+ {
+     sn_context *ctx = sn_ctx();
+     if (ctx == NULL || ctx->xattrs == NULL)
+         return;
+     std::string rel = utils::relative_path(path);
+     if (subtree)
+         ctx->xattrs->forget_tree(rel);
+     else
+         ctx->xattrs->forget(rel);
+ }
+
+ /* Paths known to be missing from data/, or NULL */
+ static negative_cache::Cache *sn_negatives()
+ {
+     sn_context *ctx = sn_ctx();
+     return ctx != NULL ? ctx->negatives : NULL;
+ }
+
+ /* A callback created path; called after it exists */
+ static void sn_created(const char *path)
+ {
+     negative_cache::Cache *negatives = sn_negatives();
+     if (negatives != NULL)
+         negatives->forget(utils::relative_path(path));
+     attr_cache::Cache *attrs = sn_attrs();
+     if (attrs != NULL)
+         attrs->parent_changed(utils::relative_path(path));
+ }
+
+ /* Manifest entry for a path whose contents have not been restored yet */
+ static bool sn_pending(const char *path, tar_manager::Entry &e)
+ {
+     sn_context *ctx = sn_ctx();
+     return ctx != NULL && ctx->restore != NULL &&
+            ctx->restore->pending_entry(utils::relative_path(path), e);
+ }
+
+ /* sn_restored() for a caller about to truncate path to size: a file still
+    in the snapshot has only the bytes that survive copied into data/, so
+    truncating to zero costs nothing however large the file was. Call it
+    last: the rest of the file is gone even if the caller then fails. */
+ static int sn_restored_truncated(const char *path, off_t size)
+ {
+     sn_context *ctx = sn_ctx();
+     tar_manager::Entry e;
+     if (ctx == NULL || ctx->restore == NULL || size < 0 || !sn_pending(path, e))
+         return sn_restored(path);
+     /* The truncation itself would fail and must not lose anything */
+     if (!(e.mode & S_IWUSR) && geteuid() != 0)
+         return sn_restored(path);
+
+     std::string rel = utils::relative_path(path);
+     if (!ctx->restore->wait_truncated(rel, static_cast<uint64_t>(size))) {
+         SN_LOG_WARN("fs", "restore of %s failed", rel.c_str());
+         return -EIO;
+     }
+     return 0;
+ }
+
+ /* open(2) of path in data/ for sn_open and sn_create. With O_TRUNC, a file
+    still in the snapshot is restored empty, as in sn_restored_truncated(),
+    but only once the backing file is open: an open that fails must leave
+    the file whole. The fd or -errno. */
+ static int sn_open_backing(const char *path, int flags, mode_t mode)
+ {
+     sn_context *ctx = sn_ctx();
+     std::string real = utils::backing_path(path);
+     tar_manager::Entry e;
+     int fd;
+
+     /* O_EXCL fails on a file that exists and must leave it whole */
+     bool cut = (flags & (O_TRUNC | O_EXCL)) == O_TRUNC && (flags & O_ACCMODE) != O_RDONLY &&
+                sn_pending(path, e) && e.type == '0' && ((e.mode & S_IWUSR) || geteuid() == 0);
+     if (!cut) {
+         int res = sn_restored(path);
+         if (res != 0)
+             return res;
+         fd = open(real.c_str(), flags, mode);
+         return fd == -1 ? -errno : fd;
+     }
+
+     /* Not in data/ yet: the restore below writes the inode opened here,
+        unless a concurrent one got there first */
+     bool created = true;
+     fd = open(real.c_str(), (flags & ~O_TRUNC) | O_CREAT | O_EXCL, 0600);
+     if (fd == -1 && errno == EEXIST) {
+         created = false;
+         fd = open(real.c_str(), flags & ~(O_TRUNC | O_CREAT));
+     }
+     if (fd == -1)
+         return -errno;
+     std::string rel = utils::relative_path(path);
+     /* ftruncate covers a concurrent restore that copied it whole first */
+     if (!ctx->restore->wait_truncated(rel, 0) || ftruncate(fd, 0) == -1) {
+         SN_LOG_WARN("fs", "restore of %s failed", rel.c_str());
+         /* An empty file left in data/ would hide the snapshot copy */
+         if (created && sn_pending(path, e))
+             unlink(real.c_str());
+         close(fd);
+         return -EIO;
+     }
+     return fd;
+ }
+
+ static void sn_entry_stat(const tar_manager::Entry &e, struct stat *st)
+ {
+     memset(st, 0, sizeof(*st));
+     st->st_mode = e.mode | (e.type == '2' ? S_IFLNK : S_IFREG);
+     st->st_nlink = 1;
+     st->st_uid = getuid();
+     st->st_gid = getgid();
+     st->st_size = e.type == '2' ? e.link.size() : e.size;
+     st->st_blocks = (st->st_size + 511) / 512;
+     st->st_mtim.tv_sec = e.mtime;
+     st->st_ctim = st->st_mtim;
+     st->st_atim = st->st_mtim;
+ }
+
  extern "C" {
 
     int fill_dir_plus = 0;
+
+    /* Seconds the kernel caches failed lookups for in sole-owner mode */
+    static const double SN_NEGATIVE_TIMEOUT = 5.0;
     
     void *sn_init(struct fuse_conn_info *conn,
                 struct fuse_config *cfg)
@@ -71,6 +587,8 @@ In each callback (getattr, readdir, open, read, write, cleanup):
             in xmp_create() or xmp_open(). */
         // cfg->direct_io = 1;
             cfg->parallel_direct_writes = 1;
+        /* Concurrent writes to one file are ordered per block range by
+            open_file::Inode::lock(), not by a per-file lock */
     
         /* Pick up changes from lower filesystem right away. This is
             also necessary for better hardlink support. When the kernel
@@ -79,33 +597,136 @@ In each callback (getattr, readdir, open, read, write, cleanup):
             the cache of the associated inode - resulting in an
             incorrect st_nlink value being reported for any remaining
             hardlinks to this inode. */
+        sn_context *ctx = sn_ctx();
         if (!cfg->auto_cache) {
             cfg->entry_timeout = 0;
             cfg->attr_timeout = 0;
             cfg->negative_timeout = 0;
         }
-    
-        return NULL;
+        /* Missing names have no inode to go stale, so when nothing but this
+            mount changes data/ the kernel may remember them: every creation
+            goes through a callback and the kernel drops the entry itself. */
+        if (ctx != NULL && ctx->sole_owner)
+            cfg->negative_timeout = SN_NEGATIVE_TIMEOUT;
+
+        /* FUSE has daemonized by now, so worker threads survive */
+        if (ctx != NULL && ctx->logger != NULL)
+            ctx->logger->start();
+        if (ctx != NULL && ctx->restore != NULL)
+            ctx->restore->start();
+        if (ctx != NULL && ctx->checkpoints != NULL)
+            ctx->checkpoints->start();
+        if (ctx != NULL && ctx->prefetcher != NULL)
+            ctx->prefetcher->start();
+        if (ctx != NULL && ctx->tracer != NULL)
+            ctx->tracer->start();
+        if (ctx != NULL && ctx->control != NULL)
+            sn_add_controls(ctx, cfg);
+        SN_LOG_INFO("fs", "mounted");
+    
+        return ctx;
     }
 
     int sn_getattr(const char *path, struct stat *stbuf,
                     struct fuse_file_info *fi)
     {
-        (void) fi;
+        metrics::Scope timing(metrics::Op::Getattr);
         int res;
-    
-        res = lstat(path, stbuf);
-        if (res == -1)
-            return -errno;
+        tar_manager::Entry pending;
+
+        if (sn_fd(fi) != -1) {
+            res = fstat(sn_fd(fi), stbuf);
+            return res == -1 ? -errno : 0;
+        }
+        if (sn_internal(path))
+            return sn_internal_stat(path, stbuf);
+
+        if (sn_pending(path, pending)) {
+            sn_entry_stat(pending, stbuf);
+            return 0;
+        }
+        if ((res = sn_restored(path)) != 0)
+            return res;
+
+        /* Probes for files that are not there come in bursts */
+        negative_cache::Cache *negatives = sn_negatives();
+        std::string rel = utils::relative_path(path);
+        if (negatives != NULL && negatives->missing(rel)) {
+            metrics::add(metrics::Counter::NegativeHits);
+            return -ENOENT;
+        }
+        uint64_t generation = negatives != NULL ? negatives->generation(rel) : 0;
+
+        /* Hot files are answered without an lstat */
+        attr_cache::Cache *attrs = sn_attrs();
+        attr_cache::Cache::Ticket ticket;
+        if (attrs != NULL) {
+            if (attrs->get(rel, *stbuf)) {
+                metrics::add(metrics::Counter::AttrHits);
+                return 0;
+            }
+            ticket = attrs->ticket(rel);
+        }
+
+        std::string real = utils::backing_path(path);
+        res = lstat(real.c_str(), stbuf);
+        if (res == -1) {
+            res = -errno;
+            if (res == -ENOENT && negatives != NULL)
+                negatives->add(rel, generation);
+            return res;
+        }
+        if (attrs != NULL)
+            attrs->fill(rel, *stbuf, ticket);
     
         return 0;
     }
     
     int sn_access(const char *path, int mask)
     {
+        metrics::Scope timing(metrics::Op::Access);
         int res;
-    
-        res = access(path, mask);
+        tar_manager::Entry pending;
+
+        if (sn_internal(path)) {
+            struct stat st;
+            if ((res = sn_internal_stat(path, &st)) != 0)
+                return res;
+            return ((mask & W_OK) && !(st.st_mode & S_IWUSR)) ? -EACCES : 0;
+        }
+
+        /* Everything restored is owned by us, so the owner bits decide */
+        if (sn_pending(path, pending)) {
+            if (((mask & R_OK) && !(pending.mode & S_IRUSR)) ||
+                ((mask & W_OK) && !(pending.mode & S_IWUSR)) ||
+                ((mask & X_OK) && !(pending.mode & S_IXUSR)))
+                return -EACCES;
+            return 0;
+        }
+        if ((res = sn_restored(path)) != 0)
+            return res;
+        negative_cache::Cache *negatives = sn_negatives();
+        if (negatives != NULL && negatives->missing(utils::relative_path(path))) {
+            metrics::add(metrics::Counter::NegativeHits);
+            return -ENOENT;
+        }
+        /* access(2) checks our real uid, so for files we own the owner
+           bits of cached attributes give the same answer; root and other
+           owners take the syscall */
+        struct stat st;
+        attr_cache::Cache *attrs = sn_attrs();
+        if (attrs != NULL && getuid() != 0 && attrs->get(utils::relative_path(path), st) &&
+            st.st_uid == getuid()) {
+            metrics::add(metrics::Counter::AttrHits);
+            if (((mask & R_OK) && !(st.st_mode & S_IRUSR)) ||
+                ((mask & W_OK) && !(st.st_mode & S_IWUSR)) ||
+                ((mask & X_OK) && !(st.st_mode & S_IXUSR)))
+                return -EACCES;
+            return 0;
+        }
+
+        std::string real = utils::backing_path(path);
+        res = access(real.c_str(), mask);
         if (res == -1)
             return -errno;
     
@@ -114,9 +735,23 @@ In each callback (getattr, readdir, open, read, write, cleanup):
     
     int sn_readlink(const char *path, char *buf, size_t size)
     {
+        metrics::Scope timing(metrics::Op::Readlink);
         int res;
-    
-        res = readlink(path, buf, size - 1);
+        tar_manager::Entry pending;
+
+        if (sn_internal(path))
+            return -EINVAL;
+        if (sn_pending(path, pending)) {
+            size_t len = pending.link.size() < size - 1 ? pending.link.size() : size - 1;
+            memcpy(buf, pending.link.data(), len);
+            buf[len] = '\0';
+            return 0;
+        }
+        if ((res = sn_restored(path)) != 0)
+            return res;
+
+        std::string real = utils::backing_path(path);
+        res = readlink(real.c_str(), buf, size - 1);
         if (res == -1)
             return -errno;
     
@@ -129,19 +764,68 @@ In each callback (getattr, readdir, open, read, write, cleanup):
                     off_t offset, struct fuse_file_info *fi,
                     enum fuse_readdir_flags flags)
     {
+        metrics::Scope timing(metrics::Op::Readdir);
         DIR *dp;
         struct dirent *de;
+        sn_context *ctx = sn_ctx();
     
         (void) offset;
         (void) fi;
-        (void) flags;
+
+        /* The control directory lists its knobs, but is itself hidden from
+           the root listing so ls, find and rsync never walk into it */
+        if (sn_internal(path)) {
+            if (strcmp(path, SN_INTERNAL_DIR) != 0)
+                return -ENOTDIR;
+            filler(buf, ".", NULL, 0, (enum fuse_fill_dir_flags) 0);
+            filler(buf, "..", NULL, 0, (enum fuse_fill_dir_flags) 0);
+            if (ctx != NULL && ctx->control != NULL)
+                for (const auto &k : ctx->control->knobs())
+                    if (filler(buf, k.name.c_str(), NULL, 0, (enum fuse_fill_dir_flags) 0))
+                        break;
+            return 0;
+        }
     
-        dp = opendir(path);
+        /* Files still being restored are listed from the snapshot manifest */
+        std::vector<tar_manager::Entry> pending;
+        std::set<std::string> pending_names;
+        if (ctx != NULL && ctx->restore != NULL) {
+            pending = ctx->restore->pending_children(utils::relative_path(path));
+            if (pending.empty() && sn_restored(path) != 0)
+                return -EIO;
+        }
+
+        std::string real = utils::backing_path(path);
+        dp = opendir(real.c_str());
         if (dp == NULL)
             return -errno;
+
+        /* The lookups readdirplus is followed by find their inodes mapped,
+           so their first lstat already fills the attribute cache */
+        attr_cache::Cache *attrs = (flags & FUSE_READDIR_PLUS) ? sn_attrs() : NULL;
+        std::string dir = utils::relative_path(path);
+        struct stat dir_st;
+        if (attrs != NULL && fstat(dirfd(dp), &dir_st) == -1)
+            attrs = NULL;
+
+        for (const auto &e : pending) {
+            struct stat st;
+            sn_entry_stat(e, &st);
+            const std::string &name = *pending_names.insert(
+                e.path.substr(e.path.rfind('/') + 1)).first;
+            if (filler(buf, name.c_str(), &st, 0, FUSE_FILL_DIR_PLUS)) {
+                closedir(dp);
+                return 0;
+            }
+        }
     
         while ((de = readdir(dp)) != NULL) {
             struct stat st;
+            if (pending_names.count(de->d_name))
+                continue; /* partially written; the manifest entry stands */
+            if (attrs != NULL && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+                attrs->map(dir.empty() ? std::string(de->d_name) : dir + "/" + de->d_name,
+                           dir_st.st_dev, de->d_ino);
             if (fill_dir_plus) {
                 fstatat(dirfd(dp), de->d_name, &st,
                     AT_SYMLINK_NOFOLLOW);
@@ -160,122 +844,312 @@ In each callback (getattr, readdir, open, read, write, cleanup):
     
     int sn_mknod(const char *path, mode_t mode, dev_t rdev)
     {
+        metrics::Scope timing(metrics::Op::Mknod);
         int res;
-    
-        res = mknod_wrapper(AT_FDCWD, path, NULL, mode, rdev);
+
+        if (sn_internal(path))
+            return -EPERM;
+        if ((res = sn_restored(path)) != 0)
+            return res;
+
+        if ((res = sn_journal(path)) != 0)
+            return res;
+
+        std::string real = utils::backing_path(path);
+        res = mknod_wrapper(AT_FDCWD, real.c_str(), NULL, mode, rdev);
         if (res == -1)
             return -errno;
     
+        sn_created(path);
+        sn_changed(path);
         return 0;
     }
     
     int sn_mkdir(const char *path, mode_t mode)
     {
+        metrics::Scope timing(metrics::Op::Mkdir);
         int res;
-    
-        res = mkdir(path, mode);
+
+        if (sn_internal(path))
+            return -EPERM;
+        if ((res = sn_restored(path)) != 0)
+            return res;
+
+        if ((res = sn_journal(path)) != 0)
+            return res;
+
+        std::string real = utils::backing_path(path);
+        res = mkdir(real.c_str(), mode);
         if (res == -1)
             return -errno;
     
+        sn_created(path);
+        sn_changed(path);
         return 0;
     }
     
     int sn_unlink(const char *path)
     {
+        metrics::Scope timing(metrics::Op::Unlink);
         int res;
-    
-        res = unlink(path);
+
+        if (sn_internal(path))
+            return -EPERM;
+        if ((res = sn_journal(path, true)) != 0)
+            return res;
+        if (sn_discard(path)) {
+            sn_removed(path);
+            return 0;
+        }
+        if ((res = sn_restored(path)) != 0)
+            return res;
+
+        std::string real = utils::backing_path(path);
+        res = unlink(real.c_str());
         if (res == -1)
             return -errno;
     
+        sn_forget_xattrs(path);
+        sn_removed(path);
         return 0;
     }
     
     int sn_rmdir(const char *path)
     {
+        metrics::Scope timing(metrics::Op::Rmdir);
         int res;
-    
-        res = rmdir(path);
+
+        if (sn_internal(path))
+            return -EPERM;
+        if ((res = sn_restored(path, true)) != 0 || (res = sn_journal(path, true)) != 0)
+            return res;
+
+        std::string real = utils::backing_path(path);
+        res = rmdir(real.c_str());
         if (res == -1)
             return -errno;
     
+        sn_forget_xattrs(path);
+        sn_removed(path);
         return 0;
     }
     
     int sn_symlink(const char *from, const char *to)
     {
+        metrics::Scope timing(metrics::Op::Symlink);
         int res;
-    
-        res = symlink(from, to);
+
+        if (sn_internal(to))
+            return -EPERM;
+        if ((res = sn_restored(to)) != 0 || (res = sn_journal(to)) != 0)
+            return res;
+
+        /* from is the link target and is stored verbatim */
+        std::string real_to = utils::backing_path(to);
+        res = symlink(from, real_to.c_str());
         if (res == -1)
             return -errno;
     
+        sn_created(to);
+        sn_changed(to);
         return 0;
     }
     
     int sn_rename(const char *from, const char *to, unsigned int flags)
     {
+        metrics::Scope timing(metrics::Op::Rename);
         int res;
     
+        if (sn_internal(from) || sn_internal(to))
+            return -EPERM;
+    #ifdef HAVE_RENAMEAT2
+        if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) ||
+            flags == (RENAME_NOREPLACE | RENAME_EXCHANGE))
+            return -EINVAL;
+    #else
         if (flags)
             return -EINVAL;
-    
-        res = rename(from, to);
-        if (res == -1)
+    #endif
+        /* Still only in the snapshot, but it exists all the same */
+        tar_manager::Entry e;
+        if ((flags & RENAME_NOREPLACE) && sn_pending(to, e))
+            return -EEXIST;
+
+        if ((res = sn_restored(from, true)) != 0)
+            return res;
+
+        std::string real_from = utils::backing_path(from);
+        std::string real_to = utils::backing_path(to);
+
+        struct stat st;
+        if (lstat(real_from.c_str(), &st) == -1)
             return -errno;
-    
+
+        tar_manager::Change gone, moved;
+        gone.path = utils::relative_path(from);
+        gone.removed = true;
+        moved.path = utils::relative_path(to);
+        moved.tree = true;
+        /* After an exchange each path holds the other's old tree */
+        if (flags & RENAME_EXCHANGE) {
+            gone.tree = true;
+            moved.removed = true;
+        }
+        if ((res = sn_journal({gone, moved})) != 0)
+            return res;
+
+        bool held = false;
+        if (flags & RENAME_EXCHANGE) {
+            /* Both sides survive, so both have to be in data/ */
+            if ((res = sn_restored(to, true)) != 0)
+                return res;
+        } else if (!(flags & RENAME_NOREPLACE)) {
+            /* A snapshot file about to be replaced never needs restoring,
+               but has to stay whole until the rename has succeeded */
+            held = sn_hold(to);
+            if (held && S_ISDIR(st.st_mode)) {
+                /* Snapshot files are never directories */
+                sn_release(to, false);
+                return -ENOTDIR;
+            }
+            if (!held && (res = sn_restored(to, true)) != 0)
+                return res;
+        }
+
+    #ifdef HAVE_RENAMEAT2
+        if (flags)
+            res = renameat2(AT_FDCWD, real_from.c_str(), AT_FDCWD, real_to.c_str(), flags);
+        else
+    #endif
+        res = rename(real_from.c_str(), real_to.c_str());
+        res = res == -1 ? -errno : 0;
+        if (held)
+            sn_release(to, res == 0);
+        if (res != 0)
+            return res;
+
+        sn_forget_xattrs(from, true);
+        sn_forget_xattrs(to, true);
+        if (sn_negatives() != NULL) {
+            sn_negatives()->forget_tree(utils::relative_path(from));
+            sn_negatives()->forget_tree(utils::relative_path(to));
+        }
+        if (sn_attrs() != NULL) {
+            /* Both files were mapped under their old names; rename sets their ctime */
+            sn_attrs()->changed(utils::relative_path(from));
+            sn_attrs()->changed(utils::relative_path(to));
+            sn_attrs()->forget_tree(utils::relative_path(from));
+            sn_attrs()->forget_tree(utils::relative_path(to));
+            sn_attrs()->parent_changed(utils::relative_path(from));
+            sn_attrs()->parent_changed(utils::relative_path(to));
+        }
+        if (flags & RENAME_EXCHANGE)
+            sn_moved(to, from);
+        sn_moved(from, to);
         return 0;
     }
     
     int sn_link(const char *from, const char *to)
     {
+        metrics::Scope timing(metrics::Op::Link);
         int res;
-    
-        res = link(from, to);
+
+        if (sn_internal(from) || sn_internal(to))
+            return -EPERM;
+        if ((res = sn_restored(from)) != 0 || (res = sn_restored(to)) != 0 ||
+            (res = sn_journal(to)) != 0)
+            return res;
+
+        std::string real_from = utils::backing_path(from);
+        std::string real_to = utils::backing_path(to);
+        res = link(real_from.c_str(), real_to.c_str());
         if (res == -1)
             return -errno;
     
+        /* The link count of from went up */
+        if (sn_attrs() != NULL)
+            sn_attrs()->changed(utils::relative_path(from));
+        sn_created(to);
+        sn_changed(to);
         return 0;
     }
     
     int sn_chmod(const char *path, mode_t mode,
                 struct fuse_file_info *fi)
     {
-        (void) fi;
+        metrics::Scope timing(metrics::Op::Chmod);
         int res;
-    
-        res = chmod(path, mode);
+
+        if (sn_internal(path))
+            return -EPERM;
+        if (sn_fd(fi) != -1) {
+            if ((res = sn_journal(path)) != 0)
+                return res;
+            res = fchmod(sn_fd(fi), mode);
+        } else {
+            if ((res = sn_restored(path)) != 0 || (res = sn_journal(path)) != 0)
+                return res;
+            std::string real = utils::backing_path(path);
+            res = chmod(real.c_str(), mode);
+        }
         if (res == -1)
             return -errno;
     
+        sn_changed(path);
         return 0;
     }
     
     int sn_chown(const char *path, uid_t uid, gid_t gid,
                 struct fuse_file_info *fi)
     {
-        (void) fi;
+        metrics::Scope timing(metrics::Op::Chown);
         int res;
-    
-        res = lchown(path, uid, gid);
+
+        if (sn_internal(path))
+            return -EPERM;
+        if (sn_fd(fi) != -1) {
+            if ((res = sn_journal(path)) != 0)
+                return res;
+            res = fchown(sn_fd(fi), uid, gid);
+        } else {
+            if ((res = sn_restored(path)) != 0 || (res = sn_journal(path)) != 0)
+                return res;
+            std::string real = utils::backing_path(path);
+            res = lchown(real.c_str(), uid, gid);
+        }
         if (res == -1)
             return -errno;
     
+        sn_changed(path);
         return 0;
     }
     
     int sn_truncate(const char *path, off_t size,
                 struct fuse_file_info *fi)
     {
+        metrics::Scope timing(metrics::Op::Truncate);
         int res;
     
-        if (fi != NULL)
-            res = ftruncate(fi->fh, size);
-        else
-            res = truncate(path, size);
+        /* Shells truncate before writing a new value with > */
+        if (sn_internal(path)) {
+            const control::Knob *knob = sn_knob(path);
+            return knob != NULL && knob->set && size == 0 ? 0 : -EPERM;
+        }
+        if (sn_fd(fi) != -1) {
+            if ((res = sn_journal(path)) != 0)
+                return res;
+            /* Only writes at or past the new end can race with it */
+            open_file::Inode::Guard guard = sn_fh(fi)->lock_from(size, true);
+            res = ftruncate(sn_fd(fi), size);
+        } else {
+            if ((res = sn_journal(path)) != 0 || (res = sn_restored_truncated(path, size)) != 0)
+                return res;
+            res = sn_truncate_path(utils::backing_path(path), size);
+        }
         if (res == -1)
             return -errno;
     
+        sn_changed(path);
         return 0;
     }
     
@@ -283,14 +1157,26 @@ In each callback (getattr, readdir, open, read, write, cleanup):
     int sn_utimens(const char *path, const struct timespec ts[2],
                     struct fuse_file_info *fi)
     {
-        (void) fi;
+        metrics::Scope timing(metrics::Op::Utimens);
         int res;
     
-        /* don't use utime/utimes since they follow symlinks */
-        res = utimensat(0, path, ts, AT_SYMLINK_NOFOLLOW);
+        if (sn_internal(path))
+            return -EPERM;
+        if (sn_fd(fi) != -1) {
+            if ((res = sn_journal(path)) != 0)
+                return res;
+            res = futimens(sn_fd(fi), ts);
+        } else {
+            if ((res = sn_restored(path)) != 0 || (res = sn_journal(path)) != 0)
+                return res;
+            /* don't use utime/utimes since they follow symlinks */
+            std::string real = utils::backing_path(path);
+            res = utimensat(0, real.c_str(), ts, AT_SYMLINK_NOFOLLOW);
+        }
         if (res == -1)
             return -errno;
     
+        sn_changed(path);
         return 0;
     }
     #endif
@@ -298,23 +1184,60 @@ In each callback (getattr, readdir, open, read, write, cleanup):
     int sn_create(const char *path, mode_t mode,
                 struct fuse_file_info *fi)
     {
+        metrics::Scope timing(metrics::Op::Create);
         int res;
-    
-        res = open(path, fi->flags, mode);
-        if (res == -1)
-            return -errno;
-    
-        fi->fh = res;
+
+        if (sn_internal(path))
+            return -EPERM;
+        if ((res = sn_journal(path)) != 0)
+            return res;
+
+        res = sn_open_backing(path, fi->flags, mode);
+        if (res < 0)
+            return res;
+    
+        open_file::Handle *fh = new open_file::Handle(res, fi->flags, sn_files());
+        fi->fh = fh->to_fh();
+        sn_created(path);
+        sn_changed(path);
+        if (sn_attrs() != NULL && fh->inode() != NULL)
+            sn_attrs()->map(utils::relative_path(path), fh->inode()->dev(), fh->inode()->ino());
         return 0;
     }
     
     int sn_open(const char *path, struct fuse_file_info *fi)
     {
+        metrics::Scope timing(metrics::Op::Open);
         int res;
-    
-        res = open(path, fi->flags);
-        if (res == -1)
-            return -errno;
+
+        if (sn_internal(path)) {
+            struct stat st;
+            if ((res = sn_internal_stat(path, &st)) != 0)
+                return res;
+            if (S_ISDIR(st.st_mode))
+                return -EISDIR;
+            const control::Knob *knob = sn_knob(path);
+            if ((fi->flags & O_ACCMODE) != O_RDONLY && !knob->set)
+                return -EACCES;
+            fi->direct_io = 1;
+            fi->fh = (new open_file::Handle(knob->get()))->to_fh();
+            return 0;
+        }
+
+        /* Read-only opens of untouched snapshot files read it in place */
+        if ((fi->flags & O_ACCMODE) == O_RDONLY && !(fi->flags & O_TRUNC)) {
+            const tar_manager::IndexedArchive::File *archived = sn_archived(path);
+            if (archived != NULL) {
+                fi->fh = (new open_file::Handle(archived))->to_fh();
+                return 0;
+            }
+        }
+        if ((fi->flags & O_TRUNC) && (res = sn_journal(path)) != 0)
+            return res;
+
+        res = sn_open_backing(path, fi->flags, 0);
+        if (res < 0)
+            return res;
     
             /* Enable direct_io when open has flags O_DIRECT to enjoy the feature
             parallel_direct_writes (i.e., to get a shared lock, not exclusive lock,
@@ -324,62 +1247,92 @@ In each callback (getattr, readdir, open, read, write, cleanup):
             fi->parallel_direct_writes = 1;
         }
     
-        fi->fh = res;
+        fi->fh = (new open_file::Handle(res, fi->flags, sn_files()))->to_fh();
+        if (fi->flags & O_TRUNC)
+            sn_changed(path);
         return 0;
     }
     
     int sn_read(const char *path, char *buf, size_t size, off_t offset,
                 struct fuse_file_info *fi)
     {
-        int fd;
+        metrics::Scope timing(metrics::Op::Read);
         int res;
-    
-        if(fi == NULL)
-            fd = open(path, O_RDONLY);
-        else
-            fd = fi->fh;
-        
-        if (fd == -1)
-            return -errno;
-    
-        res = pread(fd, buf, size, offset);
-        if (res == -1)
-            res = -errno;
-    
-        if(fi == NULL)
-            close(fd);
+        open_file::Handle *fh = sn_fh(fi);
+
+        timing.detail(sn_ino(fh), offset, size);
+        if (fh->contents() != NULL) {
+            const std::string &text = *fh->contents();
+            if (offset < 0 || static_cast<size_t>(offset) >= text.size())
+                return 0;
+            res = static_cast<int>(std::min(size, text.size() - offset));
+            memcpy(buf, text.data() + offset, res);
+            return res;
+        }
+
+        sn_follow_restore(fh, path);
+        sn_readahead(fh, offset, size);
+        if (fh->archived() != NULL) {
+            metrics::Scope copy(metrics::Op::Snapshot);
+            res = sn_ctx()->snapshot->read(*fh->archived(), buf, size, offset);
+        } else {
+            open_file::Inode::Guard guard = fh->lock(offset, size, false);
+            metrics::Scope disk(metrics::Op::Disk);
+            if ((res = pread(fh->fd(), buf, size, offset)) == -1)
+                res = -errno;
+        }
+
+        if (res > 0) {
+            ++fh->stats().reads;
+            fh->stats().read_bytes += res;
+            metrics::add(metrics::Counter::ReadBytes, res);
+        }
         return res;
     }
     
     int sn_write(const char *path, const char *buf, size_t size,
                 off_t offset, struct fuse_file_info *fi)
     {
-        int fd;
+        metrics::Scope timing(metrics::Op::Write);
         int res;
-    
-        (void) fi;
-        if(fi == NULL)
-            fd = open(path, O_WRONLY);
-        else
-            fd = fi->fh;
-        
-        if (fd == -1)
-            return -errno;
-    
-        res = pwrite(fd, buf, size, offset);
+        open_file::Handle *fh = sn_fh(fi);
+
+        timing.detail(sn_ino(fh), offset, size);
+        /* A control file takes the whole value in one write */
+        if (fh->contents() != NULL) {
+            const control::Knob *knob = sn_knob(path);
+            if (knob == NULL || !knob->set || offset != 0)
+                return -EINVAL;
+            if ((res = knob->set(std::string(buf, size))) != 0)
+                return res;
+            return static_cast<int>(size);
+        }
+        if ((res = sn_journal_write(fh, path)) != 0)
+            return res;
+    
+        {
+            /* Ordered against other handles' writes to the same blocks */
+            open_file::Inode::Guard guard = fh->lock(offset, size, true);
+            metrics::Scope disk(metrics::Op::Disk);
+            res = pwrite(fh->fd(), buf, size, offset);
+        }
         if (res == -1)
-            res = -errno;
-    
-        if(fi == NULL)
-            close(fd);
+            return -errno;
+
+        ++fh->stats().writes;
+        fh->stats().write_bytes += res;
+        metrics::add(metrics::Counter::WriteBytes, res);
+        sn_changed(path, res);
         return res;
     }
     
     int sn_statfs(const char *path, struct statvfs *stbuf)
     {
+        metrics::Scope timing(metrics::Op::Statfs);
         int res;
-    
-        res = statvfs(path, stbuf);
+
+        std::string real = utils::backing_path(sn_internal(path) ? "/" : path);
+        res = statvfs(real.c_str(), stbuf);
         if (res == -1)
             return -errno;
     
@@ -388,20 +1341,38 @@ In each callback (getattr, readdir, open, read, write, cleanup):
     
     int sn_release(const char *path, struct fuse_file_info *fi)
     {
+        metrics::Scope timing(metrics::Op::Release);
         (void) path;
-        close(fi->fh);
+        delete sn_fh(fi);
         return 0;
     }
     
     int sn_fsync(const char *path, int isdatasync,
                 struct fuse_file_info *fi)
     {
-        /* Just a stub.	 This method is optional and can safely be left
-            unimplemented */
-    
+        metrics::Scope timing(metrics::Op::Fsync);
+        int res;
+
         (void) path;
-        (void) isdatasync;
-        (void) fi;
+        /* Writes go straight to the backing fd, so there is nothing of our
+           own to flush first. Snapshot and internal files have no fd and
+           nothing that is not already durable. */
+        open_file::Handle *fh = sn_fh(fi);
+        if (fh->fd() == -1)
+            return 0;
+        timing.detail(sn_ino(fh), 0, 0);
+
+        /* Concurrent fsyncs of one file share a sync */
+        if (fh->inode() != NULL)
+            return -fh->inode()->sync(fh->fd(), isdatasync != 0);
+
+        metrics::add(metrics::Counter::Syncs);
+        {
+            metrics::Scope disk(metrics::Op::Disk);
+            res = isdatasync ? fdatasync(fh->fd()) : fsync(fh->fd());
+        }
+        if (res == -1)
+            return -errno;
         return 0;
     }
     
@@ -409,128 +1380,235 @@ In each callback (getattr, readdir, open, read, write, cleanup):
     int sn_fallocate(const char *path, int mode,
                 off_t offset, off_t length, struct fuse_file_info *fi)
     {
-        int fd;
+        metrics::Scope timing(metrics::Op::Fallocate);
         int res;
     
-        (void) fi;
-    
+    #ifndef HAVE_FALLOCATE
         if (mode)
             return -EOPNOTSUPP;
+    #endif
     
-        if(fi == NULL)
-            fd = open(path, O_WRONLY);
-        else
-            fd = fi->fh;
-        
-        if (fd == -1)
-            return -errno;
-    
-        res = -posix_fallocate(fd, offset, length);
-    
-        if(fi == NULL)
-            close(fd);
+        if (sn_fd(fi) == -1)
+            return -EBADF;
+        timing.detail(sn_ino(sn_fh(fi)), offset, length);
+        if ((res = sn_journal_write(sn_fh(fi), path)) != 0)
+            return res;
+    
+        {
+            open_file::Inode::Guard guard = sn_fh(fi)->lock(offset, length, true);
+    #ifdef HAVE_FALLOCATE
+            /* Hole punching, zeroing and KEEP_SIZE preallocation all keep
+               data/ sparse; the filesystem rejects modes it lacks */
+            if (mode)
+                res = fallocate(sn_fd(fi), mode, offset, length) == -1 ? -errno : 0;
+            else
+                res = -posix_fallocate(sn_fd(fi), offset, length);
+    #else
+            res = -posix_fallocate(sn_fd(fi), offset, length);
+    #endif
+        }
+        if (res == 0)
+            sn_changed(path);
         return res;
     }
     #endif
     
     #ifdef HAVE_SETXATTR
-    /* xattr operations are optional and can safely be left unimplemented */
+    /* Attributes live in one blob per backing file, cached by xattr::Cache,
+       and go into snapshots with it. A file still only in the snapshot is
+       answered from the blob its entry carries, without copying it into
+       data/; changing them restores it first. */
     int sn_setxattr(const char *path, const char *name, const char *value,
                 size_t size, int flags)
     {
-        int res = lsetxattr(path, name, value, size, flags);
-        if (res == -1)
-            return -errno;
-        return 0;
+        metrics::Scope timing(metrics::Op::Setxattr);
+        sn_context *ctx = sn_ctx();
+        if (sn_internal(path))
+            return -EPERM;
+        if (ctx == NULL || ctx->xattrs == NULL)
+            return -ENOTSUP;
+        int res = sn_restored(path);
+        if (res != 0)
+            return res;
+
+        if ((res = sn_journal(path)) != 0)
+            return res;
+
+        std::string real = utils::backing_path(path);
+        res = ctx->xattrs->set(utils::relative_path(path), real, name, value, size, flags);
+        if (res == 0)
+            sn_changed(path);
+        return res;
     }
     
     int sn_getxattr(const char *path, const char *name, char *value,
                 size_t size)
     {
-        int res = lgetxattr(path, name, value, size);
-        if (res == -1)
-            return -errno;
-        return res;
+        metrics::Scope timing(metrics::Op::Getxattr);
+        sn_context *ctx = sn_ctx();
+        tar_manager::Entry e;
+        if (sn_internal(path))
+            return -ENODATA;
+        if (sn_pending(path, e))
+            return xattr::get(e.xattrs, name, value, size);
+        if (ctx == NULL || ctx->xattrs == NULL)
+            return -ENOTSUP;
+
+        std::string real = utils::backing_path(path);
+        return ctx->xattrs->get(utils::relative_path(path), real, name, value, size);
     }
     
     int sn_listxattr(const char *path, char *list, size_t size)
     {
-        int res = llistxattr(path, list, size);
-        if (res == -1)
-            return -errno;
-        return res;
+        metrics::Scope timing(metrics::Op::Listxattr);
+        sn_context *ctx = sn_ctx();
+        tar_manager::Entry e;
+        if (sn_internal(path))
+            return 0;
+        if (sn_pending(path, e))
+            return xattr::list(e.xattrs, list, size);
+        if (ctx == NULL || ctx->xattrs == NULL)
+            return -ENOTSUP;
+
+        std::string real = utils::backing_path(path);
+        return ctx->xattrs->list(utils::relative_path(path), real, list, size);
     }
     
     int sn_removexattr(const char *path, const char *name)
     {
-        int res = lremovexattr(path, name);
-        if (res == -1)
-            return -errno;
-        return 0;
+        metrics::Scope timing(metrics::Op::Removexattr);
+        sn_context *ctx = sn_ctx();
+        tar_manager::Entry e;
+        if (sn_internal(path))
+            return -EPERM;
+        /* Nothing to restore the file for */
+        if (sn_pending(path, e) && xattr::get(e.xattrs, name, NULL, 0) == -ENODATA)
+            return -ENODATA;
+        if (ctx == NULL || ctx->xattrs == NULL)
+            return -ENOTSUP;
+        int res;
+        if ((res = sn_restored(path)) != 0 || (res = sn_journal(path)) != 0)
+            return res;
+
+        std::string real = utils::backing_path(path);
+        res = ctx->xattrs->remove(utils::relative_path(path), real, name);
+        if (res == 0)
+            sn_changed(path);
+        return res;
     }
     #endif /* HAVE_SETXATTR */
     
     #ifdef HAVE_COPY_FILE_RANGE
+    /* Filesystem block size clones must be aligned to. 4 KiB covers btrfs
+       and xfs as usually formatted; anything else fails with EINVAL and
+       gets copied instead. */
+    static const off_t SN_CLONE_BLOCK = 4096;
+
+    /* Cleared once data/ turns out not to support FICLONERANGE */
+    static std::atomic<bool> sn_clone_supported{true};
+
+    /* Share the blocks of [offset_in, offset_in + len) with the output file
+       instead of copying them. 0, or -1 with errno set. */
+    static int sn_clone_range(int fd_in, off_t offset_in, int fd_out,
+                              off_t offset_out, off_t len)
+    {
+    #ifdef FICLONERANGE
+        struct file_clone_range range;
+        range.src_fd = fd_in;
+        range.src_offset = offset_in;
+        range.src_length = len;
+        range.dest_offset = offset_out;
+        if (ioctl(fd_out, FICLONERANGE, &range) == 0)
+            return 0;
+        if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV)
+            sn_clone_supported.store(false, std::memory_order_relaxed);
+        return -1;
+    #else
+        (void) fd_in; (void) offset_in; (void) fd_out; (void) offset_out; (void) len;
+        sn_clone_supported.store(false, std::memory_order_relaxed);
+        errno = EOPNOTSUPP;
+        return -1;
+    #endif
+    }
+
+    /* copy_file_range(2) that clones the whole blocks in the middle of the
+       range when both offsets sit at the same place within a block, and
+       copies only the partial blocks at either edge. Falls back to copying
+       everything when cloning is not possible. */
+    static ssize_t sn_copy_range(int fd_in, off_t offset_in, int fd_out,
+                                 off_t offset_out, size_t len, int flags)
+    {
+        off_t head = (SN_CLONE_BLOCK - offset_in % SN_CLONE_BLOCK) % SN_CLONE_BLOCK;
+        off_t whole = (static_cast<off_t>(len) - std::min<off_t>(head, len)) /
+                      SN_CLONE_BLOCK * SN_CLONE_BLOCK;
+        if (flags != 0 || whole == 0 || offset_in % SN_CLONE_BLOCK != offset_out % SN_CLONE_BLOCK ||
+            !sn_clone_supported.load(std::memory_order_relaxed))
+            return copy_file_range(fd_in, &offset_in, fd_out, &offset_out, len, flags);
+
+        ssize_t done = 0;
+        if (head > 0) {
+            done = copy_file_range(fd_in, &offset_in, fd_out, &offset_out, head, 0);
+            if (done != head)
+                return done;
+        }
+        if (sn_clone_range(fd_in, offset_in, fd_out, offset_out, whole) == -1) {
+            ssize_t res = copy_file_range(fd_in, &offset_in, fd_out, &offset_out, len - done, 0);
+            return res == -1 ? (done > 0 ? done : -1) : done + res;
+        }
+        metrics::add(metrics::Counter::CloneBytes, whole);
+        offset_in += whole;
+        offset_out += whole;
+        done += whole;
+        if (static_cast<size_t>(done) == len)
+            return done;
+
+        ssize_t res = copy_file_range(fd_in, &offset_in, fd_out, &offset_out, len - done, 0);
+        return res == -1 ? done : done + res;
+    }
+
     ssize_t sn_copy_file_range(const char *path_in,
                         struct fuse_file_info *fi_in,
                         off_t offset_in, const char *path_out,
                         struct fuse_file_info *fi_out,
                         off_t offset_out, size_t len, int flags)
     {
-        int fd_in, fd_out;
+        metrics::Scope timing(metrics::Op::CopyFileRange);
         ssize_t res;
     
-        if(fi_in == NULL)
-            fd_in = open(path_in, O_RDONLY);
-        else
-            fd_in = fi_in->fh;
-    
-        if (fd_in == -1)
-            return -errno;
-    
-        if(fi_out == NULL)
-            fd_out = open(path_out, O_WRONLY);
-        else
-            fd_out = fi_out->fh;
-    
-        if (fd_out == -1) {
-            close(fd_in);
-            return -errno;
+        timing.detail(sn_ino(sn_fh(fi_out)), offset_out, len);
+        sn_follow_restore(sn_fh(fi_in), path_in);
+        /* Let the kernel fall back to read/write for snapshot-served input */
+        if (sn_fh(fi_in)->archived() != NULL)
+            return -EOPNOTSUPP;
+        if ((res = sn_journal_write(sn_fh(fi_out), path_out)) != 0)
+            return res;
+
+        {
+            open_file::Inode::Guard guard = sn_fh(fi_out)->lock(offset_out, len, true);
+            res = sn_copy_range(sn_fd(fi_in), offset_in, sn_fd(fi_out), offset_out, len, flags);
         }
-    
-        res = copy_file_range(fd_in, &offset_in, fd_out, &offset_out, len,
-                    flags);
         if (res == -1)
-            res = -errno;
-    
-        if (fi_out == NULL)
-            close(fd_out);
-        if (fi_in == NULL)
-            close(fd_in);
-    
+            return -errno;
+
+        sn_changed(path_out, res);
         return res;
     }
     #endif
     
     off_t sn_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
     {
-        int fd;
+        metrics::Scope timing(metrics::Op::Lseek);
         off_t res;
-    
-        if (fi == NULL)
-            fd = open(path, O_RDONLY);
-        else
-            fd = fi->fh;
-    
-        if (fd == -1)
-            return -errno;
-    
-        res = lseek(fd, off, whence);
+        sn_follow_restore(sn_fh(fi), path);
+        const tar_manager::IndexedArchive::File *archived = sn_fh(fi)->archived();
+
+        /* Holes of snapshot files are tracked per block */
+        if (archived != NULL)
+            return archived->owner->seek(*archived, off, whence);
+
+        res = lseek(sn_fd(fi), off, whence);
         if (res == -1)
-            res = -errno;
-    
-        if (fi == NULL)
-            close(fd);
+            return -errno;
         return res;
     }
     
@@ -110,6 +110,49 @@ const struct fuse_operations* get_sn_operations(void);
 
 #ifdef __cplusplus
 }
+
+namespace tar_manager { class Restore; class LazySnapshot; }
+namespace checkpoint { class Checkpointer; }
+namespace prefetch { class Prefetcher; }
+namespace open_file { class Table; }
+namespace control { class Panel; }
+namespace trace { class Dumper; }
+namespace utils { class Logger; }
+namespace journal { class Journal; }
+namespace xattr { class Cache; }
+namespace negative_cache { class Cache; }
+namespace attr_cache { class Cache; }
+
+// State shared by every callback, passed to fuse_main() as private_data
+struct sn_context {
+    // Snapshot files not in data/ yet, or nullptr if there was none
+    tar_manager::Restore* restore = nullptr;
+    // Same object when it is an indexed snapshot that can be read in place
+    tar_manager::LazySnapshot* snapshot = nullptr;
+    // Background checkpointer told about every change under data/
+    checkpoint::Checkpointer* checkpoints = nullptr;
+    // Write-ahead record of changes, made durable before they are applied
+    journal::Journal* journal = nullptr;
+    // Worker threads fetching ahead of sequential readers
+    prefetch::Prefetcher* prefetcher = nullptr;
+    // Shared state of every backing inode with open handles
+    open_file::Table* files = nullptr;
+    // Files of the hidden control directory, filled in by sn_init
+    control::Panel* control = nullptr;
+    // Writes the request trace to a file on SIGUSR1
+    trace::Dumper* tracer = nullptr;
+    // Flushes log records in the background once FUSE has daemonized
+    utils::Logger* logger = nullptr;
+    // Extended attributes of files in data/, kept in memory once read
+    xattr::Cache* xattrs = nullptr;
+    // Paths recently found missing from data/
+    negative_cache::Cache* negatives = nullptr;
+    // Attributes of files in data/ looked up before
+    attr_cache::Cache* attrs = nullptr;
+    // Nothing but this mount changes data/ (--sole-owner), so the kernel
+    // may cache failed lookups too
+    bool sole_owner = false;
+};
 #endif
 
 #endif // SECURENOTEFS_FS_HPP
@@ -0,0 +1,186 @@
+/*
+Responsibilities of io_engine:
+
+Run the batches of positioned reads and writes the snapshot pipeline in
+tar_manager issues against data/ and the snapshot being written.
+
+With liburing (CMake defines HAVE_LIBURING when pkg-config finds it) a whole
+batch goes to the kernel in one io_uring_submit_and_wait() call, and buffers
+registered up front use the fixed-buffer opcodes. Without it, or when the
+kernel will not set up a ring (old kernels, seccomp-filtered containers),
+ops fall back to one pread/pwrite each, which is what the pipeline did before.
+*/
+
+#include "io_engine.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace io_engine {
+
+namespace {
+
+// Complete an op with plain syscalls from done bytes onward
+bool finish_sync(Op& op, size_t done)
+{
+    while (done < op.len) {
+        off_t at = static_cast<off_t>(op.offset + done);
+        ssize_t n = op.write ? ::pwrite(op.fd, op.buf + done, op.len - done, at)
+                             : ::pread(op.fd, op.buf + done, op.len - done, at);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (n == 0 && op.write)) {
+            op.result = n < 0 ? -errno : -EIO;
+            return false;
+        }
+        if (n == 0)
+            break; // end of file
+        done += static_cast<size_t>(n);
+    }
+    op.result = static_cast<ssize_t>(done);
+    return true;
+}
+
+class SyncEngine : public Engine {
+public:
+    const char* name() const override { return "sync"; }
+
+    bool run(std::vector<Op>& ops) override
+    {
+        bool ok = true;
+        for (auto& op : ops)
+            ok = finish_sync(op, 0) && ok;
+        return ok;
+    }
+};
+
+#ifdef HAVE_LIBURING
+class UringEngine : public Engine {
+public:
+    explicit UringEngine(unsigned depth) : depth_(depth) {}
+
+    ~UringEngine() override
+    {
+        if (ready_)
+            io_uring_queue_exit(&ring_);
+    }
+
+    bool init()
+    {
+        ready_ = io_uring_queue_init(depth_, &ring_, 0) == 0;
+        return ready_;
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    void register_buffers(const std::vector<char*>& bufs, size_t len) override
+    {
+        std::vector<struct iovec> iov;
+        for (char* b : bufs)
+            iov.push_back({b, len});
+        // Not fatal: unregistered buffers just take the ordinary opcodes
+        if (io_uring_register_buffers(&ring_, iov.data(), static_cast<unsigned>(iov.size())) != 0)
+            return;
+        for (size_t i = 0; i < bufs.size(); ++i)
+            fixed_[bufs[i]] = static_cast<int>(i);
+        fixed_len_ = len;
+    }
+
+    bool run(std::vector<Op>& ops) override
+    {
+        if (broken_)
+            return fallback_.run(ops);
+
+        bool ok = true;
+        for (size_t first = 0; first < ops.size(); first += depth_) {
+            size_t n = std::min<size_t>(depth_, ops.size() - first);
+            for (size_t i = first; i < first + n; ++i)
+                prepare(ops[i]);
+
+            int res = io_uring_submit_and_wait(&ring_, static_cast<unsigned>(n));
+            if (res < 0 || static_cast<size_t>(res) != n) {
+                // Entries may still be queued and complete later against ops
+                // we no longer own; stop using the ring for good
+                broken_ = true;
+                std::vector<Op> rest(ops.begin() + static_cast<ptrdiff_t>(first), ops.end());
+                ok = fallback_.run(rest) && ok;
+                std::copy(rest.begin(), rest.end(), ops.begin() + static_cast<ptrdiff_t>(first));
+                return ok;
+            }
+
+            for (size_t i = 0; i < n; ++i) {
+                struct io_uring_cqe* cqe;
+                if (io_uring_wait_cqe(&ring_, &cqe) != 0) {
+                    broken_ = true;
+                    return false;
+                }
+                Op& op = *static_cast<Op*>(io_uring_cqe_get_data(cqe));
+                int r = cqe->res;
+                io_uring_cqe_seen(&ring_, cqe);
+                if (r == -EINTR || r == -EAGAIN) {
+                    ok = finish_sync(op, 0) && ok;
+                } else if (r < 0) {
+                    op.result = r;
+                    ok = false;
+                } else if (static_cast<size_t>(r) < op.len) {
+                    ok = finish_sync(op, static_cast<size_t>(r)) && ok;
+                } else {
+                    op.result = r;
+                }
+            }
+        }
+        return ok;
+    }
+
+private:
+    void prepare(Op& op)
+    {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+        unsigned len = static_cast<unsigned>(std::min<size_t>(op.len, UINT_MAX));
+        auto fixed = fixed_.find(op.buf);
+        if (fixed != fixed_.end() && op.len <= fixed_len_) {
+            if (op.write)
+                io_uring_prep_write_fixed(sqe, op.fd, op.buf, len, op.offset, fixed->second);
+            else
+                io_uring_prep_read_fixed(sqe, op.fd, op.buf, len, op.offset, fixed->second);
+        } else if (op.write) {
+            io_uring_prep_write(sqe, op.fd, op.buf, len, op.offset);
+        } else {
+            io_uring_prep_read(sqe, op.fd, op.buf, len, op.offset);
+        }
+        io_uring_sqe_set_data(sqe, &op);
+    }
+
+    unsigned depth_;
+    struct io_uring ring_;
+    bool ready_ = false;
+    bool broken_ = false;
+    std::unordered_map<const char*, int> fixed_;  // registered buffer -> index
+    size_t fixed_len_ = 0;
+    SyncEngine fallback_;
+};
+#endif
+
+} // namespace
+
+std::unique_ptr<Engine> make_engine(unsigned queue_depth)
+{
+#ifdef HAVE_LIBURING
+    auto ring = std::make_unique<UringEngine>(queue_depth);
+    if (ring->init())
+        return ring;
+#else
+    (void) queue_depth;
+#endif
+    return std::make_unique<SyncEngine>();
+}
+
+} // namespace io_engine
@@ -0,0 +1,47 @@
+#ifndef SECURENOTEFS_IO_ENGINE_HPP
+#define SECURENOTEFS_IO_ENGINE_HPP
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace io_engine {
+
+// One read or write in a batch
+struct Op {
+    bool write = false;
+    int fd = -1;
+    char* buf = nullptr;
+    size_t len = 0;
+    uint64_t offset = 0;
+    ssize_t result = 0;  // bytes transferred, or -errno
+};
+
+// Runs batches of positioned reads and writes against the backing store.
+// An engine is owned by one thread; each thread that does I/O makes its own.
+class Engine {
+public:
+    virtual ~Engine() = default;
+
+    // "io_uring" or "sync", for logs
+    virtual const char* name() const = 0;
+
+    // Buffers that will be passed to run() over and over; an engine may pin
+    // them so the kernel does not have to map them on every request
+    virtual void register_buffers(const std::vector<char*>& bufs, size_t len) { (void) bufs; (void) len; }
+
+    // Perform every op, continuing short transfers until len bytes moved or
+    // a read hits end of file. False if any op failed; see each op's result.
+    virtual bool run(std::vector<Op>& ops) = 0;
+};
+
+// io_uring when built with liburing and the kernel lets us set up a ring of
+// queue_depth entries, else one pread/pwrite syscall per op
+std::unique_ptr<Engine> make_engine(unsigned queue_depth);
+
+} // namespace io_engine
+
+#endif // SECURENOTEFS_IO_ENGINE_HPP
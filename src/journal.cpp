@@ -0,0 +1,330 @@
+/*
+Responsibilities of journal:
+
+Record each path a callback is about to create, modify or remove, durably
+and before the change reaches data/, so a crash can never leave a change in
+data/ that the next mount does not know to snapshot.
+
+Batch concurrent callers into one write and one fdatasync (group commit):
+whoever finds no sync in progress becomes the leader and writes everything
+appended so far; callers arriving meanwhile wait and the next of them leads.
+
+A segment file is a sequence of records:
+
+    record := length:u32 flags:u8 crc32:u32 path
+    flags  := 1 removed | 2 tree, as in tar_manager::Change
+
+Integers are little-endian; the CRC covers flags and path. Reading stops at
+the first short or corrupt record, which can only be a write torn by a crash
+and so was never acknowledged to anyone.
+*/
+
+#include "journal.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <map>
+
+#include <zlib.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "metrics.hpp"
+#include "utils.hpp"
+
+namespace journal {
+
+namespace {
+
+constexpr const char* SEGMENT_PREFIX = "securenotefs-journal-";
+constexpr const char* SEGMENT_SUFFIX = ".log";
+constexpr size_t RECORD_HEADER = 9;
+constexpr uint8_t REMOVED = 1;
+constexpr uint8_t TREE = 2;
+
+void put_u32(std::string& out, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        out += static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+uint32_t get_u32(const char* p)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i)
+        v |= static_cast<uint32_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    return v;
+}
+
+uint32_t record_crc(uint8_t flags, const std::string& path)
+{
+    uLong crc = crc32(0, &flags, 1);
+    return static_cast<uint32_t>(
+        crc32(crc, reinterpret_cast<const Bytef*>(path.data()), static_cast<uInt>(path.size())));
+}
+
+void append_record(std::string& out, const std::string& path, uint8_t flags)
+{
+    put_u32(out, static_cast<uint32_t>(path.size()));
+    out += static_cast<char>(flags);
+    put_u32(out, record_crc(flags, path));
+    out += path;
+}
+
+// Every intact record of a segment file, flags of a path OR'd together
+void read_segment(const std::string& file, std::map<std::string, uint8_t>& out)
+{
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    std::string data;
+    char buf[64 << 10];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+        data.append(buf, static_cast<size_t>(n));
+    ::close(fd);
+
+    size_t pos = 0;
+    while (data.size() - pos >= RECORD_HEADER) {
+        uint32_t length = get_u32(data.data() + pos);
+        uint8_t flags = static_cast<uint8_t>(data[pos + 4]);
+        uint32_t crc = get_u32(data.data() + pos + 5);
+        if (data.size() - pos - RECORD_HEADER < length)
+            break;
+        std::string path = data.substr(pos + RECORD_HEADER, length);
+        if (record_crc(flags, path) != crc)
+            break;
+        out[path] |= flags;
+        pos += RECORD_HEADER + length;
+    }
+}
+
+bool write_all(int fd, const std::string& data)
+{
+    const char* p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t n = ::write(fd, p, left);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        left -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+Journal::~Journal()
+{
+    if (fd_ != -1)
+        ::close(fd_);
+}
+
+std::string Journal::segment_path(uint64_t segment) const
+{
+    return dir_ + "/" + SEGMENT_PREFIX + std::to_string(segment) + SEGMENT_SUFFIX;
+}
+
+void Journal::sync_dir() const
+{
+    int fd = ::open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    ::fsync(fd);
+    ::close(fd);
+}
+
+int Journal::create(uint64_t segment)
+{
+    int fd = ::open(segment_path(segment).c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        SN_LOG_ERROR("journal", "cannot create %s: %s", segment_path(segment).c_str(), strerror(errno));
+        return -1;
+    }
+    // Records synced with fdatasync are no use if the file itself is lost
+    sync_dir();
+    return fd;
+}
+
+bool Journal::open(const std::string& dir, std::vector<tar_manager::Change>& recovered, bool& found)
+{
+    dir_ = dir;
+    recovered.clear();
+    found = false;
+
+    std::vector<uint64_t> old;
+    std::error_code ec;
+    for (const auto& de : std::filesystem::directory_iterator(dir, ec)) {
+        std::string name = de.path().filename().string();
+        if (!name.starts_with(SEGMENT_PREFIX) || !name.ends_with(SEGMENT_SUFFIX))
+            continue;
+        std::string number = name.substr(strlen(SEGMENT_PREFIX),
+                                         name.size() - strlen(SEGMENT_PREFIX) - strlen(SEGMENT_SUFFIX));
+        if (number.empty() || number.find_first_not_of("0123456789") != std::string::npos)
+            continue;
+        old.push_back(std::stoull(number));
+    }
+    if (ec)
+        return false;
+    std::sort(old.begin(), old.end());
+    found = !old.empty();
+
+    std::map<std::string, uint8_t> paths;
+    for (uint64_t s : old)
+        read_segment(segment_path(s), paths);
+
+    uint64_t first = old.empty() ? 1 : old.back() + 1;
+    int fd = create(first);
+    if (fd == -1)
+        return false;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    fd_ = fd;
+    segment_.store(first, std::memory_order_relaxed);
+    segments_.assign(1, first);
+
+    // Carried into the new segment before the old ones go, so a second
+    // crash still finds them
+    for (const auto& [path, flags] : paths) {
+        tar_manager::Change c;
+        c.path = path;
+        c.removed = flags & REMOVED;
+        c.tree = flags & TREE;
+        recovered.push_back(c);
+        append_record(pending_, path, flags);
+        logged_[path] = {++appended_, flags};
+    }
+    if (!commit(lock, appended_))
+        return false;
+    lock.unlock();
+
+    for (uint64_t s : old)
+        ::unlink(segment_path(s).c_str());
+    if (!old.empty())
+        sync_dir();
+    if (!recovered.empty())
+        SN_LOG_WARN("journal", "recovered %zu changes from an unclean shutdown", recovered.size());
+    return true;
+}
+
+uint64_t Journal::log(const std::vector<tar_manager::Change>& changes)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (failed_)
+        return 0;
+
+    uint64_t target = 0;
+    for (const auto& c : changes) {
+        uint8_t flags = (c.removed ? REMOVED : 0) | (c.tree ? TREE : 0);
+        auto it = logged_.find(c.path);
+        if (it != logged_.end() && (it->second.second | flags) == it->second.second) {
+            target = std::max(target, it->second.first);
+            continue;
+        }
+        uint8_t all = flags | (it != logged_.end() ? it->second.second : 0);
+        append_record(pending_, c.path, all);
+        logged_[c.path] = {++appended_, all};
+        target = appended_;
+    }
+    // Rotation moves records to their segment before switching, so this
+    // is the segment every record above is in
+    uint64_t segment = segment_.load(std::memory_order_relaxed);
+    if (target > durable_ && !commit(lock, target))
+        return 0;
+    return segment;
+}
+
+bool Journal::commit(std::unique_lock<std::mutex>& lock, uint64_t target)
+{
+    while (durable_ < target && !failed_) {
+        if (committing_) {
+            cv_.wait(lock);
+            continue;
+        }
+        committing_ = true;
+        std::string batch;
+        batch.swap(pending_);
+        uint64_t upto = appended_;
+        int fd = fd_;
+        lock.unlock();
+
+        bool ok;
+        {
+            metrics::Scope timing(metrics::Op::Journal);
+            ok = write_all(fd, batch) && ::fdatasync(fd) == 0;
+        }
+        if (!ok)
+            SN_LOG_ERROR("journal", "cannot write %s: %s", segment_path(segment()).c_str(), strerror(errno));
+
+        lock.lock();
+        committing_ = false;
+        if (ok)
+            durable_ = upto;
+        else
+            failed_ = true;
+        cv_.notify_all();
+    }
+    return !failed_;
+}
+
+uint64_t Journal::rotate()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Everything appended so far was promised a place in the old segment.
+    // commit() returns once those records are durable, but a leader may
+    // already be writing later ones through fd_ unlocked; only swap the fd
+    // once nobody is using it and nothing is left to write.
+    while (!failed_ && (committing_ || durable_ < appended_)) {
+        if (committing_)
+            cv_.wait(lock);
+        else
+            commit(lock, appended_);
+    }
+    // Read only now: the waits above drop the mutex, and another rotate()
+    // may have switched segments meanwhile
+    uint64_t old = segment_.load(std::memory_order_relaxed);
+    if (failed_)
+        return old;
+
+    int fd = create(old + 1);
+    if (fd == -1)
+        return old;  // keep appending to the old one
+    ::close(fd_);
+    fd_ = fd;
+    segments_.push_back(old + 1);
+    segment_.store(old + 1, std::memory_order_relaxed);
+    logged_.clear();
+    return old;
+}
+
+void Journal::retire(uint64_t segment)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto keep = std::lower_bound(segments_.begin(), segments_.end(), segment);
+    if (keep == segments_.begin())
+        return;
+    for (auto it = segments_.begin(); it != keep; ++it)
+        ::unlink(segment_path(*it).c_str());
+    segments_.erase(segments_.begin(), keep);
+    // A retired segment coming back after a crash would replay stale removals
+    sync_dir();
+}
+
+void Journal::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (uint64_t s : segments_)
+        ::unlink(segment_path(s).c_str());
+    segments_.clear();
+    sync_dir();
+}
+
+} // namespace journal
@@ -0,0 +1,82 @@
+#ifndef SECURENOTEFS_JOURNAL_HPP
+#define SECURENOTEFS_JOURNAL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tar_manager.hpp"
+
+namespace journal {
+
+// Write-ahead log of the paths callbacks are about to change under data/.
+// A record is on disk before its change is applied, so after a crash the
+// next mount knows exactly what to put in its first delta instead of
+// snapshotting all of data/.
+//
+// The log is split into segments, securenotefs-journal-<n>.log next to the
+// snapshots. The checkpointer starts a new one as it takes each checkpoint
+// and drops the old ones once the checkpoint is on disk.
+class Journal {
+public:
+    Journal() = default;
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+    ~Journal();
+
+    // Start a new segment in dir. Segments left by a session that did not
+    // unmount cleanly are read into recovered and carried into the new
+    // one; found tells whether there were any. False on I/O error.
+    bool open(const std::string& dir, std::vector<tar_manager::Change>& recovered, bool& found);
+
+    // Segment records are being appended to
+    uint64_t segment() const { return segment_.load(std::memory_order_relaxed); }
+
+    // Return once a record of each change is on disk. Callers arriving
+    // while another one syncs share the next fdatasync; a path already
+    // recorded in this segment costs nothing. The segment the records
+    // went to, or 0 on I/O error, after which every call fails.
+    uint64_t log(const std::vector<tar_manager::Change>& changes);
+    uint64_t log(const tar_manager::Change& change) { return log(std::vector<tar_manager::Change>{change}); }
+
+    // Begin a new segment ahead of a checkpoint. Returns the one it
+    // replaced, which may still hold records of changes the checkpoint
+    // misses because they were in flight.
+    uint64_t rotate();
+
+    // Delete segments older than segment; a snapshot holds their changes
+    void retire(uint64_t segment);
+
+    // Delete every segment; only once a final snapshot holds everything
+    void clear();
+
+private:
+    // Make records up to number target durable, as leader or follower
+    bool commit(std::unique_lock<std::mutex>& lock, uint64_t target);
+    int create(uint64_t segment);
+    std::string segment_path(uint64_t segment) const;
+    void sync_dir() const;
+
+    std::string dir_;
+    std::atomic<uint64_t> segment_{0};
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    int fd_ = -1;
+    std::vector<uint64_t> segments_;  // on disk, oldest first
+    std::string pending_;             // encoded records nobody is writing yet
+    uint64_t appended_ = 0;           // records appended, numbered from 1
+    uint64_t durable_ = 0;            // records known to be on disk
+    bool committing_ = false;         // a leader is writing and syncing
+    bool failed_ = false;
+    // Paths recorded in the current segment: record number and flags
+    std::unordered_map<std::string, std::pair<uint64_t, uint8_t>> logged_;
+};
+
+} // namespace journal
+
+#endif // SECURENOTEFS_JOURNAL_HPP
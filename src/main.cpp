@@ -4,32 +4,262 @@ Implemented using libfuse3
 
 Responsibilities of main()
 
-Parse any CLI flags (for now, just CWD defaults).
+Parse any CLI flags (CWD defaults, plus checkpoint tuning:
+--checkpoint-interval=SEC, --checkpoint-dirty-mb=N, --checkpoint-io-mbps=N, --checkpoint-keep-full=N,
+--shutdown-deadline=SEC to bound how long unmount spends saving, logging: --log=FILE, --log-level=debug|info|warn|error|off, and --sole-owner when nothing
+else touches data/ while mounted, which lets failed lookups be cached for longer).
 
 ensure_directory("notes") & ensure_directory("data").
 
-If .tar.gz exists, pick the newest and tar_manager::extract().
+If a snapshot exists, pick the newest: serve a .snfs in place (tar_manager::LazySnapshot) or
+restore a .tar.gz in the background (tar_manager::BackgroundExtractor).
 
 Call fuse_main(), passing in fs::operations.
 
-After fuse_main returns, call tar_manager::create_timestamped("data"), catch and warn on failure.
+While mounted, checkpoint::Checkpointer writes changes out as delta snapshots in the background.
+Every change is recorded in journal::Journal before it is applied, so after a crash the next
+mount snapshots just what the journal lists rather than all of data/.
+Files under notes/.securenotefs/ report statistics and retune it, readahead and cache timeouts live.
+SIGUSR1 writes the trace of recent requests to securenotefs-trace-<pid>-<n>.json in the CWD.
+
+After fuse_main returns, flush whatever changed since the last checkpoint, logging progress
+while it runs, then remove notes/ and data/. On failure, warn and leave data/ in place. If
+fuse_main itself failed, touch nothing. Everything after fuse_main goes through the logger,
+since the daemonized process has no terminal: pass --log=FILE to see it.
+Past --shutdown-deadline the save is cancelled and also fails: data/ and the journal are left
+for the next mount, which recovers them as it would after a crash.
 
 */
 
 #define FUSE_USE_VERSION 31
 
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
 #include <iostream>
 #include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "attr_cache.hpp"
+#include "checkpoint.hpp"
+#include "control.hpp"
 #include "fs.hpp"
+#include "journal.hpp"
+#include "negative_cache.hpp"
+#include "open_file.hpp"
+#include "prefetch.hpp"
+#include "tar_manager.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+#include "xattr.hpp"
 
-int main([[maybe_unused]] int argc, char const *argv[])
+// Value of --name=N in arg, or false if arg is not that flag
+static bool parse_flag(std::string_view arg, std::string_view name, uint64_t& out)
 {
+    if (!arg.starts_with(name) || arg.size() <= name.size() || arg[name.size()] != '=')
+        return false;
+    out = std::stoull(std::string(arg.substr(name.size() + 1)));
+    return true;
+}
+
+// Value of --name=TEXT in arg, or false if arg is not that flag
+static bool parse_flag(std::string_view arg, std::string_view name, std::string& out)
+{
+    if (!arg.starts_with(name) || arg.size() <= name.size() || arg[name.size()] != '=')
+        return false;
+    out = std::string(arg.substr(name.size() + 1));
+    return true;
+}
+
+// Log how far the final snapshot has got, once a second until done is set,
+// so a slow unmount is visibly making progress. FUSE has daemonized by now
+// and stderr is /dev/null, so like everything after fuse_main() this goes
+// through the logger and is only seen with --log.
+static void report_progress(const tar_manager::Progress& progress, std::mutex& mutex,
+                            std::condition_variable& cv, const bool& done)
+{
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!cv.wait_for(lock, std::chrono::seconds(1), [&] { return done; })) {
+        double secs = std::chrono::duration<double>(clock::now() - start).count();
+        double mib = static_cast<double>(progress.bytes_done) / (1 << 20);
+        SN_LOG_INFO("main", "saving: %" PRIu64 "/%" PRIu64 " files, %" PRIu64 "/%" PRIu64 " MiB, %" PRIu64 " MiB/s",
+                    progress.files_done.load(), progress.files_total.load(), static_cast<uint64_t>(mib),
+                    progress.bytes_total.load() >> 20, static_cast<uint64_t>(mib / secs));
+    }
+}
+
+// Cancels the checkpoints still being written once secs have passed,
+// unless destroyed first; secs of 0 never does
+class ShutdownDeadline {
+public:
+    ShutdownDeadline(checkpoint::Checkpointer& checkpoints, uint64_t secs)
+    {
+        if (secs == 0)
+            return;
+        thread_ = std::thread([this, &checkpoints, secs] {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (cv_.wait_for(lock, std::chrono::seconds(secs), [this] { return done_; }))
+                return;
+            passed_ = true;
+            lock.unlock();
+            checkpoints.cancel();
+        });
+    }
+    ShutdownDeadline(const ShutdownDeadline&) = delete;
+    ShutdownDeadline& operator=(const ShutdownDeadline&) = delete;
+
+    ~ShutdownDeadline()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    bool passed()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return passed_;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool done_ = false;
+    bool passed_ = false;
+    std::thread thread_;
+};
+
+int main(int argc, char const *argv[])
+{
+    checkpoint::Config config;
+    std::string log_path;
+    bool sole_owner = false;
+    uint64_t shutdown_deadline = 0;
+    for (int i = 1; i < argc; ++i) {
+        uint64_t value = 0;
+        std::string text;
+        utils::LogLevel level;
+        try {
+            if (std::string_view(argv[i]) == "--sole-owner")
+                sole_owner = true;
+            else if (parse_flag(argv[i], "--checkpoint-interval", value))
+                config.interval_sec = static_cast<unsigned>(value);
+            else if (parse_flag(argv[i], "--checkpoint-dirty-mb", value))
+                config.dirty_bytes = value << 20;
+            else if (parse_flag(argv[i], "--checkpoint-io-mbps", value))
+                config.io_budget = value << 20;
+            else if (parse_flag(argv[i], "--checkpoint-keep-full", value))
+                config.keep_full = static_cast<size_t>(value);
+            else if (parse_flag(argv[i], "--shutdown-deadline", value))
+                shutdown_deadline = value;
+            else if (parse_flag(argv[i], "--log", text))
+                log_path = std::filesystem::absolute(text).string();
+            else if (parse_flag(argv[i], "--log-level", text)) {
+                if (!utils::parse_log_level(text, level))
+                    throw std::invalid_argument(text);
+                utils::set_log_level(level);
+            } else
+                std::cerr << "Warning: ignoring unknown option " << argv[i] << '\n';
+        } catch (const std::exception&) {
+            std::cerr << "Warning: ignoring bad value in " << argv[i] << '\n';
+        }
+    }
+
+    // Declared first so it outlives everything that logs; FUSE points
+    // stderr at /dev/null when it daemonizes, so --log keeps the records
+    utils::Logger logger;
+    if (!log_path.empty() && !logger.open(log_path))
+        std::cerr << "Warning: cannot open log " << log_path << ", logging to stderr" << '\n';
+
     std::cout << "Running on default from CWD" << '\n';
     std::filesystem::path current_working_dir = std::filesystem::current_path();
+    std::filesystem::path data_dir = current_working_dir / "data";
 
     // Create notes and data directories
     std::filesystem::create_directory("notes");
     std::filesystem::create_directory("data");
+    utils::set_backing_root(data_dir.string());
+    bool data_was_empty = std::filesystem::is_empty(data_dir);
+
+    // Never unpack the newest snapshot before mounting, so startup time does not
+    // grow with the size of the vault. An indexed snapshot is served in place;
+    // files already in data/ (a session that never got packed) shadow it. A
+    // tarball is restored in the background, but only into an empty data/.
+    sn_context ctx;
+    tar_manager::LazySnapshot lazy;
+    tar_manager::BackgroundExtractor restore;
+    std::string snapshot = tar_manager::find_newest(current_working_dir.string());
+    if (snapshot.ends_with(".snfs")) {
+        if (lazy.open(snapshot, data_dir.string())) {
+            ctx.restore = ctx.snapshot = &lazy;
+            std::cout << "Serving " << snapshot << " in place" << '\n';
+        } else {
+            std::cerr << "Warning: cannot read " << snapshot << ", starting without it" << '\n';
+        }
+    } else if (!snapshot.empty() && data_was_empty) {
+        if (restore.open(snapshot, data_dir.string())) {
+            ctx.restore = &restore;
+            std::cout << "Restoring " << snapshot << " in the background" << '\n';
+        } else {
+            std::cerr << "Warning: cannot read " << snapshot << ", starting empty" << '\n';
+        }
+    }
+
+    // A journal left behind lists everything a crashed session changed
+    journal::Journal journal;
+    std::vector<tar_manager::Change> recovered;
+    bool crashed = false;
+    if (journal.open(current_working_dir.string(), recovered, crashed))
+        ctx.journal = &journal;
+    else
+        std::cerr << "Warning: cannot open the journal, changes are not crash-safe" << '\n';
+
+    // Checkpoint in the background so unmount only writes the last few changes.
+    // Leftovers in data/ are not in any snapshot, so they force a full one
+    // first, unless the journal says which ones changed on top of the chain.
+    bool known = crashed && ctx.journal != nullptr && ctx.snapshot != nullptr;
+    checkpoint::Checkpointer checkpoints;
+    checkpoints.setup(data_dir.string(), ctx.snapshot != nullptr ? lazy.chain() : std::vector<std::string>{},
+                      config, ctx.snapshot, ctx.restore == &restore ? &restore : nullptr,
+                      !data_was_empty && !known);
+    if (ctx.journal != nullptr)
+        checkpoints.use_journal(&journal, known ? recovered : std::vector<tar_manager::Change>{});
+    ctx.checkpoints = &checkpoints;
+
+    prefetch::Prefetcher prefetcher;
+    ctx.prefetcher = &prefetcher;
+
+    open_file::Table files;
+    ctx.files = &files;
+
+    xattr::Cache xattrs;
+    ctx.xattrs = &xattrs;
+
+    // Anyone else writing to data/ may create a name behind our back, so
+    // only trust a miss for a second unless this mount owns data/
+    negative_cache::Cache negatives(sole_owner ? std::chrono::seconds(0) : std::chrono::seconds(1));
+    ctx.negatives = &negatives;
+    attr_cache::Cache attrs(sole_owner ? std::chrono::seconds(0) : std::chrono::seconds(1));
+    ctx.attrs = &attrs;
+    ctx.sole_owner = sole_owner;
+
+    // Knobs under notes/.securenotefs/ retune the above while mounted
+    control::Panel panel;
+    ctx.control = &panel;
+
+    // kill -USR1 drops the recent request trace next to the snapshots
+    trace::Dumper tracer(current_working_dir.string());
+    ctx.tracer = &tracer;
+    ctx.logger = &logger;
 
     auto sn_oper = get_sn_operations();
     int fuse_argc = 2;
@@ -39,5 +269,65 @@ int main([[maybe_unused]] int argc, char const *argv[])
         nullptr
     };
 
-    return fuse_main(fuse_argc, const_cast<char**>(fuse_argv), sn_oper, nullptr);
+    int ret = fuse_main(fuse_argc, const_cast<char**>(fuse_argv), sn_oper, &ctx);
+
+    // Nothing may have been served at all; data/ and the journal are all
+    // there is of the last session, so leave them for the next mount
+    if (ret != 0) {
+        checkpoints.stop();
+        SN_LOG_ERROR("main", "fuse_main failed (%d), leaving data/ and the journal in place", ret);
+        return ret;
+    }
+
+    // Covers a background checkpoint stop() waits for as well as the final
+    // one, but not the wait for a .tar.gz restore, which cannot be cut short
+    ShutdownDeadline deadline(checkpoints, shutdown_deadline);
+    checkpoints.stop();
+
+    // Never pack a half-restored data/ over the snapshot it came from
+    if (ctx.restore == &restore && !restore.wait_all()) {
+        SN_LOG_WARN("main", "restore of %s failed, leaving data/ in place", snapshot.c_str());
+        return ret;
+    }
+
+    tar_manager::Progress progress;
+    std::mutex progress_mutex;
+    std::condition_variable progress_cv;
+    bool saved = false;
+    std::thread reporter(report_progress, std::cref(progress), std::ref(progress_mutex),
+                         std::ref(progress_cv), std::cref(saved));
+
+    std::string written;
+    bool ok = checkpoints.flush(written, &progress);
+    {
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        saved = true;
+    }
+    progress_cv.notify_one();
+    reporter.join();
+
+    if (!ok && deadline.passed()) {
+        SN_LOG_WARN("main", "shutdown deadline passed, leaving data/ and the journal for the next mount");
+        return ret;
+    }
+    if (!ok) {
+        SN_LOG_WARN("main", "could not archive data/, leaving it in place");
+        return ret;
+    }
+    if (written.empty())
+        SN_LOG_INFO("main", "no changes, keeping %s", snapshot.c_str());
+    else
+        SN_LOG_INFO("main", "saved %s", written.c_str());
+
+    // The snapshot chain now holds everything, durably; drop the working copies.
+    // The journal goes first: without data/ its records would hide files.
+    journal.clear();
+    std::error_code ec;
+    std::filesystem::remove_all(data_dir, ec);
+    if (ec)
+        SN_LOG_WARN("main", "could not remove data/: %s", ec.message().c_str());
+    // FUSE has chdir'd to / by now
+    std::filesystem::remove(current_working_dir / "notes", ec);
+
+    return ret;
 }
@@ -0,0 +1,77 @@
+/*
+Responsibilities of metadata:
+
+Answer the lookups getattr, readdir and open make against a mounted snapshot
+(does this path exist, what is in this directory) from one immutable table,
+so metadata-heavy walks such as `find` or `du` neither take a lock per call
+nor scan a whole subtree to list one directory.
+
+The attributes themselves stay in the snapshot index, which is mmap'd; this
+only maps paths to slots and records which slots are still served from it.
+*/
+
+#include "metadata.hpp"
+
+#include <algorithm>
+
+namespace metadata {
+
+namespace {
+
+// Directory part of a relative path, "" for top-level entries
+std::string_view parent_of(std::string_view path)
+{
+    size_t slash = path.rfind('/');
+    return slash == std::string_view::npos ? std::string_view() : path.substr(0, slash);
+}
+
+} // namespace
+
+void Index::build(std::vector<std::string_view> paths)
+{
+    paths_ = std::move(paths);
+    by_path_.clear();
+    by_path_.reserve(paths_.size());
+    for (uint32_t slot = 0; slot < paths_.size(); ++slot)
+        by_path_.emplace(paths_[slot], slot);
+
+    by_dir_.resize(paths_.size());
+    for (uint32_t slot = 0; slot < paths_.size(); ++slot)
+        by_dir_[slot] = slot;
+    std::sort(by_dir_.begin(), by_dir_.end(), [this](uint32_t a, uint32_t b) {
+        std::string_view pa = parent_of(paths_[a]), pb = parent_of(paths_[b]);
+        if (pa != pb)
+            return pa < pb;
+        return paths_[a] < paths_[b];
+    });
+
+    dirs_.clear();
+    for (uint32_t begin = 0; begin < by_dir_.size();) {
+        std::string_view dir = parent_of(paths_[by_dir_[begin]]);
+        uint32_t end = begin + 1;
+        while (end < by_dir_.size() && parent_of(paths_[by_dir_[end]]) == dir)
+            ++end;
+        dirs_.emplace(dir, std::make_pair(begin, end));
+        begin = end;
+    }
+
+    present_ = std::make_unique<std::atomic<bool>[]>(paths_.size());
+    for (size_t slot = 0; slot < paths_.size(); ++slot)
+        present_[slot].store(true, std::memory_order_relaxed);
+}
+
+uint32_t Index::find(std::string_view path) const
+{
+    auto it = by_path_.find(path);
+    return it == by_path_.end() ? NONE : it->second;
+}
+
+std::span<const uint32_t> Index::children(std::string_view dir) const
+{
+    auto it = dirs_.find(dir);
+    if (it == dirs_.end())
+        return {};
+    return std::span<const uint32_t>(by_dir_.data() + it->second.first, it->second.second - it->second.first);
+}
+
+} // namespace metadata
@@ -0,0 +1,59 @@
+#ifndef SECURENOTEFS_METADATA_HPP
+#define SECURENOTEFS_METADATA_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace metadata {
+
+// Slot returned by Index::find() for a path it does not hold
+inline constexpr uint32_t NONE = UINT32_MAX;
+
+// Path index over a fixed set of entries, built once and then read without
+// locks. Entries are grouped by directory, so listing one is a contiguous
+// range rather than a scan of everything below it. An entry can be removed
+// (it moved to data/ or was deleted) but never added back.
+class Index {
+public:
+    Index() = default;
+    Index(const Index&) = delete;
+    Index& operator=(const Index&) = delete;
+
+    // Index paths (relative, no leading '/'); slot i is paths[i]. The
+    // strings they view must outlive the index. Not thread-safe.
+    void build(std::vector<std::string_view> paths);
+
+    size_t size() const { return paths_.size(); }
+
+    // Slot of path, or NONE. Removed entries still have their slot.
+    uint32_t find(std::string_view path) const;
+
+    // Slots directly inside dir ("" for the root) in name order, removed
+    // entries included
+    std::span<const uint32_t> children(std::string_view dir) const;
+
+    std::string_view path(uint32_t slot) const { return paths_[slot]; }
+
+    bool present(uint32_t slot) const { return present_[slot].load(std::memory_order_acquire); }
+
+    // Make slot absent for good; whatever replaced it must already be in place
+    void remove(uint32_t slot) { present_[slot].store(false, std::memory_order_release); }
+
+private:
+    std::vector<std::string_view> paths_;
+    std::unordered_map<std::string_view, uint32_t> by_path_;
+    std::vector<uint32_t> by_dir_;  // slots ordered by (parent, name)
+    std::unordered_map<std::string_view, std::pair<uint32_t, uint32_t>> dirs_;  // range in by_dir_
+    std::unique_ptr<std::atomic<bool>[]> present_;
+};
+
+} // namespace metadata
+
+#endif // SECURENOTEFS_METADATA_HPP
@@ -0,0 +1,249 @@
+/*
+Responsibilities of metrics:
+
+Count calls and latencies of every FUSE callback, and of the disk, snapshot
+and crypto work inside them, cheaply enough to leave on in production.
+
+Each thread records into its own shard, so the hot path never contends.
+A shard outlives its thread and is handed to the next thread that starts,
+so nothing recorded is lost when FUSE retires idle workers.
+
+Sum the shards on demand into per-op counts and p50/p90/p99 for the stats
+file fs serves under the mount.
+
+Hand every timed scope to trace as well, while tracing is on.
+*/
+
+#include "metrics.hpp"
+#include "trace.hpp"
+
+#include <bit>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace metrics {
+
+namespace {
+
+// Everything one thread records. Only the owning thread writes it; report()
+// reads it from another thread, which is why the slots are atomics at all.
+struct Shard {
+    std::atomic<uint64_t> count[OPS];
+    std::atomic<uint64_t> total_ns[OPS];
+    std::atomic<uint64_t> max_ns[OPS];
+    std::atomic<uint64_t> buckets[OPS][BUCKETS];
+    std::atomic<uint64_t> counters[COUNTERS];
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Shard>> all;
+    std::vector<Shard*> idle;  // shards of threads that have exited
+};
+
+// Never destroyed: threads still running at exit may record into it
+Registry& registry()
+{
+    static Registry* r = new Registry;
+    return *r;
+}
+
+// Gives a thread its shard on first use and hands it back when it exits
+struct Owner {
+    Shard* shard = nullptr;
+
+    Shard& get()
+    {
+        if (shard == nullptr) {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            if (!r.idle.empty()) {
+                shard = r.idle.back();
+                r.idle.pop_back();
+            } else {
+                r.all.push_back(std::make_unique<Shard>());
+                shard = r.all.back().get();
+            }
+        }
+        return *shard;
+    }
+
+    ~Owner()
+    {
+        if (shard == nullptr)
+            return;
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.idle.push_back(shard);
+    }
+};
+
+thread_local Owner owner;
+
+// Single-writer increment: no lock prefix, readers see it eventually
+inline void bump(std::atomic<uint64_t>& slot, uint64_t n)
+{
+    slot.store(slot.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+const char* const OP_NAMES[OPS] = {
+    "getattr", "access", "readlink", "readdir", "mknod", "mkdir", "unlink", "rmdir", "symlink",
+    "rename", "link", "chmod", "chown", "truncate", "utimens", "create", "open", "read", "write",
+    "statfs", "release", "fsync", "fallocate", "setxattr", "getxattr", "listxattr",
+    "removexattr", "copy_file_range", "lseek",
+    "disk", "snapshot", "crypto", "journal",
+};
+
+const char* const COUNTER_NAMES[COUNTERS] = {
+    "read_bytes", "write_bytes", "prefetches", "syncs", "clone_bytes",
+    "negative_hits", "attr_hits",
+};
+
+} // namespace
+
+size_t bucket_of(uint64_t ns)
+{
+    if (ns < SUB_BUCKETS)
+        return static_cast<size_t>(ns);
+    unsigned msb = 63 - static_cast<unsigned>(std::countl_zero(ns));
+    if (msb > MAX_BITS)
+        return BUCKETS - 1;
+    unsigned shift = msb - SUB_BITS;
+    return static_cast<size_t>(SUB_BUCKETS * (shift + 1) + ((ns >> shift) - SUB_BUCKETS));
+}
+
+uint64_t bucket_floor(size_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    uint64_t shift = bucket / SUB_BUCKETS - 1;
+    return (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+void record(Op op, uint64_t ns)
+{
+    Shard& s = owner.get();
+    size_t i = static_cast<size_t>(op);
+    bump(s.count[i], 1);
+    bump(s.total_ns[i], ns);
+    bump(s.buckets[i][bucket_of(ns)], 1);
+    if (ns > s.max_ns[i].load(std::memory_order_relaxed))
+        s.max_ns[i].store(ns, std::memory_order_relaxed);
+}
+
+void Scope::end()
+{
+    auto now = std::chrono::steady_clock::now();
+    uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_).count());
+    record(op_, ns);
+    if (trace::enabled()) {
+        trace::Event e;
+        e.op = op_;
+        e.start_ns = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(start_.time_since_epoch()).count());
+        e.dur_ns = ns;
+        e.ino = ino_;
+        e.offset = offset_;
+        e.size = size_;
+        trace::emit(e);
+    }
+}
+
+void add(Counter counter, uint64_t n)
+{
+    bump(owner.get().counters[static_cast<size_t>(counter)], n);
+}
+
+Summary summarize(Op op)
+{
+    size_t i = static_cast<size_t>(op);
+    Summary sum;
+    std::vector<uint64_t> buckets(BUCKETS, 0);
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (const auto& s : r.all) {
+            sum.total_ns += s->total_ns[i].load(std::memory_order_relaxed);
+            uint64_t max = s->max_ns[i].load(std::memory_order_relaxed);
+            if (max > sum.max_ns)
+                sum.max_ns = max;
+            for (size_t b = 0; b < BUCKETS; ++b)
+                buckets[b] += s->buckets[i][b].load(std::memory_order_relaxed);
+        }
+    }
+    // Count from the buckets so percentiles agree with it even mid-update
+    for (uint64_t n : buckets)
+        sum.count += n;
+    if (sum.count == 0)
+        return sum;
+
+    // Report the middle of the bucket a percentile falls in
+    auto at = [&](uint64_t per_mille) {
+        uint64_t rank = (sum.count * per_mille + 999) / 1000;
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b];
+            if (seen >= rank) {
+                uint64_t lo = bucket_floor(b);
+                uint64_t hi = b + 1 < BUCKETS ? bucket_floor(b + 1) : lo + 1;
+                uint64_t mid = lo + (hi - lo) / 2;
+                return mid < sum.max_ns ? mid : sum.max_ns;
+            }
+        }
+        return sum.max_ns;
+    };
+    sum.p50_ns = at(500);
+    sum.p90_ns = at(900);
+    sum.p99_ns = at(990);
+    return sum;
+}
+
+uint64_t counter(Counter counter)
+{
+    size_t i = static_cast<size_t>(counter);
+    uint64_t total = 0;
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (const auto& s : r.all)
+        total += s->counters[i].load(std::memory_order_relaxed);
+    return total;
+}
+
+const char* name(Op op)
+{
+    return OP_NAMES[static_cast<size_t>(op)];
+}
+
+const char* name(Counter counter)
+{
+    return COUNTER_NAMES[static_cast<size_t>(counter)];
+}
+
+std::string report()
+{
+    std::string out;
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-16s %10s %10s %10s %10s %10s %10s\n",
+                  "op", "count", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    out += line;
+    auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+    for (size_t i = 0; i < OPS; ++i) {
+        Summary s = summarize(static_cast<Op>(i));
+        double mean = s.count != 0 ? us(s.total_ns) / static_cast<double>(s.count) : 0.0;
+        std::snprintf(line, sizeof(line), "%-16s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                      OP_NAMES[i], static_cast<unsigned long long>(s.count), mean,
+                      us(s.p50_ns), us(s.p90_ns), us(s.p99_ns), us(s.max_ns));
+        out += line;
+    }
+    out += '\n';
+    for (size_t i = 0; i < COUNTERS; ++i) {
+        std::snprintf(line, sizeof(line), "%-16s %10llu\n", COUNTER_NAMES[i],
+                      static_cast<unsigned long long>(counter(static_cast<Counter>(i))));
+        out += line;
+    }
+    return out;
+}
+
+} // namespace metrics
@@ -0,0 +1,104 @@
+#ifndef SECURENOTEFS_METRICS_HPP
+#define SECURENOTEFS_METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace metrics {
+
+// Everything that gets a latency histogram: one entry per FUSE callback,
+// then the phases callbacks spend their time in
+enum class Op : unsigned {
+    Getattr, Access, Readlink, Readdir, Mknod, Mkdir, Unlink, Rmdir, Symlink,
+    Rename, Link, Chmod, Chown, Truncate, Utimens, Create, Open, Read, Write,
+    Statfs, Release, Fsync, Fallocate, Setxattr, Getxattr, Listxattr,
+    Removexattr, CopyFileRange, Lseek,
+    Disk,      // pread/pwrite against data/
+    Snapshot,  // copying and checksumming blocks of the mounted snapshot
+    Crypto,    // encrypting and decrypting file contents
+    Journal,   // writing and syncing write-ahead journal records
+    Count
+};
+
+// Plain event and byte counters
+enum class Counter : unsigned {
+    ReadBytes, WriteBytes, Prefetches, Syncs, CloneBytes, NegativeHits,
+    AttrHits,
+    Count
+};
+
+inline constexpr size_t OPS = static_cast<size_t>(Op::Count);
+inline constexpr size_t COUNTERS = static_cast<size_t>(Counter::Count);
+
+// Histogram layout: values below SUB_BUCKETS ns get a bucket each, above that
+// every power of two is split into SUB_BUCKETS linear buckets, so any
+// recorded latency is off by at most 1/16 (about 6%). Values of
+// 2^(MAX_BITS + 1) ns (about 37 minutes) and up land in the last bucket.
+inline constexpr unsigned SUB_BITS = 4;
+inline constexpr uint64_t SUB_BUCKETS = 1u << SUB_BITS;
+inline constexpr unsigned MAX_BITS = 40;
+inline constexpr size_t BUCKETS = SUB_BUCKETS * (MAX_BITS - SUB_BITS + 2);
+
+// Bucket a latency in nanoseconds falls in, and the smallest value it holds
+size_t bucket_of(uint64_t ns);
+uint64_t bucket_floor(size_t bucket);
+
+// Count a latency or an event against the calling thread's counters. Each
+// thread only ever writes its own slots, so this is a couple of plain
+// relaxed loads and stores: no locks, no atomic read-modify-write.
+void record(Op op, uint64_t ns);
+void add(Counter counter, uint64_t n = 1);
+
+// Times a scope and records it against op when it ends, and in the
+// calling thread's trace ring while tracing is on
+class Scope {
+public:
+    explicit Scope(Op op) : op_(op), start_(std::chrono::steady_clock::now()) {}
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    ~Scope() { end(); }
+
+    // What the request was about, for the trace
+    void detail(uint64_t ino, uint64_t offset, uint64_t size)
+    {
+        ino_ = ino;
+        offset_ = offset;
+        size_ = size;
+    }
+
+private:
+    void end();
+
+    Op op_;
+    std::chrono::steady_clock::time_point start_;
+    uint64_t ino_ = 0;
+    uint64_t offset_ = 0;
+    uint64_t size_ = 0;
+};
+
+// Summary of one op summed over every thread
+struct Summary {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t p50_ns = 0;
+    uint64_t p90_ns = 0;
+    uint64_t p99_ns = 0;
+};
+
+Summary summarize(Op op);
+uint64_t counter(Counter counter);
+
+// Lower-case name used in the report, e.g. "copy_file_range"
+const char* name(Op op);
+const char* name(Counter counter);
+
+// Text table of every op and counter, as served from the stats file
+std::string report();
+
+} // namespace metrics
+
+#endif // SECURENOTEFS_METRICS_HPP
@@ -0,0 +1,151 @@
+/*
+Responsibilities of negative_cache:
+
+Remember which paths under data/ turned out not to exist, so repeated
+probes for them skip the backing filesystem.
+
+Never let a stale entry hide a file: creations drop the entry for their
+name, renames drop whole subtrees, and a miss racing a creation in the
+same directory is not recorded.
+*/
+
+#include "negative_cache.hpp"
+
+#include <algorithm>
+#include <functional>
+
+namespace negative_cache {
+
+namespace {
+
+// Split rel into its parent directory ("" for the root) and last component
+void split(const std::string& rel, std::string& dir, std::string& name)
+{
+    size_t slash = rel.rfind('/');
+    if (slash == std::string::npos) {
+        dir.clear();
+        name = rel;
+    } else {
+        dir = rel.substr(0, slash);
+        name = rel.substr(slash + 1);
+    }
+}
+
+} // namespace
+
+Cache::Shard& Cache::shard(const std::string& dir)
+{
+    return shards_[std::hash<std::string>()(dir) % SHARDS];
+}
+
+void Cache::trim(Shard& s, size_t limit)
+{
+    while (s.entries > limit) {
+        s.entries -= s.dirs.begin()->second.size();
+        s.dirs.erase(s.dirs.begin());
+    }
+}
+
+bool Cache::missing(const std::string& rel)
+{
+    std::string dir, name;
+    split(rel, dir, name);
+    Shard& s = shard(dir);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto d = s.dirs.find(dir);
+    if (d == s.dirs.end())
+        return false;
+    auto it = d->second.find(name);
+    if (it == d->second.end())
+        return false;
+    if (ttl_ != clock::duration::zero() && clock::now() - it->second > ttl_) {
+        d->second.erase(it);
+        --s.entries;
+        if (d->second.empty())
+            s.dirs.erase(d);
+        return false;
+    }
+    return true;
+}
+
+uint64_t Cache::generation(const std::string& rel)
+{
+    std::string dir, name;
+    split(rel, dir, name);
+    Shard& s = shard(dir);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.generation;
+}
+
+void Cache::add(const std::string& rel, uint64_t generation)
+{
+    std::string dir, name;
+    split(rel, dir, name);
+    Shard& s = shard(dir);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.generation != generation)
+        return;
+    trim(s, shard_limit_ - 1);
+    if (s.dirs[dir].insert_or_assign(name, clock::now()).second)
+        ++s.entries;
+}
+
+void Cache::forget(const std::string& rel)
+{
+    std::string dir, name;
+    split(rel, dir, name);
+    Shard& s = shard(dir);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    ++s.generation;
+    auto d = s.dirs.find(dir);
+    if (d == s.dirs.end() || d->second.erase(name) == 0)
+        return;
+    --s.entries;
+    if (d->second.empty())
+        s.dirs.erase(d);
+}
+
+void Cache::forget_tree(const std::string& rel)
+{
+    forget(rel);
+    std::string prefix = rel + "/";
+    for (auto& s : shards_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        ++s.generation;
+        for (auto d = s.dirs.begin(); d != s.dirs.end();) {
+            if (rel.empty() || d->first == rel || d->first.starts_with(prefix)) {
+                s.entries -= d->second.size();
+                d = s.dirs.erase(d);
+            } else {
+                ++d;
+            }
+        }
+    }
+}
+
+size_t Cache::size()
+{
+    size_t n = 0;
+    for (auto& s : shards_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        n += s.entries;
+    }
+    return n;
+}
+
+size_t Cache::capacity()
+{
+    return shard_limit_ * SHARDS;
+}
+
+void Cache::set_capacity(size_t entries)
+{
+    size_t limit = std::max<size_t>(1, (entries + SHARDS - 1) / SHARDS);
+    shard_limit_ = limit;
+    for (auto& s : shards_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        trim(s, limit);
+    }
+}
+
+} // namespace negative_cache
@@ -0,0 +1,77 @@
+#ifndef SECURENOTEFS_NEGATIVE_CACHE_HPP
+#define SECURENOTEFS_NEGATIVE_CACHE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace negative_cache {
+
+// Paths known not to exist in data/, relative to it, so the probes build
+// tools and editors make for .git, .editorconfig and lock files are
+// answered without an lstat. Entries are grouped by parent directory, and
+// callbacks that create a name drop the entry for it before they return.
+//
+// A lookup that misses reads generation() first and passes it to add(), so
+// a name created while the lstat ran is never recorded as missing.
+class Cache {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // Entries are trusted for ttl, or until invalidated when ttl is zero
+    explicit Cache(clock::duration ttl = clock::duration::zero()) : ttl_(ttl) {}
+    Cache(const Cache&) = delete;
+    Cache& operator=(const Cache&) = delete;
+
+    // True if rel is known to be missing
+    bool missing(const std::string& rel);
+
+    // Token to pass to add() for rel, taken before looking it up
+    uint64_t generation(const std::string& rel);
+
+    // Record rel as missing unless its directory changed since generation
+    void add(const std::string& rel, uint64_t generation);
+
+    // rel was created, or something else now lives there
+    void forget(const std::string& rel);
+
+    // forget() rel and every entry below it, for renames
+    void forget_tree(const std::string& rel);
+
+    // Paths known to be missing
+    size_t size();
+
+    // Paths kept before the oldest directories' entries are dropped;
+    // lowering it drops the excess at once
+    size_t capacity();
+    void set_capacity(size_t entries);
+
+private:
+    static constexpr size_t SHARDS = 16;
+
+    struct Shard {
+        std::mutex mutex;
+        uint64_t generation = 0;
+        // parent directory -> name -> when it was found missing
+        std::unordered_map<std::string, std::unordered_map<std::string, clock::time_point>> dirs;
+        size_t entries = 0;
+    };
+
+    Shard& shard(const std::string& dir);
+
+    // Drop whole directories until s holds at most limit entries; called
+    // with the shard locked
+    static void trim(Shard& s, size_t limit);
+
+    clock::duration ttl_;
+    std::atomic<size_t> shard_limit_{8192};
+    Shard shards_[SHARDS];
+};
+
+} // namespace negative_cache
+
+#endif // SECURENOTEFS_NEGATIVE_CACHE_HPP
@@ -0,0 +1,181 @@
+/*
+Responsibilities of open_file:
+
+Own the per-open state of one file (backing fd, snapshot entry or generated
+text, readahead tracking, traffic counters) for as long as FUSE keeps it open.
+
+Share the per-inode state between all handles open on the same backing file
+through a reference-counted table, and lock block ranges of it.
+
+Coalesce concurrent fsyncs of one inode into as few syncs as possible.
+*/
+
+#include "open_file.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "metrics.hpp"
+
+namespace open_file {
+
+Inode::Guard::Guard(Guard&& other) noexcept : inode_(other.inode_), id_(other.id_)
+{
+    other.inode_ = nullptr;
+}
+
+Inode::Guard::~Guard()
+{
+    if (inode_ != nullptr)
+        inode_->unlock(id_);
+}
+
+bool Inode::conflicts(uint64_t first, uint64_t last, bool exclusive) const
+{
+    for (const auto& h : held_)
+        if (h.first <= last && first <= h.last && (exclusive || h.exclusive))
+            return true;
+    return false;
+}
+
+Inode::Guard Inode::lock(uint64_t off, uint64_t len, bool exclusive)
+{
+    uint64_t first = off / LOCK_BLOCK_SIZE;
+    uint64_t last = len == 0 ? first : (off + std::min(len - 1, UINT64_MAX - off)) / LOCK_BLOCK_SIZE;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return !conflicts(first, last, exclusive); });
+    Guard g;
+    g.inode_ = this;
+    g.id_ = next_id_++;
+    held_.push_back({g.id_, first, last, exclusive});
+    return g;
+}
+
+void Inode::unlock(uint64_t id)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::find_if(held_.begin(), held_.end(), [&](const Held& h) { return h.id == id; });
+        *it = held_.back();
+        held_.pop_back();
+    }
+    cv_.notify_all();
+}
+
+int Inode::sync(int fd, bool datasync)
+{
+    std::unique_lock<std::mutex> lock(sync_mutex_);
+    // A sync already running may have missed writes that finished just
+    // before this call, so only the next one to start will do
+    uint64_t need = syncs_started_ + 1;
+    if (!datasync)
+        want_fsync_ = true;
+    ++sync_outcomes_[need].waiters;
+
+    while (syncs_finished_ < need) {
+        if (syncing_) {
+            sync_cv_.wait(lock);
+            continue;
+        }
+        syncing_ = true;
+        uint64_t generation = ++syncs_started_;
+        bool full = want_fsync_;
+        want_fsync_ = false;
+        lock.unlock();
+
+        int res;
+        {
+            metrics::Scope disk(metrics::Op::Disk);
+            res = full ? ::fsync(fd) : ::fdatasync(fd);
+        }
+        int error = res == -1 ? errno : 0;
+        metrics::add(metrics::Counter::Syncs);
+
+        lock.lock();
+        syncing_ = false;
+        syncs_finished_ = generation;
+        sync_outcomes_[generation].error = error;
+        sync_cv_.notify_all();
+    }
+
+    // Later syncs may have finished by now, but only this one is known to
+    // cover the caller's writes
+    auto it = sync_outcomes_.find(need);
+    int error = it->second.error;
+    if (--it->second.waiters == 0)
+        sync_outcomes_.erase(it);
+    return error;
+}
+
+Inode* Table::acquire(int fd)
+{
+    struct stat st;
+    if (::fstat(fd, &st) == -1)
+        return nullptr;
+    return acquire(st);
+}
+
+Inode* Table::acquire(const struct stat& st)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& slot = inodes_[Key{st.st_dev, st.st_ino}];
+    if (slot == nullptr)
+        slot = std::make_unique<Inode>(st.st_dev, st.st_ino);
+    ++slot->refs_;
+    return slot.get();
+}
+
+void Table::release(Inode* inode)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--inode->refs_ == 0)
+        inodes_.erase(Key{inode->dev_, inode->ino_});
+}
+
+size_t Table::size()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return inodes_.size();
+}
+
+Handle::Handle(int fd, int flags, Table* table) : fd_(fd), flags_(flags)
+{
+    if (table != nullptr && (inode_ = table->acquire(fd)) != nullptr)
+        table_ = table;
+}
+
+Handle::Handle(const tar_manager::IndexedArchive::File* archived)
+    : flags_(O_RDONLY), archived_(archived) {}
+
+Handle::Handle(std::string contents)
+    : flags_(O_RDONLY), contents_(std::move(contents)), has_contents_(true) {}
+
+bool Handle::restored(int fd, Table* table)
+{
+    std::lock_guard<std::mutex> lock(restore_mutex_);
+    if (archived() == nullptr) {
+        ::close(fd);
+        return false;
+    }
+    fd_ = fd;
+    if (table != nullptr && (inode_ = table->acquire(fd)) != nullptr)
+        table_ = table;
+    // Readers that see the entry gone see fd_ and inode_ too
+    archived_.store(nullptr, std::memory_order_release);
+    return true;
+}
+
+Handle::~Handle()
+{
+    if (inode_ != nullptr)
+        table_->release(inode_);
+    if (fd_ != -1)
+        ::close(fd_);
+}
+
+} // namespace open_file
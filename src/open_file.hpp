@@ -0,0 +1,251 @@
+#ifndef SECURENOTEFS_OPEN_FILE_HPP
+#define SECURENOTEFS_OPEN_FILE_HPP
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "prefetch.hpp"
+#include "tar_manager.hpp"
+
+namespace open_file {
+
+// Granularity of the per-inode range locks
+inline constexpr uint64_t LOCK_BLOCK_SIZE = 64 * 1024;
+
+// Traffic through one open file
+struct Stats {
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> read_bytes{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> write_bytes{0};
+    std::atomic<uint64_t> prefetches{0};
+};
+
+// State shared by every handle open on one backing inode, however many
+// processes opened it and under whichever name. Per-file crypto state and
+// caches belong here so concurrent opens do the work once.
+class Inode {
+public:
+    // Holds a locked block range until destroyed
+    class Guard {
+    public:
+        Guard() = default;
+        Guard(Guard&& other) noexcept;
+        Guard& operator=(Guard&&) = delete;
+        ~Guard();
+
+    private:
+        friend class Inode;
+        Inode* inode_ = nullptr;
+        uint64_t id_ = 0;
+    };
+
+    Inode(dev_t dev, ino_t ino) : dev_(dev), ino_(ino) {}
+    Inode(const Inode&) = delete;
+    Inode& operator=(const Inode&) = delete;
+
+    // Lock the blocks covering [off, off + len): shared to read them,
+    // exclusive to change them. Only overlapping ranges wait for each
+    // other, so writers patching different blocks of one file run in
+    // parallel on different FUSE worker threads.
+    Guard lock(uint64_t off, uint64_t len, bool exclusive);
+
+    // Lock every block
+    Guard lock_all(bool exclusive) { return lock(0, UINT64_MAX, exclusive); }
+
+    // Lock the block holding off and every one after it, e.g. to truncate
+    // to off; writers below that block carry on
+    Guard lock_from(uint64_t off, bool exclusive) { return lock(off, UINT64_MAX, exclusive); }
+
+    // Backing device and inode number
+    dev_t dev() const { return dev_; }
+    ino_t ino() const { return ino_; }
+
+    // Handles currently open on this inode
+    size_t refs() const { return refs_.load(std::memory_order_relaxed); }
+
+    // fsync(2), or fdatasync(2) with datasync set, through fd, which must be
+    // open on this inode. Returns once a sync that started after the call
+    // has finished: callers arriving while one runs wait and share the next,
+    // so a burst of fsyncs from many threads costs about two syncs. 0 or an
+    // errno value.
+    int sync(int fd, bool datasync);
+
+private:
+    friend class Table;
+
+    // One granted range, in blocks, both ends inclusive
+    struct Held {
+        uint64_t id;
+        uint64_t first;
+        uint64_t last;
+        bool exclusive;
+    };
+
+    bool conflicts(uint64_t first, uint64_t last, bool exclusive) const;
+    void unlock(uint64_t id);
+
+    dev_t dev_;
+    ino_t ino_;
+    std::atomic<size_t> refs_{0};  // changed under the table's mutex
+
+    // Granted ranges. There are never more than the FUSE worker threads,
+    // so a flat list beats an interval tree here.
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<Held> held_;
+    uint64_t next_id_ = 1;
+
+    // Group commit of sync(); apart from the range locks so a slow sync
+    // never holds up reads and writes
+    std::mutex sync_mutex_;
+    std::condition_variable sync_cv_;
+    uint64_t syncs_started_ = 0;
+    uint64_t syncs_finished_ = 0;
+    bool syncing_ = false;
+    bool want_fsync_ = false;  // a waiter needs metadata synced too
+
+    // Callers waiting on each sync generation and how it went; an entry
+    // lives until its last waiter has read the result
+    struct SyncOutcome {
+        size_t waiters = 0;
+        int error = 0;
+    };
+    std::unordered_map<uint64_t, SyncOutcome> sync_outcomes_;
+};
+
+// Every inode with at least one open handle. Handles take a reference when
+// opened and drop it when released; the last one out frees the shared state.
+class Table {
+public:
+    // Shared state for the inode fd refers to, or nullptr if fstat fails
+    Inode* acquire(int fd);
+
+    // Shared state for the inode st describes
+    Inode* acquire(const struct stat& st);
+
+    void release(Inode* inode);
+
+    // Inodes with open handles
+    size_t size();
+
+private:
+    struct Key {
+        dev_t dev;
+        ino_t ino;
+        bool operator==(const Key&) const = default;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const
+        {
+            return std::hash<uint64_t>()(static_cast<uint64_t>(k.ino) * 31 + static_cast<uint64_t>(k.dev));
+        }
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<Key, std::unique_ptr<Inode>, KeyHash> inodes_;
+};
+
+// Everything one open() of a file needs. sn_open/sn_create make one and store
+// it in fuse_file_info::fh, so later callbacks on the same file descriptor
+// never resolve the path again.
+class Handle {
+public:
+    // A file open in data/; the handle owns fd from now on. With a table,
+    // the handle shares its inode's state with every other open of it.
+    Handle(int fd, int flags, Table* table = nullptr);
+
+    // A read-only file served straight from the mounted snapshot
+    explicit Handle(const tar_manager::IndexedArchive::File* archived);
+
+    // A file under the mount's internal directory, made up when opened
+    explicit Handle(std::string contents);
+
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+    ~Handle();
+
+    // Round trip through fuse_file_info::fh
+    uint64_t to_fh() { return reinterpret_cast<uint64_t>(this); }
+    static Handle* from_fh(uint64_t fh) { return reinterpret_cast<Handle*>(fh); }
+
+    // Backing file in data/, or -1 when served from the snapshot or memory
+    int fd() const { return archived() != nullptr ? -1 : fd_; }
+
+    // open() flags the handle was created with
+    int flags() const { return flags_; }
+
+    // Snapshot entry reads come from, or nullptr
+    const tar_manager::IndexedArchive::File* archived() const
+    {
+        return archived_.load(std::memory_order_acquire);
+    }
+
+    // The archived file was copied into data/, where fd now has it: serve
+    // reads from fd from now on. Takes fd; false, closing it, if another
+    // caller switched the handle first.
+    bool restored(int fd, Table* table = nullptr);
+
+    // LazySnapshot::restores() as of the last check that the archived file
+    // was still only in the snapshot
+    uint64_t restores_seen() const { return restores_seen_.load(std::memory_order_relaxed); }
+    void set_restores_seen(uint64_t n) { restores_seen_.store(n, std::memory_order_relaxed); }
+
+    // Text of an internal file, or nullptr
+    const std::string* contents() const { return has_contents_ ? &contents_ : nullptr; }
+
+    // Shared per-inode state, or nullptr (snapshot files, no table)
+    Inode* inode() const { return inode_; }
+
+    // Lock a byte range of the inode; a no-op guard without one
+    Inode::Guard lock(uint64_t off, uint64_t len, bool exclusive)
+    {
+        return inode_ != nullptr ? inode_->lock(off, len, exclusive) : Inode::Guard();
+    }
+
+    Inode::Guard lock_all(bool exclusive)
+    {
+        return inode_ != nullptr ? inode_->lock_all(exclusive) : Inode::Guard();
+    }
+
+    Inode::Guard lock_from(uint64_t off, bool exclusive)
+    {
+        return inode_ != nullptr ? inode_->lock_from(off, exclusive) : Inode::Guard();
+    }
+
+    prefetch::Tracker& readahead() { return readahead_; }
+    Stats& stats() { return stats_; }
+
+    // Journal segment this handle's writes were last recorded in, so later
+    // writes in the same segment skip the journal
+    uint64_t journaled() const { return journaled_.load(std::memory_order_relaxed); }
+    void set_journaled(uint64_t segment) { journaled_.store(segment, std::memory_order_relaxed); }
+
+private:
+    int fd_ = -1;
+    int flags_ = 0;
+    // Set once by restored(), before archived_ is cleared
+    std::atomic<const tar_manager::IndexedArchive::File*> archived_{nullptr};
+    std::atomic<uint64_t> restores_seen_{0};
+    std::mutex restore_mutex_;
+    Table* table_ = nullptr;
+    Inode* inode_ = nullptr;
+    std::string contents_;
+    bool has_contents_ = false;
+    prefetch::Tracker readahead_;
+    Stats stats_;
+    std::atomic<uint64_t> journaled_{0};
+};
+
+} // namespace open_file
+
+#endif // SECURENOTEFS_OPEN_FILE_HPP
@@ -0,0 +1,131 @@
+/*
+Responsibilities of prefetch:
+
+Tell sequential streams apart from random access on each open file, and
+size the window to fetch ahead of a stream.
+
+Run the prefetches on worker threads, so reading a long note is bound by
+disk bandwidth rather than by one synchronous fetch per FUSE request.
+*/
+
+#include "prefetch.hpp"
+
+#include <algorithm>
+
+namespace prefetch {
+
+Window Tracker::on_read(uint64_t offset, uint64_t size, uint64_t file_size, uint64_t max_window)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t end = offset + size;
+
+    // The kernel issues readahead requests from several threads, so a stream
+    // may arrive a little out of order; anything near the expected offset counts
+    bool sequential = offset + MIN_WINDOW >= next_ && offset <= next_ + MIN_WINDOW;
+    if (!sequential) {
+        next_ = end;
+        ahead_ = 0;
+        window_ = MIN_WINDOW;
+        return {};
+    }
+    next_ = std::max(next_, end);
+
+    // Top up once the reader is within half a window of the prefetched end
+    if (ahead_ > end && ahead_ - end > window_ / 2)
+        return {};
+    uint64_t start = std::max(ahead_, end);
+    if (start >= file_size)
+        return {};
+    window_ = std::min(std::max(window_ * 2, MIN_WINDOW), std::max(max_window, MIN_WINDOW));
+    Window w{start, std::min(window_, file_size - start)};
+    ahead_ = start + w.length;
+    return w;
+}
+
+Prefetcher::~Prefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+}
+
+void Prefetcher::start()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    started_ = true;
+    spawn();
+}
+
+// Called with mutex_ held
+void Prefetcher::spawn()
+{
+    for (; running_ < workers_; ++running_)
+        threads_.emplace_back(&Prefetcher::run, this);
+}
+
+unsigned Prefetcher::workers()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return workers_;
+}
+
+void Prefetcher::set_workers(unsigned n)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        workers_ = n;
+        if (started_ && !stopping_)
+            spawn();
+    }
+    // Surplus threads wake up and retire
+    cv_.notify_all();
+}
+
+size_t Prefetcher::queue_limit()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_limit_;
+}
+
+void Prefetcher::set_queue_limit(size_t n)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_limit_ = n;
+}
+
+bool Prefetcher::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_ || running_ == 0 || queue_.size() >= queue_limit_)
+            return false;
+        queue_.push_back(std::move(job));
+    }
+    cv_.notify_one();
+    return true;
+}
+
+void Prefetcher::run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [&] { return stopping_ || running_ > workers_ || !queue_.empty(); });
+        if (stopping_)
+            return;
+        if (running_ > workers_) {
+            --running_;
+            return;
+        }
+        auto job = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
+
+} // namespace prefetch
@@ -0,0 +1,87 @@
+#ifndef SECURENOTEFS_PREFETCH_HPP
+#define SECURENOTEFS_PREFETCH_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace prefetch {
+
+// Smallest and default largest prefetch window
+inline constexpr uint64_t MIN_WINDOW = 128 * 1024;
+inline constexpr uint64_t DEFAULT_MAX_WINDOW = 2 * 1024 * 1024;
+
+// Byte range to fetch ahead of the reader; empty when length is 0
+struct Window {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+};
+
+// Watches the reads made through one open file. Once they form a stream it
+// hands out windows just past what was already prefetched, doubling each
+// time up to the maximum, so the reader never catches up with the disk.
+class Tracker {
+public:
+    // Record a read of [offset, offset + size) and return what to prefetch
+    Window on_read(uint64_t offset, uint64_t size, uint64_t file_size, uint64_t max_window);
+
+private:
+    std::mutex mutex_;          // FUSE may read one handle from several threads
+    uint64_t next_ = 0;         // where the stream is expected to continue
+    uint64_t ahead_ = 0;        // end of everything prefetched so far
+    uint64_t window_ = MIN_WINDOW;
+};
+
+// Runs prefetch work on background threads so the read that triggered it
+// returns at once. Work is best-effort: when the queue is full it is dropped.
+class Prefetcher {
+public:
+    explicit Prefetcher(unsigned workers = 2, size_t queue_limit = 64)
+        : workers_(workers), queue_limit_(queue_limit) {}
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+    ~Prefetcher();
+
+    // Start the workers; call after FUSE has daemonized
+    void start();
+
+    // Queue job unless the queue is full; false if it was dropped
+    bool submit(std::function<void()> job);
+
+    // Worker threads; changing it starts or retires threads right away
+    unsigned workers();
+    void set_workers(unsigned n);
+
+    // Jobs that may wait for a worker before new ones are dropped
+    size_t queue_limit();
+    void set_queue_limit(size_t n);
+
+    // Largest window a Tracker may hand out
+    uint64_t max_window() const { return max_window_.load(std::memory_order_relaxed); }
+    void set_max_window(uint64_t bytes) { max_window_.store(bytes, std::memory_order_relaxed); }
+
+private:
+    void run();
+    void spawn();
+
+    unsigned workers_;
+    size_t queue_limit_;
+    std::atomic<uint64_t> max_window_{DEFAULT_MAX_WINDOW};
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> queue_;
+    bool started_ = false;
+    bool stopping_ = false;
+    unsigned running_ = 0;               // threads not yet retired
+    std::vector<std::thread> threads_;   // retired ones are joined on destruction
+};
+
+} // namespace prefetch
+
+#endif // SECURENOTEFS_PREFETCH_HPP
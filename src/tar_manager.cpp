@@ -1,5 +1,5 @@
 /*
-Responsibilities of tar_manager: 
+Responsibilities of tar_manager:
 
 Use either a simple system("tar czf …") approach or integrate libarchive for pure-C++ control.
 
@@ -8,4 +8,1901 @@ bool create_timestamped(const std::string &dataDir, std::string &outFilename)
 bool extract(const std::string &tarballPath, const std::string &dataDir)
 
 Return false on error so main() can warn and preserve data/.
-*/
\ No newline at end of file
+*/
+
+/*
+Two snapshot formats are written:
+
+.tar.gz - plain ustar streams (GNU long-name records for paths over 100
+bytes) compressed with zlib, so `tar xzf` can still open them by hand. The
+first member is always MANIFEST_NAME, a compact listing of every entry, which
+lets BackgroundExtractor serve metadata before the data has been unpacked.
+Extended attributes are only in the manifest; plain tar drops them.
+
+.snfs - the default. A 4 KiB header block, every regular file's bytes at a
+4 KiB aligned offset, then the index and a fixed 32-byte footer:
+
+    header  := "SNFSARC1" base:str (zero padded to 4 KiB)
+    footer  := "SNFSIDX2" index_offset:u64 index_length:u64 index_crc:u32 block_size:u32
+    index   := count:u32 { entry offset:u64 nblocks:u32 crc32:u32 * nblocks } * count
+    entry   := type:u8 mode:u32 size:u64 mtime:u64 path:str link:str xattrs:str
+
+xattrs is the xattr::BLOB_NAME attribute of the file, which holds all the
+others. Snapshots from before it was kept end in "SNFSIDX1" and have no
+xattrs field; they are still read.
+
+A full snapshot has an empty base. A delta (a background checkpoint) names
+the snapshot it sits on and holds only what changed since: new entries, plus
+'W' whiteout entries hiding older copies of a path and everything below it.
+
+Integers are little-endian, str is a u32 length followed by the bytes. It is
+not compressed: once notes are stored encrypted there is nothing to gain, and
+uncompressed bytes can be mmap'd and served without unpacking anything.
+
+Blocks of zeros are not written, leaving holes in the snapshot file, so
+sparse and preallocated files cost no disk. Their CRCs are still in the
+index. A block the filesystem reports as a hole (SEEK_HOLE) and whose CRC is
+that of zeros is read without checksumming, carried into later snapshots
+without being read, and copied into data/ as a hole again.
+
+A .snfs is written by a pipeline so unmount time tracks disk bandwidth: a
+walker lists entries, the calling thread lays files out at their offsets,
+reader threads read and checksum 64 KiB blocks in parallel, and one writer
+writes them in any order. Readers and the writer hand batches of blocks to
+an io_engine, so with io_uring a batch costs one syscall instead of one each. Queues between the stages are bounded, which
+caps memory at PIPELINE_BUFFERS blocks. Writeback is started every
+WRITEBACK_BATCH bytes so the single fdatasync at the end has little left.
+
+Both formats are written to <name>.partial and renamed into place once on
+disk, so find_newest() never picks up a snapshot cut short by a crash.
+*/
+
+#include "tar_manager.hpp"
+#include "io_engine.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <functional>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "utils.hpp"
+#include "xattr.hpp"
+
+namespace tar_manager {
+
+namespace {
+
+constexpr size_t BLOCK = 512;
+constexpr size_t COPY_CHUNK = 64 * 1024;
+constexpr const char* PREFIX = "notes-data-";
+constexpr const char* TARGZ_SUFFIX = ".tar.gz";
+constexpr const char* INDEX_SUFFIX = ".snfs";
+constexpr uint32_t MANIFEST_MAGIC = 0x534e4d32;    // "SNM2"
+constexpr uint32_t MANIFEST_MAGIC_V1 = 0x534e4d31; // "SNM1", entries without xattrs
+constexpr char INDEX_HEAD_MAGIC[8] = {'S', 'N', 'F', 'S', 'A', 'R', 'C', '1'};
+constexpr char INDEX_FOOT_MAGIC[8] = {'S', 'N', 'F', 'S', 'I', 'D', 'X', '2'};
+constexpr char INDEX_FOOT_MAGIC_V1[8] = {'S', 'N', 'F', 'S', 'I', 'D', 'X', '1'};
+constexpr uint64_t INDEX_ALIGN = 4096;
+constexpr size_t INDEX_FOOTER = 32;
+constexpr const char* PARTIAL_SUFFIX = ".partial";
+constexpr unsigned PIPELINE_READERS = 4;           // blocks read and checksummed in parallel
+constexpr size_t PIPELINE_BUFFERS = 64;            // blocks in flight between stages
+constexpr unsigned PIPELINE_BATCH = 16;            // blocks per io_engine submission
+constexpr uint64_t WRITEBACK_BATCH = 32ull << 20;  // start writeback every this many bytes
+
+struct Header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+static_assert(sizeof(Header) == BLOCK, "ustar header must be one block");
+
+// Octal field, falling back to GNU base-256 when the value does not fit
+void put_number(char* field, size_t len, uint64_t value)
+{
+    uint64_t limit = 1;
+    for (size_t i = 0; i < len - 1; ++i)
+        limit *= 8;
+    if (value < limit) {
+        field[len - 1] = '\0';
+        for (size_t i = len - 1; i-- > 0; value /= 8)
+            field[i] = static_cast<char>('0' + (value % 8));
+        return;
+    }
+    std::memset(field, 0, len);
+    for (size_t i = len; i-- > 1; value >>= 8)
+        field[i] = static_cast<char>(value & 0xff);
+    field[0] = static_cast<char>(0x80);
+}
+
+uint64_t get_number(const char* field, size_t len)
+{
+    uint64_t value = 0;
+    if (static_cast<unsigned char>(field[0]) & 0x80) {
+        for (size_t i = 1; i < len; ++i)
+            value = (value << 8) | static_cast<unsigned char>(field[i]);
+        return value;
+    }
+    for (size_t i = 0; i < len && field[i]; ++i) {
+        if (field[i] >= '0' && field[i] <= '7')
+            value = value * 8 + static_cast<uint64_t>(field[i] - '0');
+    }
+    return value;
+}
+
+unsigned int checksum(const Header& h)
+{
+    Header copy = h;
+    std::memset(copy.chksum, ' ', sizeof(copy.chksum));
+    const auto* bytes = reinterpret_cast<const unsigned char*>(&copy);
+    unsigned int sum = 0;
+    for (size_t i = 0; i < BLOCK; ++i)
+        sum += bytes[i];
+    return sum;
+}
+
+bool write_all(gzFile gz, const void* buf, size_t len)
+{
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        unsigned int n = static_cast<unsigned int>(std::min(len, COPY_CHUNK));
+        if (gzwrite(gz, p, n) != static_cast<int>(n))
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool read_all(gzFile gz, void* buf, size_t len)
+{
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+        unsigned int n = static_cast<unsigned int>(std::min(len, COPY_CHUNK));
+        int got = gzread(gz, p, n);
+        if (got <= 0)
+            return false;
+        p += got;
+        len -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+bool write_padding(gzFile gz, uint64_t size)
+{
+    static const char zeros[BLOCK] = {};
+    size_t rem = size % BLOCK;
+    return rem == 0 || write_all(gz, zeros, BLOCK - rem);
+}
+
+bool skip_bytes(gzFile gz, uint64_t len)
+{
+    char buf[BLOCK * 16];
+    while (len > 0) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(len, sizeof(buf)));
+        if (!read_all(gz, buf, n))
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
+uint64_t padded(uint64_t size)
+{
+    return (size + BLOCK - 1) / BLOCK * BLOCK;
+}
+
+bool write_header(gzFile gz, const Entry& e);
+
+// GNU 'L'/'K' record carrying a name that does not fit the ustar field
+bool write_long_name(gzFile gz, char type, const std::string& name)
+{
+    Entry rec;
+    rec.path = "././@LongLink";
+    rec.type = type;
+    rec.size = name.size() + 1;
+    return write_header(gz, rec) && write_all(gz, name.c_str(), name.size() + 1) &&
+           write_padding(gz, rec.size);
+}
+
+bool write_header(gzFile gz, const Entry& e)
+{
+    std::string name = e.type == '5' ? e.path + "/" : e.path;
+    if (name.size() > sizeof(Header::name) && !write_long_name(gz, 'L', name))
+        return false;
+    if (e.link.size() > sizeof(Header::linkname) && !write_long_name(gz, 'K', e.link))
+        return false;
+
+    Header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.name, name.data(), std::min(name.size(), sizeof(h.name)));
+    std::memcpy(h.linkname, e.link.data(), std::min(e.link.size(), sizeof(h.linkname)));
+    put_number(h.mode, sizeof(h.mode), e.mode & 07777);
+    put_number(h.uid, sizeof(h.uid), 0);
+    put_number(h.gid, sizeof(h.gid), 0);
+    put_number(h.size, sizeof(h.size), e.type == '0' || e.type == 'L' || e.type == 'K' ? e.size : 0);
+    put_number(h.mtime, sizeof(h.mtime), static_cast<uint64_t>(std::max<int64_t>(e.mtime, 0)));
+    h.typeflag = e.type;
+    std::memcpy(h.magic, "ustar", 6);
+    std::memcpy(h.version, "00", 2);
+    put_number(h.chksum, 7, checksum(h));
+    h.chksum[7] = ' ';
+    return write_all(gz, &h, sizeof(h));
+}
+
+// Result of read_header(): a member, the end-of-archive marker, or an error
+enum class Next { Member, End, Error };
+
+Next read_header(gzFile gz, Entry& e)
+{
+    std::string long_name, long_link;
+    for (;;) {
+        Header h;
+        if (!read_all(gz, &h, sizeof(h)))
+            return Next::Error;
+
+        const auto* bytes = reinterpret_cast<const unsigned char*>(&h);
+        if (std::all_of(bytes, bytes + BLOCK, [](unsigned char c) { return c == 0; }))
+            return Next::End;
+        if (get_number(h.chksum, sizeof(h.chksum)) != checksum(h))
+            return Next::Error;
+
+        uint64_t size = get_number(h.size, sizeof(h.size));
+        if (h.typeflag == 'L' || h.typeflag == 'K') {
+            std::string value(static_cast<size_t>(size), '\0');
+            if (!read_all(gz, value.data(), value.size()) || !skip_bytes(gz, padded(size) - size))
+                return Next::Error;
+            value.resize(std::strlen(value.c_str()));
+            (h.typeflag == 'L' ? long_name : long_link) = value;
+            continue;
+        }
+
+        std::string name = long_name;
+        if (name.empty()) {
+            if (h.prefix[0])
+                name = std::string(h.prefix, strnlen(h.prefix, sizeof(h.prefix))) + "/";
+            name += std::string(h.name, strnlen(h.name, sizeof(h.name)));
+        }
+        while (name.size() > 1 && name.back() == '/')
+            name.pop_back();
+        if (name.starts_with("./"))
+            name.erase(0, 2);
+
+        e.path = name;
+        e.type = h.typeflag == '\0' ? '0' : h.typeflag;
+        e.mode = static_cast<mode_t>(get_number(h.mode, sizeof(h.mode)));
+        e.size = size;
+        e.mtime = static_cast<int64_t>(get_number(h.mtime, sizeof(h.mtime)));
+        e.link = long_link.empty() ? std::string(h.linkname, strnlen(h.linkname, sizeof(h.linkname)))
+                                   : long_link;
+        return Next::Member;
+    }
+}
+
+// Refuse absolute paths and ".." so a crafted archive cannot escape data/
+bool safe_path(const std::string& rel)
+{
+    if (rel.empty() || rel.front() == '/')
+        return false;
+    for (const auto& part : std::filesystem::path(rel))
+        if (part == "..")
+            return false;
+    return true;
+}
+
+void put_u32(std::string& out, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+}
+
+void put_u64(std::string& out, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i)
+        out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+}
+
+bool get_u32(const std::string& in, size_t& pos, uint32_t& v)
+{
+    if (pos + 4 > in.size())
+        return false;
+    v = 0;
+    for (int i = 0; i < 4; ++i)
+        v |= static_cast<uint32_t>(static_cast<unsigned char>(in[pos + i])) << (8 * i);
+    pos += 4;
+    return true;
+}
+
+bool get_u64(const std::string& in, size_t& pos, uint64_t& v)
+{
+    if (pos + 8 > in.size())
+        return false;
+    v = 0;
+    for (int i = 0; i < 8; ++i)
+        v |= static_cast<uint64_t>(static_cast<unsigned char>(in[pos + i])) << (8 * i);
+    pos += 8;
+    return true;
+}
+
+bool get_str(const std::string& in, size_t& pos, std::string& s)
+{
+    uint32_t len;
+    if (!get_u32(in, pos, len) || pos + len > in.size())
+        return false;
+    s.assign(in, pos, len);
+    pos += len;
+    return true;
+}
+
+void put_entry(std::string& out, const Entry& e)
+{
+    out.push_back(e.type);
+    put_u32(out, e.mode);
+    put_u64(out, e.size);
+    put_u64(out, static_cast<uint64_t>(e.mtime));
+    put_u32(out, static_cast<uint32_t>(e.path.size()));
+    out += e.path;
+    put_u32(out, static_cast<uint32_t>(e.link.size()));
+    out += e.link;
+    put_u32(out, static_cast<uint32_t>(e.xattrs.size()));
+    out += e.xattrs;
+}
+
+// xattrs is false for entries written before they carried attributes
+bool get_entry(const std::string& in, size_t& pos, Entry& e, bool xattrs)
+{
+    uint32_t mode;
+    uint64_t mtime;
+    if (pos >= in.size())
+        return false;
+    e.type = in[pos++];
+    if (!get_u32(in, pos, mode) || !get_u64(in, pos, e.size) || !get_u64(in, pos, mtime) ||
+        !get_str(in, pos, e.path) || !get_str(in, pos, e.link))
+        return false;
+    if (xattrs && !get_str(in, pos, e.xattrs))
+        return false;
+    e.mode = mode;
+    e.mtime = static_cast<int64_t>(mtime);
+    return true;
+}
+
+std::string encode_manifest(const std::vector<Entry>& entries)
+{
+    std::string out;
+    put_u32(out, MANIFEST_MAGIC);
+    put_u32(out, static_cast<uint32_t>(entries.size()));
+    for (const auto& e : entries)
+        put_entry(out, e);
+    return out;
+}
+
+bool decode_manifest(const std::string& in, std::vector<Entry>& entries)
+{
+    size_t pos = 0;
+    uint32_t magic, count;
+    if (!get_u32(in, pos, magic) || (magic != MANIFEST_MAGIC && magic != MANIFEST_MAGIC_V1) ||
+        !get_u32(in, pos, count))
+        return false;
+    entries.clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        Entry e;
+        if (!get_entry(in, pos, e, magic == MANIFEST_MAGIC))
+            return false;
+        entries.push_back(std::move(e));
+    }
+    return true;
+}
+
+// Pending entries directly inside rel, from a map ordered by path
+template <typename Map, typename Fn>
+void for_each_child(const Map& pending, const std::string& rel, Fn fn)
+{
+    std::string prefix = rel.empty() ? rel : rel + "/";
+    for (auto it = pending.lower_bound(prefix); it != pending.end() && it->first.starts_with(prefix); ++it) {
+        if (it->first.find('/', prefix.size()) == std::string::npos)
+            fn(it->second);
+    }
+}
+
+// Whether an ordered pending map holds anything at or below rel
+template <typename Map>
+bool any_under(const Map& pending, const std::string& rel)
+{
+    if (rel.empty())
+        return !pending.empty();
+    if (pending.count(rel))
+        return true;
+    std::string prefix = rel + "/";
+    auto it = pending.lower_bound(prefix);
+    return it != pending.end() && it->first.starts_with(prefix);
+}
+
+// The xattr::BLOB_NAME attribute of path into blob, empty if it has none
+bool read_xattrs(const std::string& path, std::string& blob)
+{
+    blob.clear();
+    for (;;) {
+        ssize_t len = ::lgetxattr(path.c_str(), xattr::BLOB_NAME, nullptr, 0);
+        // Symlinks cannot carry user attributes, nor can some filesystems
+        if (len == -1 && (errno == ENODATA || errno == ENOTSUP || errno == EPERM))
+            return true;
+        if (len == -1)
+            return false;
+        blob.resize(static_cast<size_t>(len));
+        len = ::lgetxattr(path.c_str(), xattr::BLOB_NAME, blob.data(), blob.size());
+        if (len == -1 && errno == ERANGE)
+            continue;  // grew in between
+        if (len == -1)
+            return false;
+        blob.resize(static_cast<size_t>(len));
+        return true;
+    }
+}
+
+// Put attributes read by read_xattrs() back on a restored file
+bool write_xattrs(const std::string& path, const std::string& blob)
+{
+    if (blob.empty())
+        return true;
+    if (::lsetxattr(path.c_str(), xattr::BLOB_NAME, blob.data(), blob.size(), 0) == 0)
+        return true;
+    SN_LOG_WARN("tar_manager", "cannot restore extended attributes of %s: %s", path.c_str(), strerror(errno));
+    return false;
+}
+
+// Call fn for every directory, regular file and symlink under dataDir,
+// parents first; stops early and returns false once fn does
+template <typename Fn>
+bool walk_entries(const std::string& dataDir, Fn fn)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::recursive_directory_iterator it(dataDir, fs::directory_options::none, ec);
+    for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        struct stat st;
+        if (lstat(it->path().c_str(), &st) == -1)
+            return false;
+
+        Entry e;
+        e.path = it->path().lexically_relative(dataDir).generic_string();
+        e.mode = st.st_mode & 07777;
+        e.mtime = st.st_mtime;
+        if (S_ISDIR(st.st_mode)) {
+            e.type = '5';
+        } else if (S_ISREG(st.st_mode)) {
+            e.type = '0';
+            e.size = static_cast<uint64_t>(st.st_size);
+        } else if (S_ISLNK(st.st_mode)) {
+            e.type = '2';
+            e.link = fs::read_symlink(it->path(), ec).string();
+            if (ec)
+                return false;
+        } else {
+            continue; // fifos and device nodes are not worth preserving
+        }
+        if (!read_xattrs(it->path().string(), e.xattrs))
+            return false;
+        if (!fn(std::move(e)))
+            return false;
+    }
+    return !ec;
+}
+
+// Every directory, regular file and symlink under dataDir, parents first
+bool collect_entries(const std::string& dataDir, std::vector<Entry>& entries)
+{
+    return walk_entries(dataDir, [&](Entry e) {
+        entries.push_back(std::move(e));
+        return true;
+    });
+}
+
+bool write_file_data(gzFile gz, const std::string& path, uint64_t size)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    std::vector<char> buf(COPY_CHUNK);
+    uint64_t done = 0;
+    bool ok = true;
+    while (ok && done < size) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(size - done, buf.size()));
+        ssize_t got = ::read(fd, buf.data(), want);
+        if (got < 0) {
+            ok = false;
+            break;
+        }
+        if (got == 0) {
+            // File shrank since it was listed; keep the header honest
+            std::fill(buf.begin(), buf.end(), 0);
+            got = static_cast<ssize_t>(want);
+        }
+        ok = write_all(gz, buf.data(), static_cast<size_t>(got));
+        done += static_cast<uint64_t>(got);
+    }
+    ::close(fd);
+    return ok && write_padding(gz, size);
+}
+
+// Write one member's contents from the stream to dataDir/e.path
+bool extract_member(gzFile gz, const Entry& e, const std::string& dataDir)
+{
+    std::string dest = dataDir + "/" + e.path;
+    uint64_t data_len = padded(e.size);
+
+    if (!safe_path(e.path))
+        return skip_bytes(gz, data_len);
+
+    if (e.type == '5') {
+        std::error_code ec;
+        std::filesystem::create_directories(dest, ec);
+        if (ec)
+            return false;
+        // Keep the owner bits so later members can still be written inside
+        ::chmod(dest.c_str(), (e.mode & 07777) | S_IRWXU);
+        write_xattrs(dest, e.xattrs);
+        return skip_bytes(gz, data_len);
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(dest).parent_path(), ec);
+
+    if (e.type == '2') {
+        ::unlink(dest.c_str());
+        if (::symlink(e.link.c_str(), dest.c_str()) == -1)
+            return false;
+        return skip_bytes(gz, data_len);
+    }
+    if (e.type != '0')
+        return skip_bytes(gz, data_len);
+
+    int fd = ::open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, e.mode & 07777);
+    if (fd == -1)
+        return false;
+
+    std::vector<char> buf(COPY_CHUNK);
+    uint64_t left = e.size;
+    bool ok = true;
+    while (ok && left > 0) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(left, buf.size()));
+        ok = read_all(gz, buf.data(), n) && ::write(fd, buf.data(), n) == static_cast<ssize_t>(n);
+        left -= n;
+    }
+    write_xattrs(dest, e.xattrs);
+    ::fchmod(fd, e.mode & 07777);
+    struct timespec times[2] = {{0, UTIME_OMIT}, {static_cast<time_t>(e.mtime), 0}};
+    ::futimens(fd, times);
+    ::close(fd);
+    return ok && skip_bytes(gz, padded(e.size) - e.size);
+}
+
+bool cancelled(const Progress* progress)
+{
+    return progress != nullptr && progress->cancelled;
+}
+
+// notes-data-<timestamp><suffix> next to dataDir; milliseconds keep
+// back-to-back checkpoints apart and still sort lexically
+std::string timestamped_name(const std::string& dataDir, const char* suffix)
+{
+    using namespace std::chrono;
+    auto now = system_clock::now();
+    std::time_t secs = system_clock::to_time_t(now);
+    char stamp[32];
+    size_t len = std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", std::localtime(&secs));
+    std::snprintf(stamp + len, sizeof(stamp) - len, "-%03d",
+                  static_cast<int>(duration_cast<milliseconds>(now.time_since_epoch()).count() % 1000));
+
+    std::filesystem::path parent = std::filesystem::absolute(dataDir).lexically_normal().parent_path();
+    if (parent.filename().empty())
+        parent = parent.parent_path();
+    return (parent / (std::string(PREFIX) + stamp + suffix)).string();
+}
+
+bool write_tarball(const std::string& dataDir, const std::vector<Entry>& entries,
+                   const std::string& outFilename, Progress* progress)
+{
+    gzFile gz = gzopen(outFilename.c_str(), "wb6");
+    if (gz == nullptr)
+        return false;
+
+    Entry manifest;
+    manifest.path = MANIFEST_NAME;
+    manifest.mode = 0600;
+    std::string blob = encode_manifest(entries);
+    manifest.size = blob.size();
+    bool ok = write_header(gz, manifest) && write_all(gz, blob.data(), blob.size()) &&
+              write_padding(gz, blob.size());
+
+    if (progress != nullptr) {
+        progress->files_total += entries.size();
+        for (const auto& e : entries)
+            progress->bytes_total += e.size;
+    }
+    for (const auto& e : entries) {
+        if (!ok || cancelled(progress))
+            break;
+        ok = write_header(gz, e);
+        if (ok && e.type == '0')
+            ok = write_file_data(gz, dataDir + "/" + e.path, e.size);
+        if (progress != nullptr) {
+            ++progress->files_done;
+            progress->bytes_done += e.size;
+        }
+    }
+
+    static const char trailer[BLOCK * 2] = {};
+    ok = ok && !cancelled(progress) && write_all(gz, trailer, sizeof(trailer));
+    if (gzclose(gz) != Z_OK)
+        ok = false;
+
+    // gzclose() does not sync, and the file is about to be renamed into place
+    int fd = ok ? ::open(outFilename.c_str(), O_RDONLY) : -1;
+    ok = fd != -1 && ::fdatasync(fd) == 0;
+    if (fd != -1)
+        ::close(fd);
+    return ok;
+}
+
+// CRC of len zero bytes, len at most INDEX_BLOCK_SIZE
+uint32_t zero_crc(size_t len)
+{
+    static const std::vector<char> zeros(INDEX_BLOCK_SIZE, '\0');
+    static const uint32_t full = static_cast<uint32_t>(
+        crc32(0L, reinterpret_cast<const Bytef*>(zeros.data()), INDEX_BLOCK_SIZE));
+    if (len == INDEX_BLOCK_SIZE)
+        return full;
+    return static_cast<uint32_t>(crc32(0L, reinterpret_cast<const Bytef*>(zeros.data()), static_cast<uInt>(len)));
+}
+
+bool all_zero(const char* p, size_t len)
+{
+    return len == 0 || (p[0] == 0 && std::memcmp(p, p + 1, len - 1) == 0);
+}
+
+using Ranges = std::vector<std::pair<uint64_t, uint64_t>>;
+
+// Holes of fd within [from, to) as sorted [start, end) ranges; none where
+// the filesystem cannot tell
+Ranges hole_ranges(int fd, uint64_t from, uint64_t to)
+{
+    Ranges holes;
+    uint64_t pos = from;
+    while (pos < to) {
+        off_t hole = ::lseek(fd, static_cast<off_t>(pos), SEEK_HOLE);
+        if (hole == -1 || static_cast<uint64_t>(hole) >= to)
+            break;
+        off_t data = ::lseek(fd, hole, SEEK_DATA);
+        uint64_t end = data == -1 ? to : std::min<uint64_t>(static_cast<uint64_t>(data), to);
+        holes.emplace_back(static_cast<uint64_t>(hole), end);
+        pos = end;
+    }
+    return holes;
+}
+
+// Which INDEX_BLOCK_SIZE blocks of the size bytes at base lie wholly in holes
+std::vector<bool> hole_blocks(const Ranges& holes, uint64_t base, uint64_t size)
+{
+    uint64_t nblocks = (size + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE;
+    std::vector<bool> out(nblocks);
+    auto it = std::lower_bound(holes.begin(), holes.end(), base,
+                               [](const auto& h, uint64_t at) { return h.second <= at; });
+    for (; it != holes.end() && it->first < base + size; ++it) {
+        uint64_t b = (std::max(it->first, base) - base + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE;
+        for (; b < nblocks && base + std::min<uint64_t>((b + 1) * INDEX_BLOCK_SIZE, size) <= it->second; ++b)
+            out[b] = true;
+    }
+    return out;
+}
+
+// Rename a finished snapshot to its final name and make the rename durable
+bool publish(const std::string& partial, const std::string& outFilename)
+{
+    if (::rename(partial.c_str(), outFilename.c_str()) == -1)
+        return false;
+    std::string dir = std::filesystem::path(outFilename).parent_path().string();
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        return false;
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+bool pwrite_all(int fd, const void* buf, size_t len, uint64_t off)
+{
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t n = ::pwrite(fd, p, len, static_cast<off_t>(off));
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+        off += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+// One file headed for an indexed snapshot, from data/ or a previous snapshot
+struct IndexSource {
+    Entry entry;
+    const IndexedArchive::File* file = nullptr;
+};
+
+// Feeds one snapshot's entries to the pipeline; emit returns false once the
+// pipeline has failed, and the walk should stop and return false too
+using Emit = std::function<bool(IndexSource)>;
+using Walk = std::function<bool(const Emit&)>;
+
+// Closable FIFO between pipeline stages that blocks producers once full
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+    // false once the queue is closed
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [&] { return closed_ || items_.size() < capacity_; });
+        if (closed_)
+            return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // false if nothing is queued right now
+    bool try_pop(T& item)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (items_.empty())
+            return false;
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // false once the queue is closed and drained
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+        if (items_.empty())
+            return false;
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};
+
+// A file laid out in the snapshot being written. Lives in a deque so the
+// reader and writer threads can hold pointers while more are added.
+struct Planned {
+    IndexSource src;
+    uint64_t offset = 0;
+    std::vector<uint32_t> crcs;       // one slot per block, filled by readers
+    int fd = -1;                      // closed by whichever reader finishes last
+    std::atomic<uint64_t> unread{0};
+    std::atomic<uint64_t> unwritten{0};
+};
+
+struct BlockJob {
+    Planned* file = nullptr;
+    uint64_t block = 0;
+};
+
+struct BlockData {
+    Planned* file = nullptr;
+    uint64_t block = 0;
+    std::vector<char> buf;
+    size_t len = 0;
+    bool zero = false;  // left as a hole rather than written
+};
+
+bool write_indexed(const std::string& dataDir, const Walk& walk, const std::string& outFilename,
+                   const std::string& base, Throttle* throttle, Progress* progress)
+{
+    int out = ::open(outFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out == -1)
+        return false;
+
+    std::string head(INDEX_HEAD_MAGIC, sizeof(INDEX_HEAD_MAGIC));
+    std::string base_name = std::filesystem::path(base).filename().string();
+    put_u32(head, static_cast<uint32_t>(base_name.size()));
+    head += base_name;
+    head.resize(INDEX_ALIGN, '\0');
+    std::atomic<bool> failed{!pwrite_all(out, head.data(), head.size(), 0)};
+
+    BoundedQueue<IndexSource> sources(PIPELINE_BUFFERS);
+    BoundedQueue<BlockJob> jobs(PIPELINE_BUFFERS);
+    BoundedQueue<std::vector<char>> pool(PIPELINE_BUFFERS);
+    BoundedQueue<BlockData> blocks(PIPELINE_BUFFERS);
+    std::vector<char*> buffers;
+    for (size_t i = 0; i < PIPELINE_BUFFERS; ++i) {
+        std::vector<char> buf(INDEX_BLOCK_SIZE);
+        buffers.push_back(buf.data());
+        pool.push(std::move(buf));
+    }
+
+    // Unblock every stage; each drains what it holds and exits
+    auto abort = [&] {
+        failed = true;
+        sources.close();
+        jobs.close();
+        pool.close();
+        blocks.close();
+    };
+
+    std::thread walker([&] {
+        if (!walk([&](IndexSource src) { return sources.push(std::move(src)); }))
+            abort();
+        sources.close();
+    });
+
+    // Readers take up to PIPELINE_BATCH blocks at once and read the ones in
+    // data/ with a single engine submission. Only the first buffer of a batch
+    // waits for the writer to free one, so readers never hoard the pool.
+    auto read_blocks = [&] {
+        auto engine = io_engine::make_engine(PIPELINE_BATCH);
+        engine->register_buffers(buffers, INDEX_BLOCK_SIZE);
+        std::vector<BlockData> batch;
+        std::vector<io_engine::Op> ops;
+        std::vector<size_t> op_block;  // batch slot of each op
+        BlockJob job;
+        while (jobs.pop(job)) {
+            if (!failed && cancelled(progress))
+                abort();
+            batch.clear();
+            std::vector<char> buf;
+            if (!failed && pool.pop(buf)) {
+                batch.push_back({job.file, job.block, std::move(buf), 0});
+                while (batch.size() < PIPELINE_BATCH && pool.try_pop(buf)) {
+                    if (!jobs.try_pop(job)) {
+                        pool.push(std::move(buf));
+                        break;
+                    }
+                    batch.push_back({job.file, job.block, std::move(buf), 0});
+                }
+            } else {
+                // Aborting: account for the job so its file still gets closed
+                batch.push_back({job.file, job.block, {}, 0});
+            }
+
+            ops.clear();
+            op_block.clear();
+            uint64_t total = 0;
+            for (size_t i = 0; i < batch.size() && !failed; ++i) {
+                BlockData& b = batch[i];
+                uint64_t at = b.block * INDEX_BLOCK_SIZE;
+                b.len = static_cast<size_t>(std::min<uint64_t>(b.file->src.entry.size - at, INDEX_BLOCK_SIZE));
+                total += b.len;
+                if (b.file->src.file == nullptr) {
+                    ops.push_back({false, b.file->fd, b.buf.data(), b.len, at, 0});
+                    op_block.push_back(i);
+                }
+            }
+            if (throttle != nullptr && total > 0)
+                throttle->take(total);
+            if (!failed && !engine->run(ops))
+                abort();
+
+            size_t next_op = 0;
+            for (size_t i = 0; i < batch.size() && !failed; ++i) {
+                BlockData& b = batch[i];
+                const Planned& p = *b.file;
+                ssize_t got;
+                if (next_op < op_block.size() && op_block[next_op] == i)
+                    got = ops[next_op++].result;
+                else
+                    got = p.src.file->owner->read(*p.src.file, b.buf.data(), b.len,
+                                                  static_cast<off_t>(b.block * INDEX_BLOCK_SIZE));
+                if (got < 0) {
+                    abort();
+                    break;
+                }
+                if (static_cast<size_t>(got) < b.len) // file shrank; keep the index honest
+                    std::fill(b.buf.begin() + got, b.buf.begin() + static_cast<ptrdiff_t>(b.len), 0);
+                uint32_t crc = static_cast<uint32_t>(
+                    crc32(0L, reinterpret_cast<const Bytef*>(b.buf.data()), static_cast<uInt>(b.len)));
+                b.file->crcs[b.block] = crc;
+                b.zero = crc == zero_crc(b.len) && all_zero(b.buf.data(), b.len);
+            }
+            for (auto& b : batch) {
+                Planned& p = *b.file;
+                if (!failed)
+                    blocks.push(std::move(b));
+                if (--p.unread == 0 && p.fd != -1) {
+                    ::close(p.fd);
+                    p.fd = -1;
+                }
+            }
+        }
+    };
+    std::vector<std::thread> readers;
+    for (unsigned i = 0; i < PIPELINE_READERS; ++i)
+        readers.emplace_back(read_blocks);
+
+    // The writer likewise submits whatever blocks are queued in one batch
+    std::thread writer([&] {
+        auto engine = io_engine::make_engine(PIPELINE_BATCH);
+        engine->register_buffers(buffers, INDEX_BLOCK_SIZE);
+        std::vector<BlockData> batch;
+        std::vector<io_engine::Op> ops;
+        uint64_t unsynced = 0;
+        BlockData b;
+        while (blocks.pop(b)) {
+            batch.clear();
+            batch.push_back(std::move(b));
+            while (batch.size() < PIPELINE_BATCH && blocks.try_pop(b))
+                batch.push_back(std::move(b));
+            if (failed)
+                continue;
+
+            ops.clear();
+            for (auto& w : batch)
+                if (!w.zero)
+                    ops.push_back({true, out, w.buf.data(), w.len, w.file->offset + w.block * INDEX_BLOCK_SIZE, 0});
+            if (!engine->run(ops)) {
+                abort();
+                continue;
+            }
+            for (auto& w : batch) {
+                unsynced += w.len;
+                if (progress != nullptr) {
+                    progress->bytes_done += w.len;
+                    if (--w.file->unwritten == 0)
+                        ++progress->files_done;
+                }
+                pool.push(std::move(w.buf));
+            }
+            if (unsynced >= WRITEBACK_BATCH) {
+                ::sync_file_range(out, 0, 0, SYNC_FILE_RANGE_WRITE);
+                unsynced = 0;
+            }
+        }
+    });
+
+    // Lay files out in walk order and hand their blocks to the readers
+    std::deque<Planned> planned;
+    uint64_t off = INDEX_ALIGN;
+    IndexSource src;
+    while (sources.pop(src)) {
+        if (!failed && cancelled(progress))
+            abort();
+        if (failed)
+            continue;
+        Planned& p = planned.emplace_back();
+        p.src = std::move(src);
+        const Entry& e = p.src.entry;
+        uint64_t nblocks = e.type == '0' ? (e.size + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE : 0;
+        if (progress != nullptr) {
+            ++progress->files_total;
+            progress->bytes_total += e.type == '0' ? e.size : 0;
+            if (nblocks == 0)
+                ++progress->files_done;
+        }
+        if (e.type != '0')
+            continue;
+        p.offset = off;
+        off = (off + e.size + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+        if (nblocks == 0)
+            continue;
+        if (p.src.file == nullptr && (p.fd = ::open((dataDir + "/" + e.path).c_str(), O_RDONLY)) == -1) {
+            abort();
+            continue;
+        }
+        // Holes need neither reading nor writing, only their CRC
+        std::vector<bool> holes = p.src.file != nullptr ? p.src.file->owner->holes(*p.src.file)
+                                                        : hole_blocks(hole_ranges(p.fd, 0, e.size), 0, e.size);
+        p.crcs.resize(nblocks);
+        uint64_t data_blocks = 0;
+        for (uint64_t b = 0; b < nblocks; ++b) {
+            if (!holes[b]) {
+                ++data_blocks;
+                continue;
+            }
+            size_t len = static_cast<size_t>(std::min<uint64_t>(e.size - b * INDEX_BLOCK_SIZE, INDEX_BLOCK_SIZE));
+            p.crcs[b] = zero_crc(len);
+            if (progress != nullptr)
+                progress->bytes_done += len;
+        }
+        p.unread = data_blocks;
+        p.unwritten = data_blocks;
+        if (data_blocks == 0) {
+            if (progress != nullptr)
+                ++progress->files_done;
+            if (p.fd != -1) {
+                ::close(p.fd);
+                p.fd = -1;
+            }
+            continue;
+        }
+        for (uint64_t b = 0; b < nblocks; ++b)
+            if (!holes[b] && !jobs.push({&p, b}))
+                break;
+    }
+    walker.join();
+    jobs.close();
+    for (auto& t : readers)
+        t.join();
+    blocks.close();
+    writer.join();
+    // Files whose blocks were never all handed out after a failure
+    for (auto& p : planned)
+        if (p.fd != -1)
+            ::close(p.fd);
+
+    bool ok = !failed;
+    std::string index;
+    put_u32(index, static_cast<uint32_t>(planned.size()));
+    for (const auto& p : planned) {
+        put_entry(index, p.src.entry);
+        put_u64(index, p.offset);
+        put_u32(index, static_cast<uint32_t>(p.crcs.size()));
+        for (uint32_t crc : p.crcs)
+            put_u32(index, crc);
+    }
+
+    std::string footer(INDEX_FOOT_MAGIC, sizeof(INDEX_FOOT_MAGIC));
+    put_u64(footer, off);
+    put_u64(footer, index.size());
+    put_u32(footer, static_cast<uint32_t>(crc32(0L, reinterpret_cast<const Bytef*>(index.data()),
+                                               static_cast<uInt>(index.size()))));
+    put_u32(footer, INDEX_BLOCK_SIZE);
+    ok = ok && pwrite_all(out, index.data(), index.size(), off) &&
+         pwrite_all(out, footer.data(), footer.size(), off + index.size());
+    // Checkpoints delete the deltas a new snapshot replaces, so it must be on disk
+    ok = ok && ::fdatasync(out) == 0;
+    if (::close(out) == -1)
+        ok = false;
+    return ok;
+}
+
+// Entry for dataDir/rel as it is on disk right now; false if it is gone
+bool stat_entry(const std::string& dataDir, const std::string& rel, Entry& e)
+{
+    struct stat st;
+    std::string path = dataDir + "/" + rel;
+    if (::lstat(path.c_str(), &st) == -1)
+        return false;
+
+    e.path = rel;
+    e.mode = st.st_mode & 07777;
+    e.mtime = st.st_mtime;
+    e.size = 0;
+    e.link.clear();
+    if (!read_xattrs(path, e.xattrs))
+        return false;
+    if (S_ISDIR(st.st_mode)) {
+        e.type = '5';
+    } else if (S_ISREG(st.st_mode)) {
+        e.type = '0';
+        e.size = static_cast<uint64_t>(st.st_size);
+    } else if (S_ISLNK(st.st_mode)) {
+        std::error_code ec;
+        e.type = '2';
+        e.link = std::filesystem::read_symlink(path, ec).string();
+        if (ec)
+            return false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Drop path and everything below it from an ordered map keyed by path
+template <typename Map>
+void erase_tree(Map& m, const std::string& rel)
+{
+    m.erase(rel);
+    std::string prefix = rel + "/";
+    auto it = m.lower_bound(prefix);
+    while (it != m.end() && it->first.starts_with(prefix))
+        it = m.erase(it);
+}
+
+} // namespace
+
+void Throttle::take(uint64_t bytes)
+{
+    if (rate_ == 0)
+        return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+    // Allow at most a second's worth of burst after an idle stretch
+    tokens_ = std::min(tokens_ + elapsed * static_cast<double>(rate_), static_cast<double>(rate_));
+    tokens_ -= static_cast<double>(bytes);
+    if (tokens_ < 0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(-tokens_ / static_cast<double>(rate_)));
+        last_ = std::chrono::steady_clock::now();
+        tokens_ = 0;
+    }
+}
+
+bool create_timestamped(const std::string& dataDir, std::string& outFilename, Format format,
+                        LazySnapshot* base, Throttle* throttle, Progress* progress)
+{
+    outFilename = timestamped_name(dataDir, format == Format::TarGz ? TARGZ_SUFFIX : INDEX_SUFFIX);
+    std::string partial = outFilename + PARTIAL_SUFFIX;
+
+    bool ok;
+    if (format == Format::TarGz) {
+        if (base != nullptr)
+            base->wait_all(); // the tar writer only reads from data/
+        std::vector<Entry> entries;
+        if (!collect_entries(dataDir, entries)) {
+            SN_LOG_ERROR("tar_manager", "cannot walk %s", dataDir.c_str());
+            return false;
+        }
+        // Sorted paths keep every directory ahead of its contents
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& a, const Entry& b) { return a.path < b.path; });
+        ok = write_tarball(dataDir, entries, partial, progress);
+    } else {
+        // Taken before the walk: a file copied into data/ meanwhile then shows
+        // up at least once, and the copy on disk wins
+        std::vector<const IndexedArchive::File*> archived;
+        if (base != nullptr)
+            archived = base->pending_files();
+        Walk walk = [&](const Emit& emit) {
+            std::set<std::string> on_disk;
+            bool walked = walk_entries(dataDir, [&](Entry e) {
+                if (!archived.empty())
+                    on_disk.insert(e.path);
+                return emit({std::move(e), nullptr});
+            });
+            if (!walked && !cancelled(progress)) {
+                SN_LOG_ERROR("tar_manager", "cannot walk %s", dataDir.c_str());
+                return false;
+            }
+            for (const auto* f : archived)
+                if (!on_disk.count(f->entry.path) && !emit({f->entry, f}))
+                    return false;
+            return true;
+        };
+        ok = write_indexed(dataDir, walk, partial, "", throttle, progress);
+    }
+    ok = ok && publish(partial, outFilename);
+    if (!ok) {
+        if (cancelled(progress))
+            SN_LOG_WARN("tar_manager", "cancelled writing %s", outFilename.c_str());
+        else
+            SN_LOG_ERROR("tar_manager", "failed writing %s", outFilename.c_str());
+        ::unlink(partial.c_str());
+    }
+    return ok;
+}
+
+bool create_delta(const std::string& dataDir, const std::string& base,
+                  const std::vector<Change>& changes, std::string& outFilename, Throttle* throttle,
+                  Progress* progress)
+{
+    // Keyed by path, so a whiteout and the new entry of the same path both
+    // survive (the whiteout only hides older layers) and duplicates collapse
+    std::map<std::string, IndexSource> entries;
+    std::map<std::string, IndexSource> whiteouts;
+    for (const auto& c : changes) {
+        if (!safe_path(c.path))
+            continue;
+        Entry e;
+        bool exists = stat_entry(dataDir, c.path, e);
+        if (c.removed || !exists) {
+            Entry w;
+            w.path = c.path;
+            w.type = 'W';
+            whiteouts[c.path] = {w, nullptr};
+        }
+        if (!exists)
+            continue;
+        bool dir = e.type == '5';
+        entries[c.path] = {std::move(e), nullptr};
+        if (!dir || !c.tree)
+            continue;
+
+        std::vector<Entry> below;
+        if (!collect_entries(dataDir + "/" + c.path, below))
+            return false;
+        for (auto& b : below) {
+            // The key is built before b is moved from: the right-hand side
+            // of = is evaluated first
+            std::string rel = c.path + "/" + b.path;
+            b.path = rel;
+            entries[rel] = {std::move(b), nullptr};
+        }
+    }
+
+    Walk walk = [&](const Emit& emit) {
+        for (auto& [rel, src] : whiteouts)
+            if (!emit(std::move(src)))
+                return false;
+        for (auto& [rel, src] : entries)
+            if (!emit(std::move(src)))
+                return false;
+        return true;
+    };
+
+    outFilename = timestamped_name(dataDir, INDEX_SUFFIX);
+    std::string partial = outFilename + PARTIAL_SUFFIX;
+    bool ok = write_indexed(dataDir, walk, partial, base, throttle, progress) && publish(partial, outFilename);
+    if (!ok) {
+        if (cancelled(progress))
+            SN_LOG_WARN("tar_manager", "cancelled writing %s", outFilename.c_str());
+        else
+            SN_LOG_ERROR("tar_manager", "failed writing %s", outFilename.c_str());
+        ::unlink(partial.c_str());
+    }
+    return ok;
+}
+
+bool extract(const std::string& tarballPath, const std::string& dataDir)
+{
+    if (tarballPath.ends_with(INDEX_SUFFIX)) {
+        LazySnapshot snapshot;
+        return snapshot.open(tarballPath, dataDir) && snapshot.wait_all();
+    }
+
+    BackgroundExtractor restore;
+    if (!restore.open(tarballPath, dataDir))
+        return false;
+    restore.start();
+    return restore.wait_all();
+}
+
+std::string find_newest(const std::string& dir)
+{
+    std::string newest, newest_stamp;
+    std::error_code ec;
+    for (const auto& de : std::filesystem::directory_iterator(dir, ec)) {
+        std::string name = de.path().filename().string();
+        std::string stamp;
+        if (name.starts_with(PREFIX) && name.ends_with(TARGZ_SUFFIX))
+            stamp = name.substr(0, name.size() - std::strlen(TARGZ_SUFFIX));
+        else if (name.starts_with(PREFIX) && name.ends_with(INDEX_SUFFIX))
+            stamp = name.substr(0, name.size() - std::strlen(INDEX_SUFFIX));
+        // Timestamps sort lexically, so the greatest stamp is the newest
+        if (!stamp.empty() && stamp > newest_stamp) {
+            newest = name;
+            newest_stamp = stamp;
+        }
+    }
+    return newest.empty() ? newest : (std::filesystem::path(dir) / newest).string();
+}
+
+std::vector<std::string> find_full(const std::string& dir)
+{
+    std::vector<std::string> full;
+    std::error_code ec;
+    for (const auto& de : std::filesystem::directory_iterator(dir, ec)) {
+        std::string name = de.path().filename().string();
+        if (!name.starts_with(PREFIX))
+            continue;
+        if (name.ends_with(TARGZ_SUFFIX)) {
+            full.push_back(de.path().string());
+            continue;
+        }
+        if (!name.ends_with(INDEX_SUFFIX))
+            continue;
+        // The base name is in the header block; no need to map the index
+        int fd = ::open(de.path().c_str(), O_RDONLY);
+        if (fd == -1)
+            continue;
+        std::string head(INDEX_ALIGN, '\0');
+        ssize_t got = ::pread(fd, head.data(), head.size(), 0);
+        ::close(fd);
+        size_t pos = sizeof(INDEX_HEAD_MAGIC);
+        uint32_t base_len;
+        if (got == static_cast<ssize_t>(head.size()) &&
+            std::memcmp(head.data(), INDEX_HEAD_MAGIC, sizeof(INDEX_HEAD_MAGIC)) == 0 &&
+            get_u32(head, pos, base_len) && base_len == 0)
+            full.push_back(de.path().string());
+    }
+    // Timestamps sort lexically, and both suffixes share the prefix
+    std::sort(full.begin(), full.end(), [](const std::string& a, const std::string& b) {
+        return std::filesystem::path(a).filename() < std::filesystem::path(b).filename();
+    });
+    return full;
+}
+
+BackgroundExtractor::~BackgroundExtractor()
+{
+    if (worker_.joinable())
+        worker_.join();
+    if (gz_ != nullptr)
+        gzclose(gz_);
+}
+
+bool BackgroundExtractor::open(const std::string& tarballPath, const std::string& dataDir)
+{
+    data_dir_ = dataDir;
+    gz_ = gzopen(tarballPath.c_str(), "rb");
+    if (gz_ == nullptr)
+        return false;
+    gzbuffer(gz_, 128 * 1024);
+
+    Entry first;
+    if (read_header(gz_, first) != Next::Member)
+        return false;
+
+    std::vector<Entry> entries;
+    std::string blob(static_cast<size_t>(first.size), '\0');
+    if (first.path == MANIFEST_NAME && read_all(gz_, blob.data(), blob.size()) &&
+        skip_bytes(gz_, padded(first.size) - first.size) && decode_manifest(blob, entries)) {
+        have_manifest_ = true;
+    } else {
+        // Foreign archive: restart from the top and let callbacks wait it out
+        gzrewind(gz_);
+    }
+
+    for (auto& e : entries) {
+        if (!safe_path(e.path))
+            continue;
+        if (e.type == '5') {
+            std::error_code ec;
+            std::filesystem::create_directories(data_dir_ + "/" + e.path, ec);
+            if (ec)
+                return false;
+            write_xattrs(data_dir_ + "/" + e.path, e.xattrs);
+        } else {
+            pending_.emplace(e.path, std::move(e));
+        }
+    }
+    return true;
+}
+
+void BackgroundExtractor::start()
+{
+    worker_ = std::thread(&BackgroundExtractor::run, this);
+}
+
+void BackgroundExtractor::run()
+{
+    bool ok = true;
+    for (;;) {
+        Entry e;
+        Next next = read_header(gz_, e);
+        if (next != Next::Member) {
+            ok = next == Next::End;
+            break;
+        }
+        if (have_manifest_ && e.type != '5') {
+            // Tar headers do not carry the attributes; the manifest does
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = pending_.find(e.path);
+            if (it != pending_.end())
+                e.xattrs = it->second.xattrs;
+        }
+        if (!extract_member(gz_, e, data_dir_)) {
+            ok = false;
+            break;
+        }
+        if (have_manifest_ && e.type != '5') {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.erase(e.path);
+            cv_.notify_all();
+        }
+    }
+    if (!ok)
+        SN_LOG_ERROR("tar_manager", "restore into %s failed", data_dir_.c_str());
+    finish(ok);
+}
+
+void BackgroundExtractor::finish(bool ok)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    failed_ = !ok;
+    pending_.clear();
+    done_ = true;
+    cv_.notify_all();
+}
+
+bool BackgroundExtractor::has_pending(const std::string& rel, bool subtree) const
+{
+    // Without a manifest nothing is known until the whole archive is out
+    if (!have_manifest_)
+        return true;
+    return subtree ? any_under(pending_, rel) : pending_.count(rel) != 0;
+}
+
+bool BackgroundExtractor::pending_entry(const std::string& rel, Entry& out)
+{
+    if (done_)
+        return false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = pending_.find(rel);
+    if (it == pending_.end())
+        return false;
+    out = it->second;
+    return true;
+}
+
+std::vector<Entry> BackgroundExtractor::pending_children(const std::string& rel)
+{
+    std::vector<Entry> children;
+    if (done_)
+        return children;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for_each_child(pending_, rel, [&](const Entry& e) { children.push_back(e); });
+    return children;
+}
+
+bool BackgroundExtractor::wait_for(const std::string& rel)
+{
+    if (done_)
+        return !failed_;
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return done_ || !has_pending(rel, false); });
+    return !failed_;
+}
+
+bool BackgroundExtractor::wait_tree(const std::string& rel)
+{
+    if (done_)
+        return !failed_;
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return done_ || !has_pending(rel, true); });
+    return !failed_;
+}
+
+bool BackgroundExtractor::wait_all()
+{
+    // The mount may have failed before sn_init ever started the worker
+    if (!worker_.joinable() && !done_)
+        start();
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return done_.load(); });
+    return !failed_;
+}
+
+IndexedArchive::~IndexedArchive()
+{
+    if (map_ != nullptr)
+        ::munmap(const_cast<char*>(map_), length_);
+}
+
+bool IndexedArchive::open(const std::string& path)
+{
+    path_ = path;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (::fstat(fd, &st) == -1 || static_cast<uint64_t>(st.st_size) < INDEX_ALIGN + INDEX_FOOTER) {
+        ::close(fd);
+        return false;
+    }
+    length_ = static_cast<size_t>(st.st_size);
+    void* map = ::mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    map_ = static_cast<const char*>(map);
+
+    std::string head(map_, INDEX_ALIGN);
+    std::string footer(map_ + length_ - INDEX_FOOTER, INDEX_FOOTER);
+    bool xattrs = std::memcmp(footer.data(), INDEX_FOOT_MAGIC, sizeof(INDEX_FOOT_MAGIC)) == 0;
+    if (std::memcmp(head.data(), INDEX_HEAD_MAGIC, sizeof(INDEX_HEAD_MAGIC)) != 0 ||
+        (!xattrs && std::memcmp(footer.data(), INDEX_FOOT_MAGIC_V1, sizeof(INDEX_FOOT_MAGIC_V1)) != 0))
+        return false;
+
+    size_t pos = sizeof(INDEX_HEAD_MAGIC);
+    if (!get_str(head, pos, base_name_) || base_name_.find('/') != std::string::npos)
+        return false;
+
+    pos = sizeof(INDEX_FOOT_MAGIC);
+    uint64_t index_off, index_len;
+    uint32_t index_crc, block_size;
+    if (!get_u64(footer, pos, index_off) || !get_u64(footer, pos, index_len) ||
+        !get_u32(footer, pos, index_crc) || !get_u32(footer, pos, block_size) ||
+        block_size != INDEX_BLOCK_SIZE || index_off + index_len + INDEX_FOOTER != length_)
+        return false;
+
+    std::string index(map_ + index_off, static_cast<size_t>(index_len));
+    if (crc32(0L, reinterpret_cast<const Bytef*>(index.data()), static_cast<uInt>(index.size())) != index_crc)
+        return false;
+
+    pos = 0;
+    uint32_t count;
+    if (!get_u32(index, pos, count))
+        return false;
+    files_.resize(count);
+    uint64_t blocks = 0;
+    for (auto& f : files_) {
+        uint32_t nblocks;
+        f.owner = this;
+        if (!get_entry(index, pos, f.entry, xattrs) || !get_u64(index, pos, f.offset) || !get_u32(index, pos, nblocks))
+            return false;
+        if (f.entry.type == '0' && (nblocks != (f.entry.size + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE ||
+                                    f.offset + f.entry.size > index_off))
+            return false;
+        f.crcs.resize(nblocks);
+        for (auto& crc : f.crcs)
+            if (!get_u32(index, pos, crc))
+                return false;
+        f.first_block = blocks;
+        blocks += nblocks;
+    }
+    for (size_t i = 0; i < files_.size(); ++i)
+        by_path_.emplace(files_[i].entry.path, i);
+    verified_ = std::make_unique<std::atomic<bool>[]>(blocks);
+
+    // A hole the index agrees is zeros can only read back as zeros
+    holes_.assign(blocks, false);
+    if ((fd = ::open(path.c_str(), O_RDONLY)) == -1)
+        return true;
+    Ranges ranges = hole_ranges(fd, INDEX_ALIGN, index_off);
+    ::close(fd);
+    if (ranges.empty())
+        return true;
+    for (const auto& f : files_) {
+        if (f.crcs.empty())
+            continue;
+        std::vector<bool> holes = hole_blocks(ranges, f.offset, f.entry.size);
+        for (uint64_t b = 0; b < f.crcs.size(); ++b) {
+            size_t len = static_cast<size_t>(std::min<uint64_t>(INDEX_BLOCK_SIZE, f.entry.size - b * INDEX_BLOCK_SIZE));
+            if (holes[b] && f.crcs[b] == zero_crc(len)) {
+                holes_[f.first_block + b] = true;
+                verified_[f.first_block + b].store(true, std::memory_order_relaxed);
+            }
+        }
+    }
+    return true;
+}
+
+const IndexedArchive::File* IndexedArchive::find(const std::string& rel) const
+{
+    auto it = by_path_.find(rel);
+    return it == by_path_.end() ? nullptr : &files_[it->second];
+}
+
+bool IndexedArchive::verify(const File& f, uint64_t block) const
+{
+    std::atomic<bool>& done = verified_[f.first_block + block];
+    if (done.load(std::memory_order_acquire))
+        return true;
+    uint64_t start = block * INDEX_BLOCK_SIZE;
+    uInt len = static_cast<uInt>(std::min<uint64_t>(INDEX_BLOCK_SIZE, f.entry.size - start));
+    if (crc32(0L, reinterpret_cast<const Bytef*>(map_ + f.offset + start), len) != f.crcs[block])
+        return false;
+    done.store(true, std::memory_order_release);
+    return true;
+}
+
+ssize_t IndexedArchive::read(const File& f, char* buf, size_t size, off_t off) const
+{
+    uint64_t start = static_cast<uint64_t>(off);
+    if (start >= f.entry.size || size == 0)
+        return 0;
+    size_t n = static_cast<size_t>(std::min<uint64_t>(size, f.entry.size - start));
+    for (uint64_t b = start / INDEX_BLOCK_SIZE; b <= (start + n - 1) / INDEX_BLOCK_SIZE; ++b)
+        if (!verify(f, b))
+            return -EIO;
+    std::memcpy(buf, map_ + f.offset + start, n);
+    return static_cast<ssize_t>(n);
+}
+
+void IndexedArchive::prefetch(const File& f, uint64_t off, uint64_t len) const
+{
+    if (off >= f.entry.size || len == 0)
+        return;
+    len = std::min(len, f.entry.size - off);
+    // Start the disk reads for the whole window, then checksum it block by block
+    uint64_t page = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+    uint64_t from = (f.offset + off) / page * page;
+    ::madvise(const_cast<char*>(map_) + from, f.offset + off + len - from, MADV_WILLNEED);
+    for (uint64_t b = off / INDEX_BLOCK_SIZE; b <= (off + len - 1) / INDEX_BLOCK_SIZE; ++b)
+        if (!verify(f, b))
+            return; // the read that needs this block reports it
+}
+
+std::vector<bool> IndexedArchive::holes(const File& f) const
+{
+    auto first = holes_.begin() + static_cast<ptrdiff_t>(f.first_block);
+    return std::vector<bool>(first, first + static_cast<ptrdiff_t>(f.crcs.size()));
+}
+
+off_t IndexedArchive::seek(const File& f, off_t off, int whence) const
+{
+    uint64_t size = f.entry.size;
+    if (off < 0 || static_cast<uint64_t>(off) >= size)
+        return -ENXIO;
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+        return -EINVAL;
+    // The end of the file counts as a hole, as for lseek(2)
+    bool want_hole = whence == SEEK_HOLE;
+    for (uint64_t b = static_cast<uint64_t>(off) / INDEX_BLOCK_SIZE; b < f.crcs.size(); ++b)
+        if (holes_[f.first_block + b] == want_hole)
+            return std::max(off, static_cast<off_t>(b * INDEX_BLOCK_SIZE));
+    return want_hole ? static_cast<off_t>(size) : -ENXIO;
+}
+
+bool IndexedArchive::copy_to(const File& f, int fd, uint64_t limit) const
+{
+    uint64_t size = std::min(f.entry.size, limit);
+    for (uint64_t b = 0; b * INDEX_BLOCK_SIZE < size; ++b) {
+        if (holes_[f.first_block + b])
+            continue;
+        uint64_t start = b * INDEX_BLOCK_SIZE;
+        size_t len = static_cast<size_t>(std::min<uint64_t>(INDEX_BLOCK_SIZE, size - start));
+        if (!verify(f, b) || !pwrite_all(fd, map_ + f.offset + start, len, start))
+            return false;
+    }
+    // Sets the size when the file ends in a hole
+    return ::ftruncate(fd, static_cast<off_t>(size)) == 0;
+}
+
+bool LazySnapshot::open(const std::string& path, const std::string& dataDir)
+{
+    data_dir_ = dataDir;
+
+    // Follow base names back to the full snapshot the chain starts from
+    std::string next = path;
+    std::set<std::string> seen;
+    while (!next.empty()) {
+        if (!seen.insert(next).second)
+            return false;
+        auto layer = std::make_unique<IndexedArchive>();
+        if (!layer->open(next)) {
+            SN_LOG_ERROR("tar_manager", "cannot open snapshot %s", next.c_str());
+            return false;
+        }
+        next = layer->base().empty() ? "" : (std::filesystem::path(next).parent_path() / layer->base()).string();
+        layers_.insert(layers_.begin(), std::move(layer));
+    }
+
+    // Newer layers win; their whiteouts hide whole subtrees of older ones
+    std::map<std::string, const IndexedArchive::File*> view;
+    for (const auto& layer : layers_) {
+        for (const auto& f : layer->files())
+            if (f.entry.type == 'W')
+                erase_tree(view, f.entry.path);
+        for (const auto& f : layer->files())
+            if (f.entry.type != 'W')
+                view[f.entry.path] = &f;
+    }
+
+    for (const auto& [rel, fp] : view) {
+        const IndexedArchive::File& f = *fp;
+        if (!safe_path(f.entry.path))
+            continue;
+        std::string dest = data_dir_ + "/" + f.entry.path;
+        if (f.entry.type == '5') {
+            std::error_code ec;
+            std::filesystem::create_directories(dest, ec);
+            if (ec)
+                return false;
+            ::chmod(dest.c_str(), (f.entry.mode & 07777) | S_IRWXU);
+            write_xattrs(dest, f.entry.xattrs);
+            continue;
+        }
+        // Anything already in data/ (an unpacked previous session) wins
+        struct stat st;
+        if ((f.entry.type == '0' || f.entry.type == '2') && ::lstat(dest.c_str(), &st) == -1)
+            pending_.emplace(f.entry.path, &f);
+    }
+
+    // Lookups from callbacks go through the index; views point into the
+    // layers, which live as long as this does
+    std::vector<std::string_view> paths;
+    for (const auto& [rel, f] : pending_) {
+        paths.push_back(f->entry.path);
+        slots_.push_back(f);
+    }
+    index_.build(std::move(paths));
+    return true;
+}
+
+void LazySnapshot::forget(const std::string& rel)
+{
+    uint32_t slot = index_.find(rel);
+    if (slot != metadata::NONE)
+        index_.remove(slot);
+}
+
+std::vector<std::string> LazySnapshot::chain() const
+{
+    std::vector<std::string> paths;
+    for (const auto& layer : layers_)
+        paths.push_back(layer->path());
+    return paths;
+}
+
+const IndexedArchive::File* LazySnapshot::archived(const std::string& rel)
+{
+    uint32_t slot = index_.find(rel);
+    return slot != metadata::NONE && index_.present(slot) ? slots_[slot] : nullptr;
+}
+
+std::vector<const IndexedArchive::File*> LazySnapshot::pending_files()
+{
+    std::vector<const IndexedArchive::File*> files;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& [rel, f] : pending_)
+        files.push_back(f);
+    return files;
+}
+
+bool LazySnapshot::restored(const IndexedArchive::File* f)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return restored_.count(f) != 0;
+}
+
+bool LazySnapshot::pending_entry(const std::string& rel, Entry& out)
+{
+    const IndexedArchive::File* f = archived(rel);
+    if (f == nullptr)
+        return false;
+    out = f->entry;
+    return true;
+}
+
+std::vector<Entry> LazySnapshot::pending_children(const std::string& rel)
+{
+    std::vector<Entry> children;
+    for (uint32_t slot : index_.children(rel))
+        if (index_.present(slot))
+            children.push_back(slots_[slot]->entry);
+    return children;
+}
+
+bool LazySnapshot::materialize(const std::string& rel, uint64_t limit)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        auto it = pending_.find(rel);
+        if (it == pending_.end())
+            return true;
+        if (copying_.count(rel)) {
+            cv_.wait(lock);
+            continue;
+        }
+
+        // Still pending while being copied, so callbacks never see a partial file
+        const IndexedArchive::File* f = it->second;
+        copying_.insert(rel);
+        lock.unlock();
+
+        std::string dest = data_dir_ + "/" + rel;
+        bool ok;
+        if (f->entry.type == '2') {
+            ok = ::symlink(f->entry.link.c_str(), dest.c_str()) == 0;
+        } else {
+            int fd = ::open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            ok = fd != -1 && f->owner->copy_to(*f, fd, limit) && write_xattrs(dest, f->entry.xattrs);
+            if (fd != -1) {
+                ::fchmod(fd, f->entry.mode & 07777);
+                struct timespec times[2] = {{0, UTIME_OMIT}, {static_cast<time_t>(f->entry.mtime), 0}};
+                ::futimens(fd, times);
+                ::close(fd);
+            }
+        }
+        if (!ok)
+            SN_LOG_ERROR("tar_manager", "cannot copy %s out of %s", rel.c_str(), f->owner->path().c_str());
+
+        lock.lock();
+        copying_.erase(rel);
+        if (ok) {
+            pending_.erase(rel);
+            forget(rel);
+            restored_.insert(f);
+            restores_.fetch_add(1, std::memory_order_release);
+        }
+        cv_.notify_all();
+        return ok;
+    }
+}
+
+bool LazySnapshot::wait_for(const std::string& rel)
+{
+    return materialize(rel);
+}
+
+bool LazySnapshot::wait_truncated(const std::string& rel, uint64_t size)
+{
+    // Whoever truncates next sees the file already cut to size
+    return materialize(rel, size);
+}
+
+bool LazySnapshot::wait_tree(const std::string& rel)
+{
+    std::vector<std::string> paths;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!any_under(pending_, rel))
+            return true;
+        std::string prefix = rel.empty() ? rel : rel + "/";
+        if (pending_.count(rel))
+            paths.push_back(rel);
+        for (auto it = pending_.lower_bound(prefix); it != pending_.end() && it->first.starts_with(prefix); ++it)
+            paths.push_back(it->first);
+    }
+    bool ok = true;
+    for (const auto& p : paths)
+        ok = materialize(p) && ok;
+    return ok;
+}
+
+bool LazySnapshot::wait_all()
+{
+    return wait_tree("");
+}
+
+bool LazySnapshot::discard(const std::string& rel)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return copying_.count(rel) == 0; });
+    if (pending_.erase(rel) == 0)
+        return false;
+    forget(rel);
+    return true;
+}
+
+bool LazySnapshot::hold(const std::string& rel)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return copying_.count(rel) == 0; });
+    if (pending_.count(rel) == 0)
+        return false;
+    // Looks like a copy in progress, so materialize() and discard() wait
+    copying_.insert(rel);
+    return true;
+}
+
+void LazySnapshot::release(const std::string& rel, bool replaced)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        copying_.erase(rel);
+        if (replaced && pending_.erase(rel) != 0)
+            forget(rel);
+    }
+    cv_.notify_all();
+}
+
+} // namespace tar_manager
@@ -0,0 +1,326 @@
+#ifndef SECURENOTEFS_TAR_MANAGER_HPP
+#define SECURENOTEFS_TAR_MANAGER_HPP
+
+#include <sys/types.h>
+#include <zlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "metadata.hpp"
+
+namespace tar_manager {
+
+// Archive member name of the manifest written ahead of all file data
+inline constexpr const char* MANIFEST_NAME = ".securenotefs/manifest";
+
+// Bytes covered by one checksum in an indexed snapshot
+inline constexpr uint32_t INDEX_BLOCK_SIZE = 64 * 1024;
+
+// One member of a snapshot, as recorded in its manifest
+struct Entry {
+    std::string path;   // relative to data/, no leading slash
+    char type = '0';    // '0' regular file, '5' directory, '2' symlink, 'W' whiteout
+    mode_t mode = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    std::string link;   // symlink target
+    std::string xattrs; // xattr::encode()d attributes, empty if none
+};
+
+// Snapshot file layouts create_timestamped() can produce
+enum class Format {
+    Indexed,  // notes-data-<timestamp>.snfs, served in place by LazySnapshot
+    TarGz,    // notes-data-<timestamp>.tar.gz, portable and unpacked on mount
+};
+
+// A path touched since the previous snapshot of a chain
+struct Change {
+    std::string path;
+    bool removed = false;  // hide older copies of path and everything below it
+    bool tree = false;     // record everything below path, not just path itself
+};
+
+// Caps how fast a snapshot writer reads data/, so background snapshots
+// leave the disk to foreground callbacks. Zero means unlimited.
+class Throttle {
+public:
+    explicit Throttle(uint64_t bytes_per_sec) : rate_(bytes_per_sec) {}
+
+    // Account for bytes about to be read, sleeping once over budget; safe to
+    // call from every reader thread of one snapshot
+    void take(uint64_t bytes);
+
+private:
+    std::mutex mutex_;
+    uint64_t rate_;
+    double tokens_ = 0;
+    std::chrono::steady_clock::time_point last_ = std::chrono::steady_clock::now();
+};
+
+// Counters a snapshot writer bumps as it goes, so another thread can report
+// progress and throughput while it runs. Setting cancelled makes the writer
+// give up and fail, leaving no snapshot behind.
+struct Progress {
+    std::atomic<uint64_t> files_total{0};
+    std::atomic<uint64_t> files_done{0};
+    std::atomic<uint64_t> bytes_total{0};
+    std::atomic<uint64_t> bytes_done{0};
+    std::atomic<bool> cancelled{false};
+};
+
+class LazySnapshot;
+
+// Pack dataDir into notes-data-<timestamp>.<ext> next to it. With base, files
+// still only in that snapshot are carried over without going through data/.
+// The snapshot only appears under its final name once it is fully on disk.
+bool create_timestamped(const std::string& dataDir, std::string& outFilename,
+                        Format format = Format::Indexed, LazySnapshot* base = nullptr,
+                        Throttle* throttle = nullptr, Progress* progress = nullptr);
+
+// Write a .snfs delta on top of the snapshot at base that records only the
+// given changes; LazySnapshot layers it over the rest of the chain
+bool create_delta(const std::string& dataDir, const std::string& base,
+                  const std::vector<Change>& changes, std::string& outFilename,
+                  Throttle* throttle = nullptr, Progress* progress = nullptr);
+
+// Unpack a snapshot into dataDir, blocking until every file is written
+bool extract(const std::string& tarballPath, const std::string& dataDir);
+
+// Newest notes-data-* snapshot in dir, or an empty string if there is none
+std::string find_newest(const std::string& dir);
+
+// Full notes-data-* snapshots in dir (a .tar.gz, or a .snfs with no base),
+// oldest first
+std::vector<std::string> find_full(const std::string& dir);
+
+// Files that belong to the mounted snapshot but are not in data/ yet. The
+// filesystem consults this before touching data/ so a mount can come up
+// before the snapshot has been unpacked.
+class Restore {
+public:
+    virtual ~Restore() = default;
+
+    // Begin any background work; call after FUSE has daemonized
+    virtual void start() {}
+
+    // Manifest entry for rel if its contents are not in data/ yet
+    virtual bool pending_entry(const std::string& rel, Entry& out) = 0;
+
+    // Pending entries directly inside directory rel ("" for the root)
+    virtual std::vector<Entry> pending_children(const std::string& rel) = 0;
+
+    // Block until rel itself is in data/; false on failure
+    virtual bool wait_for(const std::string& rel) = 0;
+
+    // Block until rel and everything below it is in data/; false on failure
+    virtual bool wait_tree(const std::string& rel) = 0;
+
+    // Block until the whole snapshot is in data/; false on failure
+    virtual bool wait_all() = 0;
+
+    // wait_for() for a caller about to truncate rel to size bytes: only
+    // what survives the truncation has to reach data/
+    virtual bool wait_truncated(const std::string& rel, uint64_t size)
+    {
+        (void) size;
+        return wait_for(rel);
+    }
+
+    // Drop a pending file that is about to be deleted or replaced, so it
+    // never has to be written to data/; false if that is not possible
+    virtual bool discard(const std::string& rel) { (void) rel; return false; }
+
+    // For a callback that may replace a pending file but can still fail:
+    // keep rel from being written to data/ until release(), then discard it
+    // only if it was replaced. hold() is false if that is not possible.
+    virtual bool hold(const std::string& rel) { (void) rel; return false; }
+    virtual void release(const std::string& rel, bool replaced) { (void) rel; (void) replaced; }
+};
+
+// Restores a .tar.gz snapshot into data/ on a worker thread. The manifest is
+// read up front, which lets callbacks answer getattr/readdir for files whose
+// contents have not been unpacked yet and block only when they need the
+// bytes of one specific path.
+class BackgroundExtractor : public Restore {
+public:
+    BackgroundExtractor() = default;
+    BackgroundExtractor(const BackgroundExtractor&) = delete;
+    BackgroundExtractor& operator=(const BackgroundExtractor&) = delete;
+    ~BackgroundExtractor() override;
+
+    // Read the manifest and create the directory skeleton under dataDir
+    bool open(const std::string& tarballPath, const std::string& dataDir);
+
+    void start() override;
+    bool pending_entry(const std::string& rel, Entry& out) override;
+    std::vector<Entry> pending_children(const std::string& rel) override;
+    bool wait_for(const std::string& rel) override;
+    bool wait_tree(const std::string& rel) override;
+    bool wait_all() override;
+
+private:
+    void run();
+    bool has_pending(const std::string& rel, bool subtree) const;
+    void finish(bool ok);
+
+    gzFile gz_ = nullptr;
+    std::string data_dir_;
+    bool have_manifest_ = false;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<std::string, Entry> pending_;  // ordered so subtrees are ranges
+    std::atomic<bool> done_{false};
+    bool failed_ = false;
+    std::thread worker_;
+};
+
+// Read-only view of a .snfs snapshot: raw file bytes followed by an index of
+// path -> offset, length and per-block CRC32, located through a fixed footer.
+// The file is mmap'd, so lookups are a hash probe and reads are a memcpy.
+class IndexedArchive {
+public:
+    struct File {
+        const IndexedArchive* owner = nullptr;
+        Entry entry;
+        uint64_t offset = 0;         // of the first byte within the archive
+        uint64_t first_block = 0;    // index into the archive-wide verified map
+        std::vector<uint32_t> crcs;  // one per INDEX_BLOCK_SIZE bytes
+    };
+
+    IndexedArchive() = default;
+    IndexedArchive(const IndexedArchive&) = delete;
+    IndexedArchive& operator=(const IndexedArchive&) = delete;
+    ~IndexedArchive();
+
+    bool open(const std::string& path);
+
+    const std::string& path() const { return path_; }
+
+    // File name of the snapshot this delta sits on, empty for a full one
+    const std::string& base() const { return base_name_; }
+
+    // Entry for rel, or nullptr
+    const File* find(const std::string& rel) const;
+
+    // Every entry, parents before children
+    const std::vector<File>& files() const { return files_; }
+
+    // Copy file bytes at off into buf, checking each block's CRC the first
+    // time it is touched; bytes copied or -EIO on corruption
+    ssize_t read(const File& f, char* buf, size_t size, off_t off) const;
+
+    // Page in and verify the blocks covering [off, off + len) ahead of a
+    // read, so the read itself is only a memcpy
+    void prefetch(const File& f, uint64_t off, uint64_t len) const;
+
+    // Which blocks of a file are holes in the archive: zeros that take no
+    // disk and are never checksummed
+    std::vector<bool> holes(const File& f) const;
+
+    // lseek(2) SEEK_DATA or SEEK_HOLE within a file, at block granularity;
+    // the offset or -errno
+    off_t seek(const File& f, off_t off, int whence) const;
+
+    // Write a file's contents, or just its first limit bytes, to fd,
+    // leaving holes as holes
+    bool copy_to(const File& f, int fd, uint64_t limit = UINT64_MAX) const;
+
+private:
+    bool verify(const File& f, uint64_t block) const;
+
+    std::string path_;
+    std::string base_name_;
+    const char* map_ = nullptr;
+    size_t length_ = 0;
+    std::vector<File> files_;
+    std::unordered_map<std::string, size_t> by_path_;
+    std::unique_ptr<std::atomic<bool>[]> verified_;
+    std::vector<bool> holes_;  // same slots as verified_, fixed once open
+};
+
+// Mounts a .snfs snapshot without unpacking it. Reads of untouched files are
+// served straight from the archive; a file is copied into data/ only when a
+// callback is about to modify it, and deleting one just forgets it. A delta
+// is layered over the chain of snapshots it was written on top of.
+// Lookups and directory listings from callbacks take no lock.
+class LazySnapshot : public Restore {
+public:
+    // Map the snapshot chain and create its directory skeleton under dataDir
+    bool open(const std::string& path, const std::string& dataDir);
+
+    // Snapshot files making up the chain, the full one first
+    std::vector<std::string> chain() const;
+
+    // Archive entry to serve rel from, or nullptr once it lives in data/
+    const IndexedArchive::File* archived(const std::string& rel);
+
+    // Read an archived file, see IndexedArchive::read()
+    ssize_t read(const IndexedArchive::File& f, char* buf, size_t size, off_t off) const
+    {
+        return f.owner->read(f, buf, size, off);
+    }
+
+    // See IndexedArchive::prefetch()
+    void prefetch(const IndexedArchive::File& f, uint64_t off, uint64_t len) const
+    {
+        f.owner->prefetch(f, off, len);
+    }
+
+    // Files that still only exist in the archive
+    std::vector<const IndexedArchive::File*> pending_files();
+
+    // Count of files copied into data/ so far, so holders of an entry only
+    // call restored() once something did move
+    uint64_t restores() const { return restores_.load(std::memory_order_acquire); }
+
+    // Whether f was copied into data/, rather than still pending or
+    // discarded with its name
+    bool restored(const IndexedArchive::File* f);
+
+    bool pending_entry(const std::string& rel, Entry& out) override;
+    std::vector<Entry> pending_children(const std::string& rel) override;
+    bool wait_for(const std::string& rel) override;
+    bool wait_truncated(const std::string& rel, uint64_t size) override;
+    bool wait_tree(const std::string& rel) override;
+    bool wait_all() override;
+    bool discard(const std::string& rel) override;
+    bool hold(const std::string& rel) override;
+    void release(const std::string& rel, bool replaced) override;
+
+private:
+    // Copy rel into data/, only its first limit bytes if it is a file
+    bool materialize(const std::string& rel, uint64_t limit = UINT64_MAX);
+    // Stop serving rel from the archive; called with mutex_ held
+    void forget(const std::string& rel);
+
+    std::vector<std::unique_ptr<IndexedArchive>> layers_;  // full snapshot first
+    std::string data_dir_;
+
+    // What callbacks look up, without taking mutex_: every file pending at
+    // open(), with slots removed as they leave pending_
+    metadata::Index index_;
+    std::vector<const IndexedArchive::File*> slots_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<std::string, const IndexedArchive::File*> pending_;
+    std::set<std::string> copying_;  // being copied, or held
+    std::set<const IndexedArchive::File*> restored_;
+    std::atomic<uint64_t> restores_{0};
+};
+
+} // namespace tar_manager
+
+#endif // SECURENOTEFS_TAR_MANAGER_HPP
@@ -0,0 +1,255 @@
+/*
+Responsibilities of trace:
+
+Keep the last RING_EVENTS callbacks and phases of every thread (op, inode,
+offset, size, start and duration) in a per-thread ring, cheap enough to
+leave on in production.
+
+Export the rings as Chrome trace / Perfetto JSON on demand (fs serves it as
+notes/.securenotefs/trace.json) or to a file when the process gets SIGUSR1.
+*/
+
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.hpp"
+
+namespace trace {
+
+namespace {
+
+std::atomic<bool> recording{true};
+
+// Slots are atomics so collect() may read them while the owner writes;
+// relaxed stores compile to plain moves
+struct Slot {
+    std::atomic<uint64_t> op_tid{0};  // op << 32 | tid
+    std::atomic<uint64_t> start_ns{0};
+    std::atomic<uint64_t> dur_ns{0};
+    std::atomic<uint64_t> ino{0};
+    std::atomic<uint64_t> offset{0};
+    std::atomic<uint64_t> size{0};
+};
+
+// A seqlock per ring: the owner bumps claimed before overwriting a slot and
+// head once it is done, so a reader can tell which slots it raced with
+struct Ring {
+    Slot slots[RING_EVENTS];
+    std::atomic<uint64_t> claimed{0};  // events started
+    std::atomic<uint64_t> head{0};     // events finished; the next goes to head % RING_EVENTS
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Ring>> all;
+    std::vector<Ring*> idle;  // rings of threads that have exited
+};
+
+// Never destroyed: threads still running at exit may record into it
+Registry& registry()
+{
+    static Registry* r = new Registry;
+    return *r;
+}
+
+// Gives a thread its ring on first use and hands it back when it exits;
+// the events stay until the next owner overwrites them
+struct Owner {
+    Ring* ring = nullptr;
+
+    Ring& get()
+    {
+        if (ring == nullptr) {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            if (!r.idle.empty()) {
+                ring = r.idle.back();
+                r.idle.pop_back();
+            } else {
+                r.all.push_back(std::make_unique<Ring>());
+                ring = r.all.back().get();
+            }
+        }
+        return *ring;
+    }
+
+    ~Owner()
+    {
+        if (ring == nullptr)
+            return;
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.idle.push_back(ring);
+    }
+};
+
+thread_local Owner owner;
+thread_local uint32_t thread_id = 0;
+
+// Signal handler -> Dumper thread: 'd' to dump, 'q' to quit
+int wake_fds[2] = {-1, -1};
+
+void on_signal(int)
+{
+    int saved = errno;
+    char c = 'd';
+    (void) !::write(wake_fds[1], &c, 1);
+    errno = saved;
+}
+
+} // namespace
+
+bool enabled()
+{
+    return recording.load(std::memory_order_relaxed);
+}
+
+void set_enabled(bool on)
+{
+    recording.store(on, std::memory_order_relaxed);
+}
+
+void emit(const Event& e)
+{
+    if (thread_id == 0)
+        thread_id = static_cast<uint32_t>(::gettid());
+    Ring& r = owner.get();
+    uint64_t h = r.head.load(std::memory_order_relaxed);
+    r.claimed.store(h + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    Slot& s = r.slots[h % RING_EVENTS];
+    s.op_tid.store(static_cast<uint64_t>(e.op) << 32 | thread_id, std::memory_order_relaxed);
+    s.start_ns.store(e.start_ns, std::memory_order_relaxed);
+    s.dur_ns.store(e.dur_ns, std::memory_order_relaxed);
+    s.ino.store(e.ino, std::memory_order_relaxed);
+    s.offset.store(e.offset, std::memory_order_relaxed);
+    s.size.store(e.size, std::memory_order_relaxed);
+    r.head.store(h + 1, std::memory_order_release);
+}
+
+std::vector<Event> collect()
+{
+    std::vector<Event> events;
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    for (const auto& r : reg.all) {
+        uint64_t end = r->head.load(std::memory_order_acquire);
+        uint64_t begin = end > RING_EVENTS ? end - RING_EVENTS : 0;
+        size_t first = events.size();
+        for (uint64_t i = begin; i < end; ++i) {
+            const Slot& s = r->slots[i % RING_EVENTS];
+            Event e;
+            uint64_t op_tid = s.op_tid.load(std::memory_order_relaxed);
+            e.op = static_cast<metrics::Op>(op_tid >> 32);
+            e.tid = static_cast<uint32_t>(op_tid);
+            e.start_ns = s.start_ns.load(std::memory_order_relaxed);
+            e.dur_ns = s.dur_ns.load(std::memory_order_relaxed);
+            e.ino = s.ino.load(std::memory_order_relaxed);
+            e.offset = s.offset.load(std::memory_order_relaxed);
+            e.size = s.size.load(std::memory_order_relaxed);
+            events.push_back(e);
+        }
+        // Whatever the owner started overwriting while we copied may be
+        // torn, so drop it
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t claimed = r->claimed.load(std::memory_order_relaxed);
+        uint64_t valid = claimed > RING_EVENTS ? claimed - RING_EVENTS : 0;
+        if (valid > begin) {
+            size_t torn = static_cast<size_t>(std::min(valid - begin, end - begin));
+            events.erase(events.begin() + static_cast<ptrdiff_t>(first),
+                         events.begin() + static_cast<ptrdiff_t>(first + torn));
+        }
+    }
+    std::sort(events.begin(), events.end(),
+              [](const Event& a, const Event& b) { return a.start_ns < b.start_ns; });
+    return events;
+}
+
+std::string chrome_json()
+{
+    std::vector<Event> events = collect();
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    char line[320];
+    int pid = static_cast<int>(::getpid());
+    for (size_t i = 0; i < events.size(); ++i) {
+        const Event& e = events[i];
+        // Complete ("X") events; ts and dur are in microseconds
+        std::snprintf(line, sizeof(line),
+                      "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                      "\"pid\":%d,\"tid\":%" PRIu32 ",\"args\":{\"ino\":%" PRIu64 ",\"offset\":%" PRIu64
+                      ",\"size\":%" PRIu64 "}}",
+                      i == 0 ? "" : ",", metrics::name(e.op),
+                      e.op >= metrics::Op::Disk ? "phase" : "fuse",
+                      static_cast<double>(e.start_ns) / 1000.0, static_cast<double>(e.dur_ns) / 1000.0, pid,
+                      e.tid, e.ino, e.offset, e.size);
+        out += line;
+    }
+    out += "\n]}\n";
+    return out;
+}
+
+Dumper::~Dumper()
+{
+    if (!worker_.joinable())
+        return;
+    char c = 'q';
+    (void) !::write(wake_fds[1], &c, 1);
+    worker_.join();
+    ::signal(SIGUSR1, SIG_DFL);
+    ::close(wake_fds[0]);
+    ::close(wake_fds[1]);
+    wake_fds[0] = wake_fds[1] = -1;
+}
+
+bool Dumper::start()
+{
+    if (wake_fds[0] != -1 || ::pipe(wake_fds) == -1)
+        return false;
+    worker_ = std::thread(&Dumper::run, this);
+
+    struct sigaction sa = {};
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return ::sigaction(SIGUSR1, &sa, nullptr) == 0;
+}
+
+bool Dumper::dump(std::string& path)
+{
+    path = dir_ + "/securenotefs-trace-" + std::to_string(::getpid()) + "-" + std::to_string(++dumps_) + ".json";
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << chrome_json();
+    out.close();
+    return static_cast<bool>(out);
+}
+
+void Dumper::run()
+{
+    char c;
+    while (true) {
+        ssize_t n = ::read(wake_fds[0], &c, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || c == 'q')
+            return;
+        std::string path;
+        if (!dump(path))
+            SN_LOG_ERROR("trace", "cannot write trace to %s", path.c_str());
+    }
+}
+
+} // namespace trace
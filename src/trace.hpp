@@ -0,0 +1,69 @@
+#ifndef SECURENOTEFS_TRACE_HPP
+#define SECURENOTEFS_TRACE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hpp"
+
+namespace trace {
+
+// Events each thread keeps; older ones are overwritten
+inline constexpr size_t RING_EVENTS = 8192;
+
+// One finished callback or phase
+struct Event {
+    metrics::Op op = metrics::Op::Count;
+    uint32_t tid = 0;
+    uint64_t start_ns = 0;  // steady clock
+    uint64_t dur_ns = 0;
+    uint64_t ino = 0;       // 0 when the request was by path only
+    uint64_t offset = 0;
+    uint64_t size = 0;
+};
+
+// Recording is on by default; it costs a few relaxed stores per event
+bool enabled();
+void set_enabled(bool on);
+
+// Append e to the calling thread's ring. Only that thread writes the ring,
+// so this takes no lock and no atomic read-modify-write.
+void emit(const Event& e);
+
+// Every event still in the rings, oldest first. Safe against concurrent
+// emit(): events overwritten while being copied are left out.
+std::vector<Event> collect();
+
+// collect() as Chrome trace event JSON, which Perfetto and chrome://tracing load
+std::string chrome_json();
+
+// Writes chrome_json() to a file in dir whenever the process gets SIGUSR1,
+// e.g. `kill -USR1 $(pidof securenotefs)` while a latency spike is happening
+class Dumper {
+public:
+    explicit Dumper(std::string dir) : dir_(std::move(dir)) {}
+    Dumper(const Dumper&) = delete;
+    Dumper& operator=(const Dumper&) = delete;
+    ~Dumper();
+
+    // Install the signal handler and start the writer thread; call after
+    // FUSE has daemonized. Only one Dumper may be started per process.
+    bool start();
+
+    // Write a dump now; false on I/O error. path is the file written.
+    bool dump(std::string& path);
+
+private:
+    void run();
+
+    std::string dir_;
+    unsigned dumps_ = 0;
+    std::thread worker_;
+};
+
+} // namespace trace
+
+#endif // SECURENOTEFS_TRACE_HPP
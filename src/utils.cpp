@@ -2,5 +2,348 @@
 Responsibilities of utils:
 
     Helpers to build paths
-    Logging and error-report wrappers
-*/
\ No newline at end of file
+    Logging and error-report wrappers: callbacks append logfmt records to a
+    buffer of their own thread, and a flusher thread writes them out, so a
+    log call never waits for I/O or for another callback
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include "utils.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+    // FUSE chdirs to / when it daemonizes, so this must be absolute
+    std::string backing_root;
+
+    // What one thread may buffer between flushes before records are dropped
+    constexpr size_t LOG_BUFFER_BYTES = 64 << 10;
+    // How often the flusher writes out buffers nobody asked it to
+    constexpr auto LOG_FLUSH_INTERVAL = std::chrono::milliseconds(200);
+
+    // Records one thread logged since the last flush. The mutex is only ever
+    // contended by the flusher swapping the string out.
+    struct LogBuffer {
+        std::mutex mutex;
+        std::string data;
+        uint64_t dropped = 0;
+    };
+
+    struct LogRegistry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<LogBuffer>> all;
+        std::vector<LogBuffer*> idle;  // buffers of threads that have exited
+    };
+
+    // Never destroyed: threads still running at exit may log into it
+    LogRegistry& log_registry()
+    {
+        static LogRegistry* r = new LogRegistry;
+        return *r;
+    }
+
+    // Gives a thread its buffer on first use and hands it back when it
+    // exits; whatever is still in it goes out with the next flush
+    struct LogOwner {
+        LogBuffer* buffer = nullptr;
+
+        LogBuffer& get()
+        {
+            if (buffer == nullptr) {
+                LogRegistry& r = log_registry();
+                std::lock_guard<std::mutex> lock(r.mutex);
+                if (!r.idle.empty()) {
+                    buffer = r.idle.back();
+                    r.idle.pop_back();
+                } else {
+                    r.all.push_back(std::make_unique<LogBuffer>());
+                    buffer = r.all.back().get();
+                    buffer->data.reserve(LOG_BUFFER_BYTES);
+                }
+            }
+            return *buffer;
+        }
+
+        ~LogOwner()
+        {
+            if (buffer == nullptr)
+                return;
+            LogRegistry& r = log_registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.idle.push_back(buffer);
+        }
+    };
+
+    thread_local LogOwner log_owner;
+
+    std::atomic<int> log_fd{STDERR_FILENO};
+    // Set while a Logger's flusher runs; read under a LogBuffer mutex
+    std::atomic<bool> log_buffering{false};
+
+    // Wakes the flusher early: a buffer is half full or an error was logged
+    std::mutex flush_mutex;
+    std::condition_variable flush_cv;
+    bool flush_wanted = false;
+    bool flush_stop = false;
+
+    // Serializes drains from the flusher and Logger::flush()
+    std::mutex drain_mutex;
+
+    const char* const LEVEL_NAMES[] = {"debug", "info", "warn", "error", "off"};
+
+    void write_all(int fd, const char* p, size_t n)
+    {
+        while (n > 0) {
+            ssize_t w = ::write(fd, p, n);
+            if (w == -1) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+            p += w;
+            n -= static_cast<size_t>(w);
+        }
+    }
+
+    // ts=2026-01-02T03:04:05.678901Z level=warn tid=123 src=fs msg="..."
+    void append_record(std::string& out, utils::LogLevel level, const char* component, const char* msg)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        // Formatting the date is the slow part; redo it once a second
+        thread_local time_t date_sec = -1;
+        thread_local char date[32];
+        thread_local pid_t tid = gettid();
+        if (now.tv_sec != date_sec) {
+            struct tm tm;
+            gmtime_r(&now.tv_sec, &tm);
+            strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+            date_sec = now.tv_sec;
+        }
+
+        char head[128];
+        snprintf(head, sizeof(head), "ts=%s.%06ldZ level=%s tid=%d src=%s msg=\"", date,
+                 now.tv_nsec / 1000, LEVEL_NAMES[static_cast<int>(level)], static_cast<int>(tid), component);
+        out += head;
+        for (const char* c = msg; *c != '\0'; ++c) {
+            if (*c == '"' || *c == '\\') {
+                out += '\\';
+                out += *c;
+            } else if (*c == '\n') {
+                out += "\\n";
+            } else {
+                out += *c;
+            }
+        }
+        out += "\"\n";
+    }
+
+    // Write every thread's buffered records to fd, oldest buffer first
+    void drain(int fd)
+    {
+        std::lock_guard<std::mutex> drain_lock(drain_mutex);
+        std::vector<LogBuffer*> buffers;
+        {
+            LogRegistry& r = log_registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            for (const auto& b : r.all)
+                buffers.push_back(b.get());
+        }
+
+        // Swapping hands the buffer the capacity of the last one drained,
+        // so the logging thread does not allocate again
+        static std::string chunk;
+        for (LogBuffer* b : buffers) {
+            uint64_t dropped;
+            {
+                std::lock_guard<std::mutex> lock(b->mutex);
+                chunk.swap(b->data);
+                dropped = b->dropped;
+                b->dropped = 0;
+            }
+            if (dropped != 0) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "dropped %llu records", static_cast<unsigned long long>(dropped));
+                append_record(chunk, utils::LogLevel::Warn, "log", msg);
+            }
+            write_all(fd, chunk.data(), chunk.size());
+            chunk.clear();
+        }
+    }
+}
+
+namespace utils {
+
+void set_backing_root(const std::string& dir)
+{
+    backing_root = dir;
+    while (backing_root.size() > 1 && backing_root.back() == '/')
+        backing_root.pop_back();
+}
+
+std::string backing_path(const char* path)
+{
+    std::string real;
+    real.reserve(backing_root.size() + strlen(path) + 1);
+    real = backing_root;
+    if (path[0] != '/')
+        real += '/';
+    real += path;
+    return real;
+}
+
+std::string relative_path(const char* path)
+{
+    while (*path == '/')
+        ++path;
+    return path;
+}
+
+std::atomic<int> log_threshold{static_cast<int>(LogLevel::Info)};
+
+void set_log_level(LogLevel level)
+{
+    log_threshold.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+LogLevel log_level()
+{
+    return static_cast<LogLevel>(log_threshold.load(std::memory_order_relaxed));
+}
+
+const char* name(LogLevel level)
+{
+    return LEVEL_NAMES[static_cast<int>(level)];
+}
+
+bool parse_log_level(const std::string& text, LogLevel& out)
+{
+    size_t end = text.find_last_not_of(" \t\r\n");
+    std::string word = end == std::string::npos ? std::string() : text.substr(0, end + 1);
+    for (int i = 0; i <= static_cast<int>(LogLevel::Off); ++i) {
+        if (word == LEVEL_NAMES[i]) {
+            out = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void log_write(LogLevel level, const char* component, const char* fmt, ...)
+{
+    char msg[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    thread_local std::string record;
+    record.clear();
+    append_record(record, level, component, msg);
+
+    LogBuffer& b = log_owner.get();
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(b.mutex);
+        if (log_buffering.load(std::memory_order_relaxed)) {
+            if (b.data.size() + record.size() > LOG_BUFFER_BYTES) {
+                ++b.dropped;
+                return;
+            }
+            bool was_below_half = b.data.size() < LOG_BUFFER_BYTES / 2;
+            b.data += record;
+            wake = level >= LogLevel::Error || (was_below_half && b.data.size() >= LOG_BUFFER_BYTES / 2);
+            if (!wake)
+                return;
+        } else {
+            wake = false;
+        }
+    }
+    if (wake) {
+        {
+            std::lock_guard<std::mutex> lock(flush_mutex);
+            flush_wanted = true;
+        }
+        flush_cv.notify_one();
+        return;
+    }
+    // No flusher running: before FUSE daemonized or after unmount
+    write_all(log_fd.load(std::memory_order_relaxed), record.data(), record.size());
+}
+
+Logger::~Logger()
+{
+    if (worker_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(flush_mutex);
+            flush_stop = true;
+        }
+        flush_cv.notify_one();
+        worker_.join();
+    }
+    // Records logged once a thread sees this go straight out, so the drain
+    // below is the last that can find anything buffered
+    log_buffering.store(false, std::memory_order_relaxed);
+    drain(log_fd.load(std::memory_order_relaxed));
+    if (fd_ != -1) {
+        log_fd.store(STDERR_FILENO, std::memory_order_relaxed);
+        ::close(fd_);
+    }
+}
+
+bool Logger::open(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return false;
+    if (fd_ != -1)
+        ::close(fd_);
+    fd_ = fd;
+    log_fd.store(fd, std::memory_order_relaxed);
+    return true;
+}
+
+bool Logger::start()
+{
+    if (worker_.joinable() || log_buffering.load(std::memory_order_relaxed))
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(flush_mutex);
+        flush_stop = false;
+    }
+    log_buffering.store(true, std::memory_order_relaxed);
+    worker_ = std::thread(&Logger::run, this);
+    return true;
+}
+
+void Logger::flush()
+{
+    drain(log_fd.load(std::memory_order_relaxed));
+}
+
+void Logger::run()
+{
+    std::unique_lock<std::mutex> lock(flush_mutex);
+    while (!flush_stop) {
+        flush_cv.wait_for(lock, LOG_FLUSH_INTERVAL, [] { return flush_wanted || flush_stop; });
+        flush_wanted = false;
+        lock.unlock();
+        drain(log_fd.load(std::memory_order_relaxed));
+        lock.lock();
+    }
+}
+
+} // namespace utils
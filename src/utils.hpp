@@ -1,3 +1,6 @@
+#ifndef SECURENOTEFS_UTILS_HPP
+#define SECURENOTEFS_UTILS_HPP
+
 /*
  * FUSE: Filesystem in Userspace
  *
@@ -27,7 +30,7 @@
  * Creates files on the underlying file system in response to a FUSE_MKNOD
  * operation
  */
-static int mknod_wrapper(int dirfd, const char *path, const char *link,
+static inline int mknod_wrapper(int dirfd, const char *path, const char *link,
 	int mode, dev_t rdev)
 {
 	int res;
@@ -73,4 +76,96 @@ static int mknod_wrapper(int dirfd, const char *path, const char *link,
 	}
 
 	return res;
-}
\ No newline at end of file
+}
+
+#ifdef __cplusplus
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Lowest level compiled into SN_LOG_* calls: 0 debug, 1 info, 2 warn, 3 error.
+// Calls below it, arguments included, generate no code at all.
+#ifndef SECURENOTEFS_LOG_MIN_LEVEL
+#define SECURENOTEFS_LOG_MIN_LEVEL 1
+#endif
+
+// Log a printf-style message from component, e.g.
+// SN_LOG_WARN("tar_manager", "cannot walk %s", dir.c_str())
+#define SN_LOG(level, component, ...)                                          \
+    do {                                                                       \
+        if constexpr (static_cast<int>(level) >= SECURENOTEFS_LOG_MIN_LEVEL) { \
+            if (utils::log_enabled(level))                                     \
+                utils::log_write(level, component, __VA_ARGS__);               \
+        }                                                                      \
+    } while (0)
+#define SN_LOG_DEBUG(component, ...) SN_LOG(utils::LogLevel::Debug, component, __VA_ARGS__)
+#define SN_LOG_INFO(component, ...) SN_LOG(utils::LogLevel::Info, component, __VA_ARGS__)
+#define SN_LOG_WARN(component, ...) SN_LOG(utils::LogLevel::Warn, component, __VA_ARGS__)
+#define SN_LOG_ERROR(component, ...) SN_LOG(utils::LogLevel::Error, component, __VA_ARGS__)
+
+namespace utils {
+
+// Set the absolute directory (data/) that mirrors the mount; call before fuse_main
+void set_backing_root(const std::string& dir);
+
+// Backing path under data/ for a path FUSE hands to a callback
+std::string backing_path(const char* path);
+
+// Path relative to the mount root, without the leading '/'
+std::string relative_path(const char* path);
+
+enum class LogLevel : int { Debug, Info, Warn, Error, Off };
+
+// Runtime threshold; records below it are skipped after one relaxed load
+extern std::atomic<int> log_threshold;
+
+inline bool log_enabled(LogLevel level)
+{
+    return static_cast<int>(level) >= log_threshold.load(std::memory_order_relaxed);
+}
+
+void set_log_level(LogLevel level);
+LogLevel log_level();
+
+// "debug", "info", "warn", "error" or "off"
+const char* name(LogLevel level);
+bool parse_log_level(const std::string& text, LogLevel& out);
+
+// Append one logfmt record (ts, level, tid, src, msg) to the calling thread's
+// buffer. Never waits for I/O or other threads; records that do not fit
+// before the next flush are counted and dropped. Use the SN_LOG_* macros.
+void log_write(LogLevel level, const char* component, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Where records go and the thread that writes them out. Until start(), and
+// after destruction, records are written as they are logged. Only one Logger
+// may be started per process.
+class Logger {
+public:
+    Logger() = default;
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+    // Writes out whatever is still buffered
+    ~Logger();
+
+    // Append records to path instead of stderr; call before FUSE daemonizes,
+    // which points stderr at /dev/null
+    bool open(const std::string& path);
+
+    // Start buffering and the flusher thread; call after FUSE has daemonized
+    bool start();
+
+    // Write every buffered record out now
+    void flush();
+
+private:
+    void run();
+
+    int fd_ = -1;
+    std::thread worker_;
+};
+
+} // namespace utils
+#endif
+
+#endif // SECURENOTEFS_UTILS_HPP
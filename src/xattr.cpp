@@ -0,0 +1,308 @@
+/*
+Responsibilities of xattr:
+
+Store all extended attributes of a file in data/ as one blob in a single
+backing attribute, so any namespace can be kept whatever the backing
+filesystem lets an unprivileged user set, and a file's attributes load in
+one syscall.
+
+Keep the attributes of recently used files in memory, sharded by path, so
+the getxattr calls security modules and indexers make all the time cost a
+hash lookup.
+*/
+
+#include "xattr.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+namespace xattr {
+
+namespace {
+
+void put_u32(std::string& out, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        out += static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+void put_str(std::string& out, const std::string& s)
+{
+    put_u32(out, static_cast<uint32_t>(s.size()));
+    out += s;
+}
+
+bool get_u32(const std::string& in, size_t& pos, uint32_t& v)
+{
+    if (in.size() - pos < 4)
+        return false;
+    v = 0;
+    for (int i = 0; i < 4; ++i)
+        v |= static_cast<uint32_t>(static_cast<unsigned char>(in[pos + i])) << (8 * i);
+    pos += 4;
+    return true;
+}
+
+bool get_str(const std::string& in, size_t& pos, std::string& s)
+{
+    uint32_t len;
+    if (!get_u32(in, pos, len) || in.size() - pos < len)
+        return false;
+    s.assign(in, pos, len);
+    pos += len;
+    return true;
+}
+
+// Copy out of the cache the way getxattr(2) does: size 0 asks for the length
+int copy_out(const std::string& bytes, char* buf, size_t size)
+{
+    if (size == 0)
+        return static_cast<int>(bytes.size());
+    if (size < bytes.size())
+        return -ERANGE;
+    std::memcpy(buf, bytes.data(), bytes.size());
+    return static_cast<int>(bytes.size());
+}
+
+int get_from(const Attrs& attrs, const std::string& name, char* value, size_t size)
+{
+    auto it = attrs.find(name);
+    if (it == attrs.end())
+        return -ENODATA;
+    return copy_out(it->second, value, size);
+}
+
+int list_from(const Attrs& attrs, char* list, size_t size)
+{
+    std::string names;
+    for (const auto& [name, value] : attrs) {
+        names += name;
+        names += '\0';
+    }
+    return copy_out(names, list, size);
+}
+
+} // namespace
+
+std::string encode(const Attrs& attrs)
+{
+    std::string out;
+    put_u32(out, static_cast<uint32_t>(attrs.size()));
+    for (const auto& [name, value] : attrs) {
+        put_str(out, name);
+        put_str(out, value);
+    }
+    return out;
+}
+
+bool decode(const std::string& blob, Attrs& attrs)
+{
+    attrs.clear();
+    size_t pos = 0;
+    uint32_t count;
+    if (!get_u32(blob, pos, count))
+        return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string name, value;
+        if (!get_str(blob, pos, name) || !get_str(blob, pos, value))
+            return false;
+        attrs.emplace(std::move(name), std::move(value));
+    }
+    return pos == blob.size();
+}
+
+int get(const std::string& blob, const std::string& name, char* value, size_t size)
+{
+    Attrs attrs;
+    if (!blob.empty() && !decode(blob, attrs))
+        return -EIO;
+    return get_from(attrs, name, value, size);
+}
+
+int list(const std::string& blob, char* list, size_t size)
+{
+    Attrs attrs;
+    if (!blob.empty() && !decode(blob, attrs))
+        return -EIO;
+    return list_from(attrs, list, size);
+}
+
+Cache::Shard& Cache::shard(const std::string& rel)
+{
+    return shards_[std::hash<std::string>()(rel) % SHARDS];
+}
+
+int Cache::load(Shard& s, const std::string& rel, const std::string& real, Attrs*& out)
+{
+    auto it = s.files.find(rel);
+    if (it != s.files.end()) {
+        out = &it->second;
+        return 0;
+    }
+
+    Attrs attrs;
+    std::string blob;
+    for (;;) {
+        ssize_t len = ::lgetxattr(real.c_str(), BLOB_NAME, nullptr, 0);
+        if (len == -1 && errno != ENODATA)
+            return -errno;
+        if (len == -1)
+            break;
+        blob.resize(static_cast<size_t>(len));
+        len = ::lgetxattr(real.c_str(), BLOB_NAME, blob.data(), blob.size());
+        if (len == -1 && errno == ERANGE)
+            continue;  // grew in between
+        if (len == -1)
+            return -errno;
+        blob.resize(static_cast<size_t>(len));
+        if (!decode(blob, attrs))
+            return -EIO;
+        break;
+    }
+
+    while (s.files.size() >= shard_limit_)
+        s.files.erase(s.files.begin());
+    out = &s.files.emplace(rel, std::move(attrs)).first->second;
+    return 0;
+}
+
+int Cache::store(const std::string& real, const Attrs& attrs)
+{
+    int res;
+    if (attrs.empty()) {
+        res = ::lremovexattr(real.c_str(), BLOB_NAME);
+        if (res == -1 && errno == ENODATA)
+            res = 0;
+    } else {
+        std::string blob = encode(attrs);
+        res = ::lsetxattr(real.c_str(), BLOB_NAME, blob.data(), blob.size(), 0);
+    }
+    return res == -1 ? -errno : 0;
+}
+
+int Cache::get(const std::string& rel, const std::string& real, const std::string& name,
+               char* value, size_t size)
+{
+    Shard& s = shard(rel);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    Attrs* attrs;
+    int res = load(s, rel, real, attrs);
+    if (res != 0)
+        return res;
+    return get_from(*attrs, name, value, size);
+}
+
+int Cache::list(const std::string& rel, const std::string& real, char* list, size_t size)
+{
+    Shard& s = shard(rel);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    Attrs* attrs;
+    int res = load(s, rel, real, attrs);
+    if (res != 0)
+        return res;
+    return list_from(*attrs, list, size);
+}
+
+int Cache::set(const std::string& rel, const std::string& real, const std::string& name,
+               const char* value, size_t size, int flags)
+{
+    return update(rel, real, [&](Attrs& attrs) {
+        bool exists = attrs.count(name) != 0;
+        if ((flags & XATTR_CREATE) && exists)
+            return -EEXIST;
+        if ((flags & XATTR_REPLACE) && !exists)
+            return -ENODATA;
+        attrs[name].assign(value, size);
+        return 0;
+    });
+}
+
+int Cache::remove(const std::string& rel, const std::string& real, const std::string& name)
+{
+    return update(rel, real, [&](Attrs& attrs) {
+        return attrs.erase(name) != 0 ? 0 : -ENODATA;
+    });
+}
+
+int Cache::update(const std::string& rel, const std::string& real,
+                  const std::function<int(Attrs&)>& change)
+{
+    {
+        Shard& s = shard(rel);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        Attrs* attrs;
+        int res = load(s, rel, real, attrs);
+        if (res != 0)
+            return res;
+
+        Attrs updated = *attrs;
+        if ((res = change(updated)) != 0 || (res = store(real, updated)) != 0)
+            return res;
+        *attrs = std::move(updated);
+    }
+
+    // Other names of a hard-linked file have entries of their own, in any
+    // shard; links are rare enough to just start over
+    struct stat st;
+    if (::lstat(real.c_str(), &st) == 0 && !S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.files.clear();
+        }
+    }
+    return 0;
+}
+
+void Cache::forget(const std::string& rel)
+{
+    Shard& s = shard(rel);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.files.erase(rel);
+}
+
+void Cache::forget_tree(const std::string& rel)
+{
+    std::string prefix = rel.empty() ? rel : rel + "/";
+    for (auto& s : shards_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (auto it = s.files.begin(); it != s.files.end();) {
+            if (it->first == rel || it->first.starts_with(prefix))
+                it = s.files.erase(it);
+            else
+                ++it;
+        }
+    }
+}
+
+size_t Cache::size()
+{
+    size_t n = 0;
+    for (auto& s : shards_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        n += s.files.size();
+    }
+    return n;
+}
+
+size_t Cache::capacity()
+{
+    return shard_limit_ * SHARDS;
+}
+
+void Cache::set_capacity(size_t files)
+{
+    size_t limit = std::max<size_t>(1, (files + SHARDS - 1) / SHARDS);
+    shard_limit_ = limit;
+    for (auto& s : shards_) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        while (s.files.size() > limit)
+            s.files.erase(s.files.begin());
+    }
+}
+
+} // namespace xattr
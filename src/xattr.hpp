@@ -0,0 +1,89 @@
+#ifndef SECURENOTEFS_XATTR_HPP
+#define SECURENOTEFS_XATTR_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace xattr {
+
+// Backing attribute holding every extended attribute of a file in data/
+inline constexpr const char* BLOB_NAME = "user.securenotefs";
+
+// A file's attributes, name to value
+using Attrs = std::map<std::string, std::string>;
+
+// Blob layout: count:u32 { name:str value:str } * count, str a u32 length
+// and the bytes, integers little-endian
+std::string encode(const Attrs& attrs);
+bool decode(const std::string& blob, Attrs& attrs);
+
+// getxattr(2) and listxattr(2) answered from an encoded blob, for a file
+// still only in a snapshot; -EIO if the blob is malformed
+int get(const std::string& blob, const std::string& name, char* value, size_t size);
+int list(const std::string& blob, char* list, size_t size);
+
+// Extended attributes of the files in data/, keyed by their path relative
+// to it. Each file's attributes are packed into the one BLOB_NAME attribute
+// of its backing file, read with a single syscall the first time the file
+// is asked about and answered from memory after that, so getxattr and
+// listxattr never reach the disk twice for the same file. Every call
+// returns what the xattr syscall would, or -errno.
+class Cache {
+public:
+    Cache() = default;
+    Cache(const Cache&) = delete;
+    Cache& operator=(const Cache&) = delete;
+
+    int get(const std::string& rel, const std::string& real, const std::string& name,
+            char* value, size_t size);
+    int list(const std::string& rel, const std::string& real, char* list, size_t size);
+    int set(const std::string& rel, const std::string& real, const std::string& name,
+            const char* value, size_t size, int flags);
+    int remove(const std::string& rel, const std::string& real, const std::string& name);
+
+    // Drop what is known about rel, or about rel and everything below it,
+    // once the name stops referring to the same file
+    void forget(const std::string& rel);
+    void forget_tree(const std::string& rel);
+
+    // Files with attributes in memory
+    size_t size();
+
+    // Files kept before the oldest ones are dropped; lowering it drops the
+    // excess at once
+    size_t capacity();
+    void set_capacity(size_t files);
+
+private:
+    static constexpr size_t SHARDS = 16;
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Attrs> files;
+    };
+
+    Shard& shard(const std::string& rel);
+
+    // Attributes of rel, loaded on a miss; called with the shard locked
+    int load(Shard& s, const std::string& rel, const std::string& real, Attrs*& out);
+
+    // Write attrs back as the blob of real; called with the shard locked
+    int store(const std::string& real, const Attrs& attrs);
+
+    // Apply change to a copy of rel's attributes and store it, keeping the
+    // cache as it was if either fails
+    int update(const std::string& rel, const std::string& real,
+               const std::function<int(Attrs&)>& change);
+
+    std::atomic<size_t> shard_limit_{4096};
+    Shard shards_[SHARDS];
+};
+
+} // namespace xattr
+
+#endif // SECURENOTEFS_XATTR_HPP
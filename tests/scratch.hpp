@@ -0,0 +1,32 @@
+#ifndef SECURENOTEFS_TESTS_SCRATCH_HPP
+#define SECURENOTEFS_TESTS_SCRATCH_HPP
+
+#include <filesystem>
+#include <string>
+
+#include <unistd.h>
+
+// An empty directory under the system temp dir, removed again when the
+// test is done with it
+struct Scratch {
+    std::filesystem::path dir;
+
+    explicit Scratch(const std::string& name)
+        : dir(std::filesystem::temp_directory_path() /
+              ("securenotefs-test-" + name + "-" + std::to_string(::getpid())))
+    {
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directories(dir);
+    }
+    ~Scratch()
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(dir, ec);
+    }
+    Scratch(const Scratch&) = delete;
+    Scratch& operator=(const Scratch&) = delete;
+
+    std::string path(const std::string& rel = "") const { return (dir / rel).string(); }
+};
+
+#endif // SECURENOTEFS_TESTS_SCRATCH_HPP
@@ -0,0 +1,147 @@
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "attr_cache.hpp"
+#include "scratch.hpp"
+
+namespace {
+
+// One lookup the way sn_getattr does it: cache, else ticket, lstat, fill
+bool lookup(attr_cache::Cache& cache, const Scratch& s, const std::string& rel, struct stat& st)
+{
+    if (cache.get(rel, st))
+        return true;
+    attr_cache::Cache::Ticket ticket = cache.ticket(rel);
+    if (::lstat(s.path(rel).c_str(), &st) == -1)
+        return false;
+    cache.fill(rel, st, ticket);
+    return false;
+}
+
+} // namespace
+
+TEST_CASE("attr cache stores from the second lookup on", "[attr_cache]")
+{
+    Scratch s("attr-second");
+    std::ofstream(s.path("note")) << "hello";
+    attr_cache::Cache cache;
+    struct stat st;
+
+    CHECK_FALSE(lookup(cache, s, "note", st));  // learns the inode
+    CHECK_FALSE(lookup(cache, s, "note", st));  // stores
+    REQUIRE(lookup(cache, s, "note", st));
+    CHECK(st.st_size == 5);
+    CHECK(cache.size() == 1);
+
+    cache.changed("note");
+    CHECK_FALSE(cache.get("note", st));
+}
+
+TEST_CASE("attr cache drops an lstat that raced a change", "[attr_cache]")
+{
+    Scratch s("attr-race");
+    std::ofstream(s.path("note")) << "hello";
+    attr_cache::Cache cache;
+    struct stat st;
+    lookup(cache, s, "note", st);
+
+    // The lstat returns before the write, but fill() runs after it
+    attr_cache::Cache::Ticket ticket = cache.ticket("note");
+    struct stat stale;
+    REQUIRE(::lstat(s.path("note").c_str(), &stale) == 0);
+    std::ofstream(s.path("note"), std::ios::app) << " world";
+    cache.changed("note");
+    cache.fill("note", stale, ticket);
+    CHECK_FALSE(cache.get("note", st));
+
+    CHECK_FALSE(lookup(cache, s, "note", st));
+    REQUIRE(lookup(cache, s, "note", st));
+    CHECK(st.st_size == 11);
+}
+
+TEST_CASE("attr cache follows a name to a new inode", "[attr_cache]")
+{
+    Scratch s("attr-replace");
+    std::ofstream(s.path("note")) << "old";
+    std::ofstream(s.path("other")) << "replacement";
+    attr_cache::Cache cache;
+    struct stat st;
+    lookup(cache, s, "note", st);
+    lookup(cache, s, "note", st);
+    REQUIRE(cache.get("note", st));
+
+    // Renamed over by something the cache was not told about: the ticket
+    // names the old inode, so the lstat only remaps the path
+    REQUIRE(::rename(s.path("other").c_str(), s.path("note").c_str()) == 0);
+    cache.forget("note");
+    attr_cache::Cache::Ticket ticket = cache.ticket("note");
+    CHECK_FALSE(ticket.known);
+    REQUIRE(::lstat(s.path("note").c_str(), &st) == 0);
+    cache.fill("note", st, ticket);
+    CHECK_FALSE(cache.get("note", st));
+
+    lookup(cache, s, "note", st);
+    REQUIRE(lookup(cache, s, "note", st));
+    CHECK(st.st_size == 11);
+}
+
+TEST_CASE("attr cache skips hard-linked files", "[attr_cache]")
+{
+    Scratch s("attr-links");
+    std::ofstream(s.path("note")) << "hello";
+    REQUIRE(::link(s.path("note").c_str(), s.path("alias").c_str()) == 0);
+    attr_cache::Cache cache;
+    struct stat st;
+    for (int i = 0; i < 3; ++i)
+        CHECK_FALSE(lookup(cache, s, "note", st));
+    CHECK(cache.size() == 0);
+}
+
+TEST_CASE("attr cache forgets renamed trees", "[attr_cache]")
+{
+    Scratch s("attr-tree");
+    std::filesystem::create_directories(s.path("dir/sub"));
+    std::ofstream(s.path("dir/sub/note")) << "hello";
+    attr_cache::Cache cache;
+    struct stat st;
+    for (const char* rel : {"dir", "dir/sub/note", "dir", "dir/sub/note"})
+        lookup(cache, s, rel, st);
+    REQUIRE(cache.get("dir/sub/note", st));
+
+    cache.forget_tree("dir");
+    CHECK_FALSE(cache.get("dir", st));
+    CHECK_FALSE(cache.get("dir/sub/note", st));
+}
+
+TEST_CASE("attr cache never serves attributes older than the last change", "[attr_cache]")
+{
+    Scratch s("attr-stress");
+    std::ofstream(s.path("note")) << "";
+    attr_cache::Cache cache;
+    std::atomic<bool> stop{false};
+
+    std::thread prober([&] {
+        struct stat st;
+        while (!stop)
+            lookup(cache, s, "note", st);
+    });
+
+    // A writer the way sn_write does it: change the file, then bump it
+    for (int i = 0; i < 200; ++i) {
+        std::ofstream(s.path("note"), std::ios::app) << "x";
+        cache.changed("note");
+        struct stat st;
+        if (cache.get("note", st))
+            CHECK(st.st_size == i + 1);
+    }
+    stop = true;
+    prober.join();
+}
@@ -0,0 +1,168 @@
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <fstream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "journal.hpp"
+#include "scratch.hpp"
+#include "utils.hpp"
+
+namespace {
+
+tar_manager::Change change(const std::string& path, bool removed = false, bool tree = false)
+{
+    tar_manager::Change c;
+    c.path = path;
+    c.removed = removed;
+    c.tree = tree;
+    return c;
+}
+
+// Paths an unclean shutdown of the journal in dir left behind
+std::set<std::string> replay(const Scratch& s)
+{
+    journal::Journal j;
+    std::vector<tar_manager::Change> recovered;
+    bool found = false;
+    REQUIRE(j.open(s.path(), recovered, found));
+    std::set<std::string> paths;
+    for (const auto& c : recovered)
+        paths.insert(c.path);
+    return paths;
+}
+
+} // namespace
+
+TEST_CASE("journal replays what an unclean shutdown left", "[journal]")
+{
+    Scratch s("journal-replay");
+    {
+        journal::Journal j;
+        std::vector<tar_manager::Change> recovered;
+        bool found = true;
+        REQUIRE(j.open(s.path(), recovered, found));
+        CHECK_FALSE(found);
+        CHECK(recovered.empty());
+        CHECK(j.log(change("a")) != 0);
+        CHECK(j.log({change("b", true), change("c", false, true)}) != 0);
+        // Logging a path again with a subset of its flags adds nothing
+        CHECK(j.log(change("c")) != 0);
+    }
+
+    journal::Journal j;
+    std::vector<tar_manager::Change> recovered;
+    bool found = false;
+    REQUIRE(j.open(s.path(), recovered, found));
+    CHECK(found);
+    REQUIRE(recovered.size() == 3);
+    for (const auto& c : recovered) {
+        CHECK(c.removed == (c.path == "b"));
+        CHECK(c.tree == (c.path == "c"));
+    }
+}
+
+TEST_CASE("journal group commit keeps every concurrent record", "[journal]")
+{
+    Scratch s("journal-group");
+    constexpr int THREADS = 8, PER_THREAD = 50;
+    {
+        journal::Journal j;
+        std::vector<tar_manager::Change> recovered;
+        bool found;
+        REQUIRE(j.open(s.path(), recovered, found));
+        std::atomic<int> failures{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; ++t)
+            threads.emplace_back([&, t] {
+                for (int i = 0; i < PER_THREAD; ++i)
+                    if (j.log(change("t" + std::to_string(t) + "/" + std::to_string(i))) == 0)
+                        ++failures;
+            });
+        for (auto& t : threads)
+            t.join();
+        CHECK(failures == 0);
+    }
+    CHECK(replay(s).size() == THREADS * PER_THREAD);
+}
+
+TEST_CASE("journal rotates while other threads append", "[journal]")
+{
+    Scratch s("journal-rotate");
+    constexpr int THREADS = 8, PER_THREAD = 300;
+    {
+        // A rotation that trips over another one only shows in the log
+        utils::Logger logger;
+        REQUIRE(logger.open(s.path("log")));
+        journal::Journal j;
+        std::vector<tar_manager::Change> recovered;
+        bool found;
+        REQUIRE(j.open(s.path(), recovered, found));
+        uint64_t first = j.segment();
+
+        std::atomic<int> failures{0};
+        std::atomic<bool> done{false};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; ++t)
+            threads.emplace_back([&, t] {
+                for (int i = 0; i < PER_THREAD; ++i)
+                    if (j.log(change("t" + std::to_string(t) + "/" + std::to_string(i))) == 0)
+                        ++failures;
+            });
+        // Two checkpointers' worth of rotations, so one often finds a
+        // leader mid-write and the other waiting behind it
+        std::vector<std::thread> rotators;
+        for (int r = 0; r < 2; ++r)
+            rotators.emplace_back([&] {
+                while (!done)
+                    j.rotate();
+            });
+        for (auto& t : threads)
+            t.join();
+        done = true;
+        for (auto& r : rotators)
+            r.join();
+
+        CHECK(failures == 0);
+        CHECK(j.segment() > first);
+        // Every record is on disk, whichever segment it went to
+        CHECK(j.log(change("after")) != 0);
+    }
+    std::ifstream log(s.path("log"));
+    std::string line;
+    while (std::getline(log, line))
+        CHECK(line.find("level=error") == std::string::npos);
+    CHECK(replay(s).size() == THREADS * PER_THREAD + 1);
+}
+
+TEST_CASE("journal retire drops older segments only", "[journal]")
+{
+    Scratch s("journal-retire");
+    {
+        journal::Journal j;
+        std::vector<tar_manager::Change> recovered;
+        bool found;
+        REQUIRE(j.open(s.path(), recovered, found));
+        REQUIRE(j.log(change("old")) != 0);
+        uint64_t old = j.rotate();
+        REQUIRE(j.log(change("new")) != 0);
+        // A checkpoint holding everything up to the rotation
+        j.retire(old + 1);
+    }
+    CHECK(replay(s) == std::set<std::string>{"new"});
+
+    {
+        journal::Journal j;
+        std::vector<tar_manager::Change> recovered;
+        bool found;
+        REQUIRE(j.open(s.path(), recovered, found));
+        j.clear();
+    }
+    CHECK(replay(s).empty());
+}
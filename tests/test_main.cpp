@@ -0,0 +1,3 @@
+// Catch2 supplies main() for every test_*.cpp linked into securenotefs_tests
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
@@ -0,0 +1,119 @@
+#include <catch2/catch.hpp>
+
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "metadata.hpp"
+
+namespace {
+
+// Paths the index views; must outlive it
+const std::vector<std::string> PATHS = {"b", "a/z", "a", "a/b/c", "a/b", "ab", "a/a", "c/d"};
+
+std::vector<std::string_view> views()
+{
+    return std::vector<std::string_view>(PATHS.begin(), PATHS.end());
+}
+
+// Paths of slots, in the order given
+std::vector<std::string_view> paths_of(const metadata::Index& index, std::span<const uint32_t> slots)
+{
+    std::vector<std::string_view> out;
+    for (uint32_t slot : slots)
+        out.push_back(index.path(slot));
+    return out;
+}
+
+} // namespace
+
+TEST_CASE("metadata index finds every path by slot", "[metadata]")
+{
+    metadata::Index index;
+    index.build(views());
+    REQUIRE(index.size() == PATHS.size());
+
+    for (uint32_t slot = 0; slot < PATHS.size(); ++slot) {
+        CHECK(index.find(PATHS[slot]) == slot);
+        CHECK(index.path(slot) == PATHS[slot]);
+        CHECK(index.present(slot));
+    }
+    CHECK(index.find("") == metadata::NONE);
+    CHECK(index.find("a/") == metadata::NONE);
+    CHECK(index.find("c") == metadata::NONE);  // only implied by c/d
+    CHECK(index.find("a/b/c/d") == metadata::NONE);
+}
+
+TEST_CASE("metadata index lists one directory in name order", "[metadata]")
+{
+    metadata::Index index;
+    index.build(views());
+
+    using list = std::vector<std::string_view>;
+    CHECK(paths_of(index, index.children("")) == list{"a", "ab", "b"});
+    CHECK(paths_of(index, index.children("a")) == list{"a/a", "a/b", "a/z"});
+    CHECK(paths_of(index, index.children("a/b")) == list{"a/b/c"});
+    CHECK(paths_of(index, index.children("c")) == list{"c/d"});
+    CHECK(index.children("a/b/c").empty());
+    CHECK(index.children("missing").empty());
+}
+
+TEST_CASE("metadata index keeps slots of removed entries", "[metadata]")
+{
+    metadata::Index index;
+    index.build(views());
+
+    uint32_t slot = index.find("a/b");
+    index.remove(slot);
+    CHECK_FALSE(index.present(slot));
+    CHECK(index.find("a/b") == slot);
+    CHECK(index.children("a").size() == 3);
+    CHECK(index.present(index.find("a/b/c")));
+    CHECK(index.present(index.find("a/a")));
+
+    // Removing twice is harmless
+    index.remove(slot);
+    CHECK_FALSE(index.present(slot));
+}
+
+TEST_CASE("metadata index is rebuilt from scratch", "[metadata]")
+{
+    metadata::Index index;
+    index.build(views());
+    index.remove(index.find("b"));
+
+    std::vector<std::string> paths = {"x", "x/y"};
+    index.build(std::vector<std::string_view>(paths.begin(), paths.end()));
+    CHECK(index.size() == 2);
+    CHECK(index.find("b") == metadata::NONE);
+    CHECK(index.children("a").empty());
+    CHECK(index.present(index.find("x")));
+    CHECK(paths_of(index, index.children("x")) == std::vector<std::string_view>{"x/y"});
+}
+
+TEST_CASE("metadata index removals are seen by concurrent readers", "[metadata]")
+{
+    metadata::Index index;
+    std::vector<std::string> paths;
+    for (int i = 0; i < 1000; ++i)
+        paths.push_back("dir/" + std::to_string(i));
+    index.build(std::vector<std::string_view>(paths.begin(), paths.end()));
+
+    std::thread remover([&] {
+        for (uint32_t slot = 0; slot < index.size(); slot += 2)
+            index.remove(slot);
+    });
+    // Lookups race the removals; once a slot reads absent it stays absent
+    std::vector<bool> seen_absent(index.size());
+    for (int round = 0; round < 20; ++round)
+        for (uint32_t slot : index.children("dir")) {
+            bool present = index.present(slot);
+            CHECK_FALSE((present && seen_absent[slot]));
+            seen_absent[slot] = seen_absent[slot] || !present;
+        }
+    remover.join();
+
+    for (uint32_t slot = 0; slot < index.size(); ++slot)
+        CHECK(index.present(slot) == (slot % 2 == 1));
+}
@@ -0,0 +1,58 @@
+#include <catch2/catch.hpp>
+
+#include <cstdint>
+
+#include "metrics.hpp"
+
+using metrics::BUCKETS;
+using metrics::SUB_BUCKETS;
+using metrics::bucket_floor;
+using metrics::bucket_of;
+
+TEST_CASE("latencies below SUB_BUCKETS get a bucket each", "[metrics]")
+{
+    for (uint64_t ns = 0; ns < SUB_BUCKETS; ++ns) {
+        CHECK(bucket_of(ns) == ns);
+        CHECK(bucket_floor(ns) == ns);
+    }
+    // The first split power of two still has unit-wide buckets
+    CHECK(bucket_of(SUB_BUCKETS) == SUB_BUCKETS);
+    CHECK(bucket_of(2 * SUB_BUCKETS - 1) == 2 * SUB_BUCKETS - 1);
+}
+
+TEST_CASE("each power of two starts a new run of buckets", "[metrics]")
+{
+    for (unsigned bits = metrics::SUB_BITS; bits <= metrics::MAX_BITS; ++bits) {
+        uint64_t power = uint64_t(1) << bits;
+        size_t first = SUB_BUCKETS * (bits - metrics::SUB_BITS + 1);
+        CHECK(bucket_of(power) == first);
+        CHECK(bucket_of(power - 1) == first - 1);
+        CHECK(bucket_floor(first) == power);
+    }
+    // Wider buckets: 32 and 33 share one, 34 starts the next
+    CHECK(bucket_of(33) == bucket_of(32));
+    CHECK(bucket_of(34) == bucket_of(32) + 1);
+}
+
+TEST_CASE("bucket floors and bucket_of agree at every boundary", "[metrics]")
+{
+    for (size_t b = 0; b + 1 < BUCKETS; ++b) {
+        uint64_t floor = bucket_floor(b), next = bucket_floor(b + 1);
+        REQUIRE(floor < next);
+        CHECK(bucket_of(floor) == b);
+        CHECK(bucket_of(next - 1) == b);
+        // Off by at most 1/SUB_BUCKETS of the value
+        if (b >= SUB_BUCKETS)
+            CHECK((next - floor) * SUB_BUCKETS <= floor);
+    }
+    CHECK(bucket_of(bucket_floor(BUCKETS - 1)) == BUCKETS - 1);
+}
+
+TEST_CASE("latencies past the top land in the last bucket", "[metrics]")
+{
+    uint64_t top = uint64_t(1) << (metrics::MAX_BITS + 1);
+    CHECK(bucket_of(top - 1) == BUCKETS - 1);
+    CHECK(bucket_of(top) == BUCKETS - 1);
+    CHECK(bucket_of(top * 1024) == BUCKETS - 1);
+    CHECK(bucket_of(UINT64_MAX) == BUCKETS - 1);
+}
@@ -0,0 +1,99 @@
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "negative_cache.hpp"
+
+TEST_CASE("negative cache remembers misses until a name is created", "[negative_cache]")
+{
+    negative_cache::Cache cache;
+    CHECK_FALSE(cache.missing(".git"));
+
+    cache.add(".git", cache.generation(".git"));
+    cache.add("src/.editorconfig", cache.generation("src/.editorconfig"));
+    CHECK(cache.missing(".git"));
+    CHECK(cache.missing("src/.editorconfig"));
+    CHECK_FALSE(cache.missing("src/.git"));
+    CHECK(cache.size() == 2);
+
+    cache.forget(".git");
+    CHECK_FALSE(cache.missing(".git"));
+    CHECK(cache.missing("src/.editorconfig"));
+    CHECK(cache.size() == 1);
+}
+
+TEST_CASE("negative cache drops a miss that raced a creation", "[negative_cache]")
+{
+    negative_cache::Cache cache;
+
+    // lookup takes the generation, then lstat fails, but the name is
+    // created in between: the creation's forget() moves the generation on
+    uint64_t before = cache.generation("dir/lock");
+    cache.forget("dir/lock");
+    cache.add("dir/lock", before);
+    CHECK_FALSE(cache.missing("dir/lock"));
+
+    // Once nothing raced, a fresh generation is accepted
+    cache.add("dir/lock", cache.generation("dir/lock"));
+    CHECK(cache.missing("dir/lock"));
+}
+
+TEST_CASE("negative cache forgets whole trees on rename", "[negative_cache]")
+{
+    negative_cache::Cache cache;
+    for (const char* rel : {"a/x", "a/b/y", "ab/z", "c/w"})
+        cache.add(rel, cache.generation(rel));
+
+    // A miss under the tree that was in flight during the rename
+    uint64_t before = cache.generation("a/b/late");
+    cache.forget_tree("a");
+    cache.add("a/b/late", before);
+
+    CHECK_FALSE(cache.missing("a/x"));
+    CHECK_FALSE(cache.missing("a/b/y"));
+    CHECK_FALSE(cache.missing("a/b/late"));
+    CHECK(cache.missing("ab/z"));
+    CHECK(cache.missing("c/w"));
+
+    cache.forget_tree("");
+    CHECK(cache.size() == 0);
+}
+
+TEST_CASE("negative cache entries expire after the ttl", "[negative_cache]")
+{
+    negative_cache::Cache cache(std::chrono::milliseconds(1));
+    cache.add("gone", cache.generation("gone"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    CHECK_FALSE(cache.missing("gone"));
+    CHECK(cache.size() == 0);
+}
+
+TEST_CASE("negative cache never hides a name created concurrently", "[negative_cache]")
+{
+    negative_cache::Cache cache;
+    std::atomic<bool> exists{false};
+    std::atomic<bool> stop{false};
+
+    // Looks the name up over and over the way sn_getattr does
+    std::thread prober([&] {
+        while (!stop) {
+            uint64_t generation = cache.generation("dir/new");
+            if (!exists)
+                cache.add("dir/new", generation);
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    exists = true;
+    cache.forget("dir/new");
+    // From here on every add() either saw exists or started too early
+    for (int i = 0; i < 1000; ++i) {
+        CHECK_FALSE(cache.missing("dir/new"));
+        std::this_thread::yield();
+    }
+    stop = true;
+    prober.join();
+}
@@ -0,0 +1,203 @@
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "open_file.hpp"
+#include "scratch.hpp"
+
+using open_file::Inode;
+using open_file::LOCK_BLOCK_SIZE;
+
+namespace {
+
+// A lock on its own thread, held until the test lets it go
+class Waiter {
+public:
+    Waiter(Inode& inode, uint64_t off, uint64_t len, bool exclusive)
+        : thread_([this, &inode, off, len, exclusive] {
+              Inode::Guard g = inode.lock(off, len, exclusive);
+              granted_ = true;
+              while (!release_)
+                  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          })
+    {
+    }
+    ~Waiter()
+    {
+        release_ = true;
+        thread_.join();
+    }
+
+    // Whether it got the lock within a generous wait
+    bool granted()
+    {
+        for (int i = 0; i < 2000 && !granted_; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return granted_;
+    }
+
+    // Whether it is still waiting after a short while
+    bool blocked()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return !granted_;
+    }
+
+private:
+    std::atomic<bool> granted_{false};
+    std::atomic<bool> release_{false};
+    std::thread thread_;
+};
+
+} // namespace
+
+TEST_CASE("range locks on different blocks do not wait", "[open_file]")
+{
+    Inode inode(1, 1);
+    Inode::Guard held = inode.lock(0, LOCK_BLOCK_SIZE, true);
+
+    // The first byte past the held block
+    Waiter next(inode, LOCK_BLOCK_SIZE, 1, true);
+    CHECK(next.granted());
+    Waiter far(inode, 10 * LOCK_BLOCK_SIZE, 3 * LOCK_BLOCK_SIZE, true);
+    CHECK(far.granted());
+}
+
+TEST_CASE("range locks overlapping by one block wait", "[open_file]")
+{
+    // One file per waiter, so only the held block stands between them
+    Inode first(1, 1), second(1, 2);
+    std::optional<Inode::Guard> held_first, held_second;
+    held_first.emplace(first.lock(LOCK_BLOCK_SIZE, 1, true));
+    held_second.emplace(second.lock(LOCK_BLOCK_SIZE, 1, true));
+
+    // Ends on the first byte of the held block
+    Waiter before(first, 0, LOCK_BLOCK_SIZE + 1, true);
+    // Starts on its last byte
+    Waiter after(second, 2 * LOCK_BLOCK_SIZE - 1, LOCK_BLOCK_SIZE, false);
+    CHECK(before.blocked());
+    CHECK(after.blocked());
+
+    held_first.reset();
+    CHECK(before.granted());
+    CHECK(after.blocked());
+    held_second.reset();
+    CHECK(after.granted());
+}
+
+TEST_CASE("shared range locks only wait for exclusive ones", "[open_file]")
+{
+    Inode inode(1, 1);
+    std::optional<Inode::Guard> reader;
+    reader.emplace(inode.lock(0, 4 * LOCK_BLOCK_SIZE, false));
+
+    Waiter other_reader(inode, LOCK_BLOCK_SIZE, 1, false);
+    CHECK(other_reader.granted());
+
+    Waiter writer(inode, 2 * LOCK_BLOCK_SIZE, 1, true);
+    CHECK(writer.blocked());
+    reader.reset();
+    // The other reader still holds block 1, not block 2
+    CHECK(writer.granted());
+}
+
+TEST_CASE("lock_from leaves lower blocks alone", "[open_file]")
+{
+    Inode inode(1, 1);
+    std::optional<Inode::Guard> truncating;
+    truncating.emplace(inode.lock_from(3 * LOCK_BLOCK_SIZE + 10, true));
+
+    std::optional<Waiter> below;
+    below.emplace(inode, 0, 3 * LOCK_BLOCK_SIZE, true);
+    CHECK(below->granted());
+    Waiter at_end(inode, UINT64_MAX - 1, 1, false);
+    CHECK(at_end.blocked());
+    Waiter all(inode, 0, UINT64_MAX, false);
+    CHECK(all.blocked());
+
+    truncating.reset();
+    CHECK(at_end.granted());
+    // below still holds blocks 0-2 exclusively
+    CHECK(all.blocked());
+    below.reset();
+    CHECK(all.granted());
+}
+
+TEST_CASE("range lock ends are clamped, not wrapped", "[open_file]")
+{
+    Inode inode(1, 1);
+    // off + len overflows; the range must still end at the last block
+    Inode::Guard end = inode.lock(UINT64_MAX - 5, 100, true);
+    Waiter start(inode, 0, 1, true);
+    CHECK(start.granted());
+
+    // An empty range still locks the block holding off
+    std::optional<Inode::Guard> empty;
+    empty.emplace(inode.lock(5 * LOCK_BLOCK_SIZE, 0, true));
+    Waiter same(inode, 5 * LOCK_BLOCK_SIZE + 1, 1, true);
+    CHECK(same.blocked());
+    empty.reset();
+    CHECK(same.granted());
+}
+
+TEST_CASE("a moved range lock guard unlocks once", "[open_file]")
+{
+    Inode inode(1, 1);
+    std::optional<Inode::Guard> moved;
+    {
+        Inode::Guard g = inode.lock(0, 1, true);
+        moved.emplace(std::move(g));
+    }
+    Waiter waiter(inode, 0, 1, true);
+    CHECK(waiter.blocked());
+    moved.reset();
+    CHECK(waiter.granted());
+}
+
+TEST_CASE("one release wakes every waiter it unblocks", "[open_file]")
+{
+    Inode inode(1, 1);
+    std::optional<Inode::Guard> writer;
+    writer.emplace(inode.lock_all(true));
+
+    std::optional<Waiter> readers[4];
+    for (uint64_t i = 0; i < 4; ++i)
+        readers[i].emplace(inode, i * LOCK_BLOCK_SIZE, 1, false);
+    for (auto& r : readers)
+        CHECK(r->blocked());
+
+    writer.reset();
+    for (auto& r : readers)
+        CHECK(r->granted());
+}
+
+TEST_CASE("each sync reports the error of the sync that covered it", "[open_file]")
+{
+    Scratch s("open-file-sync");
+    int fd = ::open(s.path("note").c_str(), O_WRONLY | O_CREAT, 0600);
+    REQUIRE(fd != -1);
+    Inode inode(1, 1);
+
+    CHECK(inode.sync(-1, true) == EBADF);
+    // A failure is not handed on to the next caller
+    CHECK(inode.sync(fd, true) == 0);
+    CHECK(inode.sync(fd, false) == 0);
+
+    std::thread threads[4];
+    for (auto& t : threads)
+        t = std::thread([&] {
+            for (int i = 0; i < 50; ++i)
+                CHECK(inode.sync(fd, i % 2 == 0) == 0);
+        });
+    for (auto& t : threads)
+        t.join();
+    ::close(fd);
+}
@@ -0,0 +1,87 @@
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "scratch.hpp"
+#include "tar_manager.hpp"
+
+namespace {
+
+std::string read_file(const std::string& path)
+{
+    std::ifstream in(path);
+    std::stringstream out;
+    out << in.rdbuf();
+    return out.str();
+}
+
+// A snapshot holding one file, target, mounted lazily over restored/
+std::string mount(const Scratch& s, tar_manager::LazySnapshot& lazy)
+{
+    std::string data = s.path("data");
+    std::filesystem::create_directories(data);
+    std::ofstream(data + "/target") << "snapshot";
+    std::string snapshot;
+    REQUIRE(tar_manager::create_timestamped(data, snapshot));
+
+    std::string restored = s.path("restored");
+    std::filesystem::create_directories(restored);
+    REQUIRE(lazy.open(snapshot, restored));
+    return restored;
+}
+
+} // namespace
+
+TEST_CASE("a held pending file survives a replacement that failed", "[tar_manager]")
+{
+    Scratch s("tar-hold-failed");
+    tar_manager::LazySnapshot lazy;
+    std::string restored = mount(s, lazy);
+
+    REQUIRE(lazy.hold("target"));
+    // The rename onto it failed, so nothing replaced it
+    lazy.release("target", false);
+
+    tar_manager::Entry e;
+    REQUIRE(lazy.pending_entry("target", e));
+    REQUIRE(lazy.wait_for("target"));
+    CHECK(read_file(restored + "/target") == "snapshot");
+
+    // Restored files are no longer pending, so there is nothing to hold
+    CHECK_FALSE(lazy.hold("target"));
+    CHECK_FALSE(lazy.hold("missing"));
+}
+
+TEST_CASE("a held pending file is dropped once replaced", "[tar_manager]")
+{
+    Scratch s("tar-hold-replaced");
+    tar_manager::LazySnapshot lazy;
+    std::string restored = mount(s, lazy);
+
+    REQUIRE(lazy.hold("target"));
+    // A restore asked for meanwhile waits for the outcome rather than
+    // copying the snapshot file over what replaced it
+    std::atomic<bool> done{false};
+    std::thread reader([&] {
+        CHECK(lazy.wait_for("target"));
+        done = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK_FALSE(done);
+
+    std::ofstream(restored + "/target") << "renamed";
+    lazy.release("target", true);
+    reader.join();
+
+    tar_manager::Entry e;
+    CHECK_FALSE(lazy.pending_entry("target", e));
+    CHECK(read_file(restored + "/target") == "renamed");
+    CHECK(lazy.wait_all());
+    CHECK(read_file(restored + "/target") == "renamed");
+}
@@ -0,0 +1,176 @@
+#include <catch2/catch.hpp>
+
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include <sys/xattr.h>
+
+#include "scratch.hpp"
+#include "tar_manager.hpp"
+#include "xattr.hpp"
+
+namespace {
+
+void put_u32(std::string& out, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        out += static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+// The blob attribute of path, or "" if it has none
+std::string blob_of(const std::string& path)
+{
+    char buf[4096];
+    ssize_t len = ::lgetxattr(path.c_str(), xattr::BLOB_NAME, buf, sizeof(buf));
+    return len == -1 ? std::string() : std::string(buf, static_cast<size_t>(len));
+}
+
+// data/ holding one file and one directory with attributes, and one file
+// without; the snapshot goes next to it
+std::string make_data(const Scratch& s, const xattr::Attrs& attrs)
+{
+    std::string data = s.path("data");
+    std::filesystem::create_directories(data + "/dir");
+    std::ofstream(data + "/dir/note") << "hello";
+    std::ofstream(data + "/plain") << "plain";
+    std::string blob = xattr::encode(attrs);
+    REQUIRE(::lsetxattr((data + "/dir/note").c_str(), xattr::BLOB_NAME, blob.data(), blob.size(), 0) == 0);
+    REQUIRE(::lsetxattr((data + "/dir").c_str(), xattr::BLOB_NAME, blob.data(), blob.size(), 0) == 0);
+    return data;
+}
+
+} // namespace
+
+TEST_CASE("xattr blobs round-trip", "[xattr]")
+{
+    xattr::Attrs attrs{{"user.a", "1"}, {"security.selinux", std::string("x\0y", 3)}, {"trusted.empty", ""}};
+    xattr::Attrs back;
+    REQUIRE(xattr::decode(xattr::encode(attrs), back));
+    CHECK(back == attrs);
+
+    REQUIRE(xattr::decode(xattr::encode({}), back));
+    CHECK(back.empty());
+}
+
+TEST_CASE("malformed xattr blobs are rejected", "[xattr]")
+{
+    std::string good = xattr::encode({{"user.a", "value"}});
+    xattr::Attrs attrs;
+
+    // Every proper prefix is cut short somewhere
+    for (size_t len = 0; len < good.size(); ++len)
+        CHECK_FALSE(xattr::decode(good.substr(0, len), attrs));
+
+    CHECK_FALSE(xattr::decode(good + "x", attrs));
+
+    // A count or a length running past the end
+    std::string many;
+    put_u32(many, 0xffffffff);
+    CHECK_FALSE(xattr::decode(many, attrs));
+    std::string long_name;
+    put_u32(long_name, 1);
+    put_u32(long_name, 0xfffffff0);
+    long_name += "user.a";
+    CHECK_FALSE(xattr::decode(long_name, attrs));
+
+    char buf[16];
+    CHECK(xattr::get(good.substr(0, 6), "user.a", buf, sizeof(buf)) == -EIO);
+    CHECK(xattr::list("junk", buf, sizeof(buf)) == -EIO);
+}
+
+TEST_CASE("xattrs are answered from a blob", "[xattr]")
+{
+    std::string blob = xattr::encode({{"user.a", "value"}, {"user.b", ""}});
+    char buf[32];
+
+    CHECK(xattr::get(blob, "user.a", nullptr, 0) == 5);
+    REQUIRE(xattr::get(blob, "user.a", buf, sizeof(buf)) == 5);
+    CHECK(std::string(buf, 5) == "value");
+    CHECK(xattr::get(blob, "user.a", buf, 4) == -ERANGE);
+    CHECK(xattr::get(blob, "user.b", buf, sizeof(buf)) == 0);
+    CHECK(xattr::get(blob, "user.c", buf, sizeof(buf)) == -ENODATA);
+
+    REQUIRE(xattr::list(blob, buf, sizeof(buf)) == 14);
+    CHECK(std::string(buf, 14) == std::string("user.a\0user.b\0", 14));
+    CHECK(xattr::list(blob, buf, 13) == -ERANGE);
+
+    // No blob at all is a file without attributes
+    CHECK(xattr::get("", "user.a", buf, sizeof(buf)) == -ENODATA);
+    CHECK(xattr::list("", buf, sizeof(buf)) == 0);
+}
+
+TEST_CASE("xattrs survive an indexed snapshot and remount", "[xattr]")
+{
+    Scratch s("xattr-snfs");
+    xattr::Attrs attrs{{"user.tag", "draft"}, {"security.label", "notes"}};
+    std::string data = make_data(s, attrs);
+    std::string blob = blob_of(data + "/dir/note");
+    REQUIRE(!blob.empty());
+
+    std::string snapshot;
+    REQUIRE(tar_manager::create_timestamped(data, snapshot));
+
+    std::string restored = s.path("restored");
+    std::filesystem::create_directories(restored);
+    tar_manager::LazySnapshot lazy;
+    REQUIRE(lazy.open(snapshot, restored));
+
+    // Still only in the snapshot: the entry carries the attributes
+    tar_manager::Entry e;
+    REQUIRE(lazy.pending_entry("dir/note", e));
+    CHECK(e.xattrs == blob);
+    REQUIRE(lazy.pending_entry("plain", e));
+    CHECK(e.xattrs.empty());
+    CHECK(blob_of(restored + "/dir") == blob);
+
+    REQUIRE(lazy.wait_all());
+    CHECK(blob_of(restored + "/dir/note") == blob);
+    CHECK(blob_of(restored + "/plain").empty());
+}
+
+TEST_CASE("xattrs survive a delta", "[xattr]")
+{
+    Scratch s("xattr-delta");
+    std::string data = make_data(s, {{"user.tag", "draft"}});
+    std::string full;
+    REQUIRE(tar_manager::create_timestamped(data, full));
+
+    std::string blob = xattr::encode({{"user.tag", "final"}});
+    REQUIRE(::lsetxattr((data + "/plain").c_str(), xattr::BLOB_NAME, blob.data(), blob.size(), 0) == 0);
+    tar_manager::Change c;
+    c.path = "plain";
+    // Snapshot names are stamped to the millisecond
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    std::string delta;
+    REQUIRE(tar_manager::create_delta(data, full, {c}, delta));
+
+    std::string restored = s.path("restored");
+    std::filesystem::create_directories(restored);
+    tar_manager::LazySnapshot lazy;
+    REQUIRE(lazy.open(delta, restored));
+    tar_manager::Entry e;
+    REQUIRE(lazy.pending_entry("plain", e));
+    CHECK(e.xattrs == blob);
+    REQUIRE(lazy.pending_entry("dir/note", e));
+    CHECK(e.xattrs == xattr::encode({{"user.tag", "draft"}}));
+}
+
+TEST_CASE("xattrs survive a tar.gz snapshot", "[xattr]")
+{
+    Scratch s("xattr-tgz");
+    std::string data = make_data(s, {{"user.tag", "draft"}});
+    std::string blob = blob_of(data + "/dir/note");
+
+    std::string snapshot;
+    REQUIRE(tar_manager::create_timestamped(data, snapshot, tar_manager::Format::TarGz));
+
+    std::string restored = s.path("restored");
+    std::filesystem::create_directories(restored);
+    REQUIRE(tar_manager::extract(snapshot, restored));
+    CHECK(blob_of(restored + "/dir/note") == blob);
+    CHECK(blob_of(restored + "/dir") == blob);
+    CHECK(blob_of(restored + "/plain").empty());
+}